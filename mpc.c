@@ -1,5 +1,66 @@
+/* mmap, madvise and fileno are POSIX; ask for them even under -std=c99 */
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MPC_HAVE_MMAP 1
+#else
+#define MPC_HAVE_MMAP 0
+#endif
+
+/*
+** Character class scans are built for AVX2 and SSSE3 whatever
+** the compiler flags, and mpc_compile picks the widest one the
+** running CPU has.
+*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MPC_HAVE_SCAN 1
+#define MPC_TARGET(t) __attribute__((target(t)))
+#else
+#define MPC_HAVE_SCAN 0
+#endif
+
+/*
+** Allocator
+*/
+
+static void *(*mpc_malloc_fn)(size_t) = malloc;
+static void *(*mpc_calloc_fn)(size_t, size_t) = calloc;
+static void *(*mpc_realloc_fn)(void *, size_t) = realloc;
+static void (*mpc_free_fn)(void *) = free;
+
+void mpc_set_allocator(
+  void *(*malloc_fn)(size_t),
+  void *(*calloc_fn)(size_t, size_t),
+  void *(*realloc_fn)(void *, size_t),
+  void (*free_fn)(void *)) {
+  mpc_malloc_fn = malloc_fn;
+  mpc_calloc_fn = calloc_fn;
+  mpc_realloc_fn = realloc_fn;
+  mpc_free_fn = free_fn;
+}
+
+static void *mpc_hook_malloc(size_t n) { return mpc_malloc_fn(n); }
+static void *mpc_hook_calloc(size_t n, size_t m) { return mpc_calloc_fn(n, m); }
+static void *mpc_hook_realloc(void *p, size_t n) { return mpc_realloc_fn(p, n); }
+static void mpc_hook_free(void *p) { mpc_free_fn(p); }
+
+/*
+** The rest of this file calls the hooks under the usual names, both
+** directly and where free is passed as a destructor.
+*/
+#define malloc mpc_hook_malloc
+#define calloc mpc_hook_calloc
+#define realloc mpc_hook_realloc
+#define free mpc_hook_free
+
 /*
 ** State Type
 */
@@ -40,16 +101,26 @@ static mpc_state_t mpc_state_new(void) {
 ** memory but backtracking can still be achieved
 ** by seeking in the file at different positions.
 **
+** A File that is a regular file is instead
+** mapped into memory and becomes an Mmap input,
+** which behaves exactly like a String: the
+** mapping is followed by a zero byte, so the
+** cursor is a plain index and backtracking is
+** a pointer reset.
+**
 ** The final mode is Pipe. This is the difficult
 ** one. As we assume pipes cannot be seeked - and
 ** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
+** any point, every character read from the pipe
+** goes into a buffer that grows geometrically and
+** tracks its own length.
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer instead of the input. Once nothing is
+** marked before a position the bytes in front of
+** it are dropped from the buffer in bulk, so the
+** cost stays linear in the length of the input.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -60,7 +131,8 @@ static mpc_state_t mpc_state_new(void) {
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 2,
+  MPC_INPUT_MMAP   = 3
 };
 
 enum {
@@ -68,12 +140,70 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_BUFFER_MIN = 4096
+};
+
+/*
+** Small parse-time allocations come from a slab allocator
+** owned by the input. Objects are grouped into size classes
+** of 16 up to 256 bytes, each with its own free list. Slabs
+** are chunks aligned to their own size, so the chunk of any
+** pointer is found by masking and a lookup in a hash set of
+** owned chunks. Chunks are carved out of regions that double
+** in size and are all released together with the input.
+*/
+
+enum {
+  MPC_MEM_CHUNK_SHIFT = 14,
+  MPC_MEM_CHUNK_HEADER = 16,
+  MPC_MEM_CLASSES = 5,
+  MPC_MEM_CLASS_MAX = 256,
+  MPC_MEM_REGION_MIN = 4,
+  MPC_MEM_REGION_MAX = 256,
+  MPC_MEM_TABLE_MIN = 64
+};
+
+#define MPC_MEM_CHUNK ((size_t)1 << MPC_MEM_CHUNK_SHIFT)
+
+typedef struct mpc_mem_free_t {
+  struct mpc_mem_free_t *next;
+} mpc_mem_free_t;
+
+typedef struct {
+  char *next;
+  char *end;
+  mpc_mem_free_t *free;
+} mpc_mem_class_t;
+
+/*
+** Packrat entries record what a memoised parser did at a
+** position. A success is only kept once the same position
+** has been visited twice, so a grammar that never backtracks
+** over the rule never holds on to its output. Each reuse
+** asks the memo apply function for another reference to it;
+** mpca_memo shares the AST instead of copying it.
+*/
+
+enum {
+  MPC_MEMO_EMPTY   = 0,
+  MPC_MEMO_SEEN    = 1,
+  MPC_MEMO_SUCCESS = 2,
+  MPC_MEMO_FAILURE = 3
+};
+
+enum {
+  MPC_MEMO_SLOTS_MIN = 256
 };
 
 typedef struct {
-  char mem[64];
-} mpc_mem_t;
+  mpc_parser_t *p;
+  long pos;
+  int status;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_err_t *error;
+} mpc_memo_t;
 
 typedef struct {
 
@@ -83,8 +213,17 @@ typedef struct {
 
   char *string;
   char *buffer;
+  long buffer_start;
+  size_t buffer_num;
+  size_t buffer_slots;
   FILE *file;
 
+  char *mapping;
+  size_t mapping_len;
+
+  long length;
+  int owned;
+
   int suppress;
   int backtrack;
   int marks_slots;
@@ -94,13 +233,45 @@ typedef struct {
   char *lasts;
   char last;
 
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  mpc_mem_class_t mem_classes[MPC_MEM_CLASSES];
+  char *mem_spare;
+  size_t mem_spare_num;
+  size_t mem_region_chunks;
+  void **mem_regions;
+  size_t mem_regions_num;
+  size_t mem_regions_slots;
+  size_t *mem_table;
+  size_t mem_table_num;
+  size_t mem_table_slots;
+
+  mpc_memo_t *memo;
+  size_t memo_num;
+  size_t memo_slots;
 
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static void mpc_mem_init(mpc_input_t *i) {
+  memset(i->mem_classes, 0, sizeof(mpc_mem_class_t) * MPC_MEM_CLASSES);
+  i->mem_spare = NULL;
+  i->mem_spare_num = 0;
+  i->mem_region_chunks = MPC_MEM_REGION_MIN;
+  i->mem_regions = NULL;
+  i->mem_regions_num = 0;
+  i->mem_regions_slots = 0;
+  i->mem_table = NULL;
+  i->mem_table_num = 0;
+  i->mem_table_slots = 0;
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_slots = 0;
+}
+
+/*
+** String inputs read the caller's buffer in place and
+** never write to it. Reads past length see a zero byte,
+** so the buffer does not need to be terminated.
+*/
+static mpc_input_t *mpc_input_new_nstring_borrowed(const char *filename, const char *string, size_t length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
 
@@ -110,10 +281,16 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
 
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = (char*)string;
   i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
   i->file = NULL;
+  i->mapping = NULL;
+  i->mapping_len = 0;
+  i->length = (long)length;
+  i->owned = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -123,27 +300,41 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_mem_init(i);
+
+  return i;
+}
 
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  size_t length = strlen(string);
+  char *copy = malloc(length + 1);
+  mpc_input_t *i;
+  memcpy(copy, string, length + 1);
+  i = mpc_input_new_nstring_borrowed(filename, copy, length);
+  i->owned = 1;
   return i;
 }
 
-static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
+static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
 
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_STRING;
 
+  i->type = MPC_INPUT_PIPE;
   i->state = mpc_state_new();
 
-  i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
-  i->string[length] = '\0';
+  i->string = NULL;
   i->buffer = NULL;
-  i->file = NULL;
+  i->buffer_start = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->file = pipe;
+  i->mapping = NULL;
+  i->mapping_len = 0;
+  i->length = 0;
+  i->owned = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -153,26 +344,31 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_mem_init(i);
 
   return i;
 
 }
 
-static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
+static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
 
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-
-  i->type = MPC_INPUT_PIPE;
+  i->type = MPC_INPUT_FILE;
   i->state = mpc_state_new();
 
   i->string = NULL;
   i->buffer = NULL;
-  i->file = pipe;
+  i->buffer_start = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->file = file;
+  i->mapping = NULL;
+  i->mapping_len = 0;
+  i->length = 0;
+  i->owned = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -182,25 +378,62 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_mem_init(i);
 
   return i;
-
 }
 
-static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
+/*
+** Map the rest of a regular file, from offset onwards,
+** followed by a zero byte. Returns NULL when the file
+** cannot be mapped so callers can fall back to reading.
+*/
+static mpc_input_t *mpc_input_new_mmap(const char *filename, int fd, long offset) {
+#if MPC_HAVE_MMAP
 
-  mpc_input_t *i = malloc(sizeof(mpc_input_t));
+  mpc_input_t *i;
+  struct stat st;
+  size_t page, len, total;
+  char *base;
+
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { return NULL; }
+  if (offset < 0 || offset > st.st_size) { return NULL; }
+
+  /*
+  ** Reserve one extra zeroed page after the file so that the
+  ** byte at the end of the contents reads as the terminator,
+  ** then map the file over the start of the reservation.
+  */
+  page = (size_t)sysconf(_SC_PAGESIZE);
+  len = (size_t)st.st_size;
+  total = ((len + page - 1) / page) * page + page;
+
+  base = mmap(NULL, total, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) { return NULL; }
+  if (len > 0 && mmap(base, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(base, total);
+    return NULL;
+  }
+  madvise(base, len, MADV_SEQUENTIAL);
+
+  i = malloc(sizeof(mpc_input_t));
 
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_FILE;
+  i->type = MPC_INPUT_MMAP;
+
   i->state = mpc_state_new();
 
-  i->string = NULL;
+  i->string = base + offset;
   i->buffer = NULL;
-  i->file = file;
+  i->buffer_start = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->file = NULL;
+  i->mapping = base;
+  i->mapping_len = total;
+  i->length = (long)len - offset;
+  i->owned = 0;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -210,48 +443,158 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_mem_init(i);
 
   return i;
+
+#else
+  (void)filename; (void)fd; (void)offset;
+  return NULL;
+#endif
 }
 
+static mpc_dtor_t mpc_memo_dtor(mpc_parser_t *p);
+
 static void mpc_input_delete(mpc_input_t *i) {
+  long j;
+  size_t k;
 
   free(i->filename);
 
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  if (i->type == MPC_INPUT_STRING && i->owned) { free(i->string); }
+  if (i->type == MPC_INPUT_PIPE) {
+    /* Hand any read-ahead back to the stream for the next reader */
+    for (j = (long)i->buffer_num - 1; j >= i->state.pos - i->buffer_start && j >= 0; j--) {
+      ungetc(i->buffer[j], i->file);
+    }
+    free(i->buffer);
+  }
+#if MPC_HAVE_MMAP
+  if (i->type == MPC_INPUT_MMAP) { munmap(i->mapping, i->mapping_len); }
+#endif
+
+  for (k = 0; k < i->memo_slots; k++) {
+    if (i->memo[k].status == MPC_MEMO_SUCCESS) {
+      mpc_memo_dtor(i->memo[k].p)(i->memo[k].output);
+    }
+  }
+  free(i->memo);
+
+  for (k = 0; k < i->mem_regions_num; k++) { free(i->mem_regions[k]); }
+  free(i->mem_regions);
+  free(i->mem_table);
 
   free(i->marks);
   free(i->lasts);
   free(i);
 }
 
-static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+static size_t mpc_mem_hash(size_t key, size_t slots) {
+  return (key * 2654435761u) & (slots - 1);
+}
+
+static void mpc_mem_table_add(mpc_input_t *i, size_t key) {
+  size_t j, k, slots;
+  size_t *table;
+
+  if ((i->mem_table_num + 1) * 2 > i->mem_table_slots) {
+    slots = i->mem_table_slots ? i->mem_table_slots * 2 : MPC_MEM_TABLE_MIN;
+    table = calloc(slots, sizeof(size_t));
+    for (j = 0; j < i->mem_table_slots; j++) {
+      if (!i->mem_table[j]) { continue; }
+      k = mpc_mem_hash(i->mem_table[j], slots);
+      while (table[k]) { k = (k + 1) & (slots - 1); }
+      table[k] = i->mem_table[j];
+    }
+    free(i->mem_table);
+    i->mem_table = table;
+    i->mem_table_slots = slots;
+  }
+
+  k = mpc_mem_hash(key, i->mem_table_slots);
+  while (i->mem_table[k]) { k = (k + 1) & (i->mem_table_slots - 1); }
+  i->mem_table[k] = key;
+  i->mem_table_num++;
+}
+
+/* Returns the chunk holding p, or NULL if p is not from the pool */
+static char *mpc_mem_chunk(mpc_input_t *i, void *p) {
+  size_t key, k;
+
+  if (!p || !i->mem_table) { return NULL; }
+
+  key = (size_t)p >> MPC_MEM_CHUNK_SHIFT;
+  k = mpc_mem_hash(key, i->mem_table_slots);
+  while (i->mem_table[k]) {
+    if (i->mem_table[k] == key) { return (char*)(key << MPC_MEM_CHUNK_SHIFT); }
+    k = (k + 1) & (i->mem_table_slots - 1);
+  }
+  return NULL;
+}
+
+static size_t mpc_mem_class_size(size_t c) {
+  return (size_t)16 << c;
+}
+
+static char *mpc_mem_chunk_new(mpc_input_t *i, size_t c) {
+  char *region, *chunk;
+  size_t n;
+
+  if (i->mem_spare_num == 0) {
+
+    n = i->mem_region_chunks;
+    region = malloc((n + 1) * MPC_MEM_CHUNK);
+    if (!region) { return NULL; }
+
+    if (i->mem_regions_num == i->mem_regions_slots) {
+      i->mem_regions_slots = i->mem_regions_slots ? i->mem_regions_slots * 2 : 8;
+      i->mem_regions = realloc(i->mem_regions, sizeof(void*) * i->mem_regions_slots);
+    }
+    i->mem_regions[i->mem_regions_num++] = region;
+
+    i->mem_spare = (char*)((((size_t)region + MPC_MEM_CHUNK - 1) >> MPC_MEM_CHUNK_SHIFT) << MPC_MEM_CHUNK_SHIFT);
+    i->mem_spare_num = n;
+
+    if (i->mem_region_chunks < MPC_MEM_REGION_MAX) { i->mem_region_chunks *= 2; }
+  }
+
+  chunk = i->mem_spare;
+  i->mem_spare += MPC_MEM_CHUNK;
+  i->mem_spare_num--;
+
+  *(size_t*)chunk = c;
+  mpc_mem_table_add(i, (size_t)chunk >> MPC_MEM_CHUNK_SHIFT);
+
+  i->mem_classes[c].next = chunk + MPC_MEM_CHUNK_HEADER;
+  i->mem_classes[c].end = chunk + MPC_MEM_CHUNK;
+  return chunk;
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
+  size_t c, size;
+  mpc_mem_class_t *k;
   char *p;
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  if (n > MPC_MEM_CLASS_MAX) { return malloc(n); }
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  c = 0;
+  while (mpc_mem_class_size(c) < n) { c++; }
+  size = mpc_mem_class_size(c);
+  k = &i->mem_classes[c];
+
+  if (k->free) {
+    p = (char*)k->free;
+    k->free = k->free->next;
+    return p;
+  }
+
+  if (!k->next || k->next + size > k->end) {
+    if (!mpc_mem_chunk_new(i, c)) { return malloc(n); }
+  }
 
-  return malloc(n);
+  p = k->next;
+  k->next += size;
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -261,33 +604,39 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  mpc_mem_free_t *f;
+  char *chunk = mpc_mem_chunk(i, p);
+  if (!chunk) { free(p); return; }
+  f = p;
+  f->next = i->mem_classes[*(size_t*)chunk].free;
+  i->mem_classes[*(size_t*)chunk].free = f;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
   char *q = NULL;
+  char *chunk = mpc_mem_chunk(i, p);
+  size_t size;
 
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
+  if (!chunk) { return realloc(p, n); }
 
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
-    return q;
-  }
+  size = mpc_mem_class_size(*(size_t*)chunk);
+  if (n <= size) { return p; }
 
-  return p;
+  q = mpc_malloc(i, n);
+  memcpy(q, p, size);
+  mpc_free(i, p);
+  return q;
 }
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
+  char *chunk = mpc_mem_chunk(i, p);
+  size_t size;
+  if (!chunk) { return p; }
+  size = mpc_mem_class_size(*(size_t*)chunk);
+  q = malloc(size);
+  memcpy(q, p, size);
   mpc_free(i, p);
   return q;
 }
@@ -298,6 +647,49 @@ static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 static void mpc_input_suppress_disable(mpc_input_t *i) { i->suppress--; }
 static void mpc_input_suppress_enable(mpc_input_t *i) { i->suppress++; }
 
+/*
+** Drop the buffered pipe bytes that no mark can rewind
+** to. Only done once they make up at least half of the
+** buffer so each byte is moved a bounded number of times.
+*/
+static void mpc_input_buffer_release(mpc_input_t *i) {
+  long keep = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+  size_t drop = (size_t)(keep - i->buffer_start);
+
+  if (drop < MPC_INPUT_BUFFER_MIN || drop < i->buffer_num / 2) { return; }
+
+  memmove(i->buffer, i->buffer + drop, i->buffer_num - drop);
+  i->buffer_num -= drop;
+  i->buffer_start = keep;
+}
+
+/*
+** Read from the pipe until the byte at the current
+** position is buffered. Returns 0 at the end of input.
+*/
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+  int c;
+
+  while (i->state.pos >= i->buffer_start + (long)i->buffer_num) {
+
+    c = getc(i->file);
+    if (c == EOF) { return 0; }
+
+    if (i->buffer_num == i->buffer_slots) {
+      mpc_input_buffer_release(i);
+    }
+
+    if (i->buffer_num == i->buffer_slots) {
+      i->buffer_slots = i->buffer_slots ? i->buffer_slots * 2 : MPC_INPUT_BUFFER_MIN;
+      i->buffer = realloc(i->buffer, i->buffer_slots);
+    }
+
+    i->buffer[i->buffer_num++] = (char)c;
+  }
+
+  return 1;
+}
+
 static void mpc_input_mark(mpc_input_t *i) {
 
   if (i->backtrack < 1) { return; }
@@ -313,14 +705,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -336,11 +723,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
   }
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
+    mpc_input_buffer_release(i);
   }
 
 }
@@ -359,12 +742,14 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
-}
+static void mpc_input_restore(mpc_input_t *i, mpc_state_t s, char last) {
 
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  i->state = s;
+  i->last  = last;
+
+  if (i->type == MPC_INPUT_FILE) {
+    fseek(i->file, i->state.pos, SEEK_SET);
+  }
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
@@ -373,19 +758,12 @@ static char mpc_input_getc(mpc_input_t *i) {
 
   switch (i->type) {
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
-
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+      if (!mpc_input_buffer_fill(i)) { return '\0'; }
+      return i->buffer[i->state.pos - i->buffer_start];
 
     default: return c;
   }
@@ -396,7 +774,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
 
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE:
 
       c = fgetc(i->file);
@@ -406,22 +785,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
       return c;
 
     case MPC_INPUT_PIPE:
-
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+      if (!mpc_input_buffer_fill(i)) { return '\0'; }
+      return i->buffer[i->state.pos - i->buffer_start];
 
     default: return c;
   }
@@ -435,32 +800,18 @@ static int mpc_input_terminated(mpc_input_t *i) {
 static int mpc_input_failure(mpc_input_t *i, char c) {
 
   switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP:
+    case MPC_INPUT_PIPE: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
     default: { break; }
   }
+  (void)c;
   return 0;
 }
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
@@ -500,18 +851,29 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x;
-  if (mpc_input_terminated(i)) { return 0; }
-  x = mpc_input_getc(i);
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+/*
+** The sets of oneof and noneof are 256 bit bitmaps with a bit
+** for each character, built to agree with strchr on the set
+** string.
+*/
+
+static void mpc_set_build(unsigned char *set, const char *s, int none) {
+  int c;
+  memset(set, 0, 32);
+  for (c = 0; c < 256; c++) {
+    if ((strchr(s, (char)c) == 0) == none) { set[c >> 3] |= (unsigned char)(1 << (c & 7)); }
+  }
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_set_has(const unsigned char *set, char c) {
+  return (set[(unsigned char)c >> 3] >> ((unsigned char)c & 7)) & 1;
+}
+
+static int mpc_input_set(mpc_input_t *i, const unsigned char *set, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return mpc_set_has(set, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -521,6 +883,27 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   return cond(x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
+/*
+** Consumes a run of characters read straight from a string or
+** mapping, with the same effect on the state as consuming them
+** one at a time.
+*/
+
+static void mpc_input_advance(mpc_input_t *i, const char *x, size_t n) {
+
+  const char *nl, *end = x + n;
+
+  if (n == 0) { return; }
+
+  i->state.pos += (long)n;
+  i->state.col += (long)n;
+  for (nl = memchr(x, '\n', n); nl; nl = memchr(nl + 1, '\n', (size_t)(end - nl - 1))) {
+    i->state.row++;
+    i->state.col = (long)(end - nl - 1);
+  }
+  i->last = end[-1];
+}
+
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
 
   const char *x = c;
@@ -871,13 +1254,54 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   return y;
 }
 
+/*
+** When one error is missing or lies strictly further into
+** the input than the other, merging would only produce a
+** copy of it, so it is returned as is.
+*/
 static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   mpc_err_t *errs[2];
+  if (x == NULL) { return y; }
+  if (y == NULL) { return x; }
+  if (x->state.pos > y->state.pos) { mpc_err_delete_internal(i, y); return x; }
+  if (y->state.pos > x->state.pos) { mpc_err_delete_internal(i, x); return y; }
   errs[0] = x;
   errs[1] = y;
   return mpc_err_or(i, errs, 2);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+
+  int j;
+  mpc_err_t *y;
+
+  if (x == NULL) { return NULL; }
+
+  y = mpc_malloc(i, sizeof(mpc_err_t));
+  y->state = x->state;
+  y->received = x->received;
+  y->filename = mpc_malloc(i, strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = mpc_malloc(i, strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+
+  y->expected_num = x->expected_num;
+  y->expected = NULL;
+  if (x->expected_num > 0) {
+    y->expected = mpc_malloc(i, sizeof(char*) * x->expected_num);
+    for (j = 0; j < x->expected_num; j++) {
+      y->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+      strcpy(y->expected[j], x->expected[j]);
+    }
+  }
+
+  return y;
+}
+
 /*
 ** Parser Type
 */
@@ -918,7 +1342,9 @@ enum {
   MPC_TYPE_SOI        = 27,
   MPC_TYPE_EOI        = 28,
 
-  MPC_TYPE_SEPBY1     = 29
+  MPC_TYPE_SEPBY1     = 29,
+
+  MPC_TYPE_MEMO       = 30
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -929,6 +1355,7 @@ typedef struct { char x; } mpc_pdata_single_t;
 typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
 typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; unsigned char set[32]; } mpc_pdata_set_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_pdata_check_t;
@@ -939,6 +1366,7 @@ typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdat
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_parser_t *sep; } mpc_pdata_sepby1;
+typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_apply_t cx; } mpc_pdata_memo_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -949,6 +1377,7 @@ typedef union {
   mpc_pdata_range_t range;
   mpc_pdata_satisfy_t satisfy;
   mpc_pdata_string_t string;
+  mpc_pdata_set_t set;
   mpc_pdata_apply_t apply;
   mpc_pdata_apply_to_t apply_to;
   mpc_pdata_check_t check;
@@ -959,13 +1388,17 @@ typedef union {
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
   mpc_pdata_sepby1 sepby1;
+  mpc_pdata_memo_t memo;
 } mpc_pdata_t;
 
+struct mpc_program_t;
+
 struct mpc_parser_t {
   char *name;
   mpc_pdata_t data;
   char type;
   char retained;
+  struct mpc_program_t *program;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -1012,337 +1445,1985 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   return f(j, xs);
 }
 
-static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
-  mpc_free(i, x);
-  return NULL;
+static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
+  mpc_free(i, x);
+  return NULL;
+}
+
+static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
+  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_free(i, c);
+  return a;
+}
+
+static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
+  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
+  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  return f(mpc_export(i, x));
+}
+
+static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  return f(mpc_export(i, x), d);
+}
+
+static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
+  if (d == free) { mpc_free(i, x); return; }
+  d(mpc_export(i, x));
+}
+
+static mpc_dtor_t mpc_memo_dtor(mpc_parser_t *p) { return p->data.memo.dx; }
+
+static size_t mpc_memo_hash(mpc_parser_t *p, long pos, size_t slots) {
+  return ((((size_t)p) >> 4) * 31 + (size_t)pos * 2654435761u) & (slots - 1);
+}
+
+static mpc_memo_t *mpc_memo_find(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  size_t k;
+  if (i->memo_slots == 0) { return NULL; }
+  k = mpc_memo_hash(p, pos, i->memo_slots);
+  while (i->memo[k].status != MPC_MEMO_EMPTY) {
+    if (i->memo[k].p == p && i->memo[k].pos == pos) { return &i->memo[k]; }
+    k = (k + 1) & (i->memo_slots - 1);
+  }
+  return NULL;
+}
+
+static mpc_memo_t *mpc_memo_add(mpc_input_t *i, mpc_parser_t *p, long pos) {
+
+  size_t j, k, slots;
+  mpc_memo_t *memo;
+
+  if ((i->memo_num + 1) * 2 > i->memo_slots) {
+    slots = i->memo_slots ? i->memo_slots * 2 : MPC_MEMO_SLOTS_MIN;
+    memo = calloc(slots, sizeof(mpc_memo_t));
+    for (j = 0; j < i->memo_slots; j++) {
+      if (i->memo[j].status == MPC_MEMO_EMPTY) { continue; }
+      k = mpc_memo_hash(i->memo[j].p, i->memo[j].pos, slots);
+      while (memo[k].status != MPC_MEMO_EMPTY) { k = (k + 1) & (slots - 1); }
+      memo[k] = i->memo[j];
+    }
+    free(i->memo);
+    i->memo = memo;
+    i->memo_slots = slots;
+  }
+
+  k = mpc_memo_hash(p, pos, i->memo_slots);
+  while (i->memo[k].status != MPC_MEMO_EMPTY) { k = (k + 1) & (i->memo_slots - 1); }
+  i->memo[k].p = p;
+  i->memo[k].pos = pos;
+  i->memo[k].status = MPC_MEMO_SEEN;
+  i->memo[k].output = NULL;
+  i->memo[k].error = NULL;
+  i->memo_num++;
+  return &i->memo[k];
+}
+
+/*
+** The parse engine is iterative. Every parser being run
+** owns a frame on an explicit stack, and calling a child
+** parser pushes a frame for it and records the stage to
+** resume at. When a frame finishes its result is left in
+** `x` and `ok` for the frame below, so nesting depth is
+** bounded by the size of the stack rather than the C stack.
+**
+** Results a frame collects for folding go on a second
+** stack shared by all frames, starting at the frame's base.
+*/
+
+enum {
+  MPC_PARSE_FRAMES_MIN = 64,
+  MPC_PARSE_RESULTS_MIN = 64
+};
+
+typedef struct {
+  mpc_parser_t *p;
+  int stage;
+  int j;
+  long pos;
+  size_t base;
+} mpc_frame_t;
+
+typedef struct {
+  mpc_frame_t *frames;
+  size_t frames_num;
+  size_t frames_slots;
+  mpc_result_t *results;
+  size_t results_num;
+  size_t results_slots;
+} mpc_stack_t;
+
+static size_t mpc_parse_stack_max = (size_t)256 * 1024 * 1024;
+
+void mpc_set_parse_stack_limit(size_t bytes) {
+  mpc_parse_stack_max = bytes;
+}
+
+static void mpc_stack_add_result(mpc_stack_t *s, mpc_frame_t *f, mpc_result_t x) {
+  if (s->results_num == s->results_slots) {
+    s->results_slots *= 2;
+    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
+  }
+  s->results[s->results_num++] = x;
+  f->j++;
+}
+
+static mpc_result_t *mpc_stack_results(mpc_stack_t *s, mpc_frame_t *f) {
+  return s->results + f->base;
+}
+
+static mpc_val_t *mpc_stack_fold(mpc_input_t *i, mpc_stack_t *s, mpc_frame_t *f, mpc_fold_t g) {
+  return mpc_parse_fold(i, g, f->j, (mpc_val_t**)mpc_stack_results(s, f));
+}
+
+#define MPC_SUCCESS(v) x->output = (v); return 1
+#define MPC_FAILURE(v) x->error = (v); return 0
+#define MPC_PRIMITIVE(c) \
+  if (c) { MPC_SUCCESS(x->output); } \
+  else { MPC_FAILURE(NULL); }
+
+/*
+** Parsers without children run straight away when they
+** are called rather than getting a frame of their own.
+*/
+static int mpc_parse_leaf(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *x) {
+
+  switch (p->type) {
+
+    /* Basic Parsers */
+
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&x->output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&x->output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&x->output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_set(i, p->data.set.set, (char**)&x->output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_set(i, p->data.set.set, (char**)&x->output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&x->output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&x->output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&x->output));
+    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&x->output));
+    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&x->output));
+
+    /* Other parsers */
+
+    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+
+    default: MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  }
+}
+
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+
+#define MPC_SUCCESS(v) do { x.output = (v); ok = 1; goto pop; } while (0)
+#define MPC_FAILURE(v) do { x.error = (v); ok = 0; goto pop; } while (0)
+#define MPC_RETURN()   goto pop
+#define MPC_LEAF(q) \
+  (((q)->type < MPC_TYPE_APPLY && (q)->type != MPC_TYPE_EXPECT) \
+  || (q)->type == MPC_TYPE_SOI || (q)->type == MPC_TYPE_EOI)
+#define MPC_CALL(q, s, l) do { \
+  f->stage = (s); q_next = (q); \
+  if (MPC_LEAF(q_next)) { ok = mpc_parse_leaf(i, q_next, &x); goto l; } \
+  goto push; } while (0)
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *root, mpc_result_t *r, mpc_err_t **e) {
+
+  int k, ok = 0;
+  mpc_stack_t s;
+  mpc_frame_t *f;
+  mpc_parser_t *p, *q_next = root;
+  mpc_memo_t *m;
+  mpc_result_t x;
+  mpc_result_t *results;
+
+  x.output = NULL;
+  s.frames_num = 0;
+  s.frames_slots = MPC_PARSE_FRAMES_MIN;
+  s.frames = malloc(sizeof(mpc_frame_t) * s.frames_slots);
+  s.results_num = 0;
+  s.results_slots = MPC_PARSE_RESULTS_MIN;
+  s.results = malloc(sizeof(mpc_result_t) * s.results_slots);
+
+  goto push;
+
+  while (1) {
+
+    f = &s.frames[s.frames_num-1];
+    p = f->p;
+
+    switch (p->type) {
+
+      /* Application Parsers */
+
+      case MPC_TYPE_APPLY:
+      resume_apply:
+        if (f->stage == 0) { MPC_CALL(p->data.apply.x, 1, resume_apply); }
+        if (ok) { MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, x.output)); }
+        MPC_RETURN();
+
+      case MPC_TYPE_APPLY_TO:
+      resume_apply_to:
+        if (f->stage == 0) { MPC_CALL(p->data.apply_to.x, 1, resume_apply_to); }
+        if (ok) { MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, x.output, p->data.apply_to.d)); }
+        MPC_RETURN();
+
+      case MPC_TYPE_CHECK:
+      resume_check:
+        if (f->stage == 0) { MPC_CALL(p->data.check.x, 1, resume_check); }
+        if (!ok) { MPC_RETURN(); }
+        if (p->data.check.f(&x.output)) { MPC_SUCCESS(x.output); }
+        mpc_parse_dtor(i, p->data.check.dx, x.output);
+        MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
+
+      case MPC_TYPE_CHECK_WITH:
+      resume_check_with:
+        if (f->stage == 0) { MPC_CALL(p->data.check_with.x, 1, resume_check_with); }
+        if (!ok) { MPC_RETURN(); }
+        if (p->data.check_with.f(&x.output, p->data.check_with.d)) { MPC_SUCCESS(x.output); }
+        mpc_parse_dtor(i, p->data.check_with.dx, x.output);
+        MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
+
+      case MPC_TYPE_EXPECT:
+      resume_expect:
+        if (f->stage == 0) {
+          mpc_input_suppress_enable(i);
+          MPC_CALL(p->data.expect.x, 1, resume_expect);
+        }
+        mpc_input_suppress_disable(i);
+        if (ok) { MPC_SUCCESS(x.output); }
+        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+
+      case MPC_TYPE_PREDICT:
+      resume_predict:
+        if (f->stage == 0) {
+          mpc_input_backtrack_disable(i);
+          MPC_CALL(p->data.predict.x, 1, resume_predict);
+        }
+        mpc_input_backtrack_enable(i);
+        MPC_RETURN();
+
+      /* Optional Parsers */
+
+      /* TODO: Update Not Error Message */
+
+      case MPC_TYPE_NOT:
+      resume_not:
+        if (f->stage == 0) {
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          MPC_CALL(p->data.not.x, 1, resume_not);
+        }
+        if (ok) {
+          mpc_input_rewind(i);
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, p->data.not.dx, x.output);
+          MPC_FAILURE(mpc_err_new(i, "opposite"));
+        }
+        mpc_input_unmark(i);
+        mpc_input_suppress_disable(i);
+        MPC_SUCCESS(p->data.not.lf());
+
+      case MPC_TYPE_MAYBE:
+      resume_maybe:
+        if (f->stage == 0) { MPC_CALL(p->data.not.x, 1, resume_maybe); }
+        if (ok) { MPC_SUCCESS(x.output); }
+        *e = mpc_err_merge(i, *e, x.error);
+        MPC_SUCCESS(p->data.not.lf());
+
+      /* Repeat Parsers */
+
+      case MPC_TYPE_MANY:
+      resume_many:
+        if (f->stage == 0) { MPC_CALL(p->data.repeat.x, 1, resume_many); }
+        if (ok) {
+          mpc_stack_add_result(&s, f, x);
+          MPC_CALL(p->data.repeat.x, 1, resume_many);
+        }
+        *e = mpc_err_merge(i, *e, x.error);
+        MPC_SUCCESS(mpc_stack_fold(i, &s, f, p->data.repeat.f));
+
+      case MPC_TYPE_MANY1:
+      resume_many1:
+        if (f->stage == 0) { MPC_CALL(p->data.repeat.x, 1, resume_many1); }
+        if (ok) {
+          mpc_stack_add_result(&s, f, x);
+          MPC_CALL(p->data.repeat.x, 1, resume_many1);
+        }
+        if (f->j == 0) { MPC_FAILURE(mpc_err_many1(i, x.error)); }
+        *e = mpc_err_merge(i, *e, x.error);
+        MPC_SUCCESS(mpc_stack_fold(i, &s, f, p->data.repeat.f));
+
+      case MPC_TYPE_SEPBY1:
+      resume_sepby1:
+        if (f->stage == 0) { MPC_CALL(p->data.sepby1.x, 1, resume_sepby1); }
+        if (f->stage == 1 && !ok) { MPC_FAILURE(mpc_err_many1(i, x.error)); }
+        if (f->stage == 2 && ok) { MPC_CALL(p->data.sepby1.x, 3, resume_sepby1); }
+        if (f->stage != 2 && ok) {
+          mpc_stack_add_result(&s, f, x);
+          MPC_CALL(p->data.sepby1.sep, 2, resume_sepby1);
+        }
+        *e = mpc_err_merge(i, *e, x.error);
+        MPC_SUCCESS(mpc_stack_fold(i, &s, f, p->data.sepby1.f));
+
+      case MPC_TYPE_COUNT:
+      resume_count:
+        if (f->stage == 0) { MPC_CALL(p->data.repeat.x, 1, resume_count); }
+        if (ok) {
+          mpc_stack_add_result(&s, f, x);
+          if (f->j == p->data.repeat.n) { MPC_SUCCESS(mpc_stack_fold(i, &s, f, p->data.repeat.f)); }
+          MPC_CALL(p->data.repeat.x, 1, resume_count);
+        }
+        results = mpc_stack_results(&s, f);
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+        }
+        MPC_FAILURE(mpc_err_count(i, x.error, p->data.repeat.n));
+
+      /* Combinatory Parsers */
+
+      case MPC_TYPE_OR:
+      resume_or:
+        if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+        if (f->stage == 1) {
+          if (ok) { MPC_SUCCESS(x.output); }
+          *e = mpc_err_merge(i, *e, x.error);
+          f->j++;
+        }
+        if (f->j < p->data.or.n) { MPC_CALL(p->data.or.xs[f->j], 1, resume_or); }
+        MPC_FAILURE(NULL);
+
+      case MPC_TYPE_AND:
+      resume_and:
+        if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+        if (f->stage == 0) {
+          mpc_input_mark(i);
+          MPC_CALL(p->data.and.xs[0], 1, resume_and);
+        }
+        if (!ok) {
+          mpc_input_rewind(i);
+          results = mpc_stack_results(&s, f);
+          for (k = 0; k < f->j; k++) {
+            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+          }
+          MPC_RETURN();
+        }
+        mpc_stack_add_result(&s, f, x);
+        if (f->j < p->data.and.n) { MPC_CALL(p->data.and.xs[f->j], 1, resume_and); }
+        mpc_input_unmark(i);
+        MPC_SUCCESS(mpc_stack_fold(i, &s, f, p->data.and.f));
+
+      /* Memoised Parsers */
+
+      case MPC_TYPE_MEMO:
+      resume_memo:
+
+        if (f->stage == 0) {
+
+          if (i->backtrack < 1) { MPC_CALL(p->data.memo.x, 2, resume_memo); }
+
+          f->pos = i->state.pos;
+          m = mpc_memo_find(i, p, f->pos);
+
+          if (m && m->status == MPC_MEMO_SUCCESS) {
+            mpc_input_restore(i, m->state, m->last);
+            MPC_SUCCESS(p->data.memo.cx(m->output));
+          }
+
+          if (m && m->status == MPC_MEMO_FAILURE) {
+            MPC_FAILURE(mpc_err_copy(i, m->error));
+          }
+
+          MPC_CALL(p->data.memo.x, 1, resume_memo);
+        }
+
+        if (f->stage == 2) { MPC_RETURN(); }
+
+        m = mpc_memo_find(i, p, f->pos);
+        if (ok) {
+          if (!m) {
+            mpc_memo_add(i, p, f->pos);
+          } else {
+            x.output = mpc_export(i, x.output);
+            m->status = MPC_MEMO_SUCCESS;
+            m->state = i->state;
+            m->last = i->last;
+            m->output = p->data.memo.cx(x.output);
+          }
+        } else {
+          if (!m) { m = mpc_memo_add(i, p, f->pos); }
+          m->status = MPC_MEMO_FAILURE;
+          m->error = mpc_err_copy(i, x.error);
+        }
+        MPC_RETURN();
+
+      /* End */
+
+      default:
+
+        MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    }
+
+  push:
+
+    if (MPC_LEAF(q_next)) {
+      ok = mpc_parse_leaf(i, q_next, &x);
+      if (s.frames_num == 0) { break; }
+      continue;
+    }
+
+    if (s.frames_num == s.frames_slots) {
+      if (sizeof(mpc_frame_t) * s.frames_slots * 2 > mpc_parse_stack_max) {
+        x.error = mpc_err_fail(i, "Maximum parse stack size exceeded!");
+        ok = 0;
+        continue;
+      }
+      s.frames_slots *= 2;
+      s.frames = realloc(s.frames, sizeof(mpc_frame_t) * s.frames_slots);
+    }
+
+    f = &s.frames[s.frames_num++];
+    f->p = q_next;
+    f->stage = 0;
+    f->j = 0;
+    f->base = s.results_num;
+    continue;
+
+  pop:
+
+    s.results_num = f->base;
+    if (--s.frames_num == 0) { break; }
+  }
+
+  free(s.frames);
+  free(s.results);
+  *r = x;
+  return ok;
+}
+
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_RETURN
+#undef MPC_LEAF
+#undef MPC_CALL
+
+/*
+** Compiled Parsers
+**
+** mpc_compile lowers the parser graph below a parser into a
+** flat array of instructions, one per parser node, with the
+** children resolved to instruction pointers and the parser
+** data copied in. An expect wrapped directly around a parser
+** without children becomes a single instruction.
+**
+** Programs run on frame and result stacks like the engine
+** above, but a frame records the address to resume
+** at instead of a stage, and dispatch is a computed goto on
+** compilers that support it and a switch on those that don't.
+*/
+
+/*
+** Label addresses are a GNU extension, so the VM turns off
+** -Wpedantic around itself rather than warning at every
+** dispatch under -std=c89 -pedantic.
+*/
+
+#if defined(__GNUC__)
+#define MPC_HAVE_COMPUTED_GOTO 1
+#else
+#define MPC_HAVE_COMPUTED_GOTO 0
+#endif
+
+enum {
+  MPC_VM_APPLY,   MPC_VM_APPLY_TO, MPC_VM_CHECK, MPC_VM_CHECK_WITH,
+  MPC_VM_EXPECT,  MPC_VM_PREDICT,  MPC_VM_NOT,   MPC_VM_MAYBE,
+  MPC_VM_MANY,    MPC_VM_MANY1,    MPC_VM_SEPBY1, MPC_VM_COUNT,
+  MPC_VM_OR,      MPC_VM_AND,      MPC_VM_MEMO,
+
+  MPC_VM_APPLY_1,  MPC_VM_APPLY_TO_1, MPC_VM_CHECK_1,  MPC_VM_CHECK_WITH_1,
+  MPC_VM_EXPECT_1, MPC_VM_PREDICT_1,  MPC_VM_NOT_1,    MPC_VM_MAYBE_1,
+  MPC_VM_MANY_1,   MPC_VM_MANY1_1,    MPC_VM_SEPBY1_1, MPC_VM_SEPBY1_2,
+  MPC_VM_SEPBY1_3, MPC_VM_COUNT_1,    MPC_VM_OR_1,     MPC_VM_OR_2,
+  MPC_VM_OR_3,     MPC_VM_AND_1,      MPC_VM_MEMO_1,   MPC_VM_MEMO_2,
+  MPC_VM_DONE
+};
+
+enum {
+  MPC_INST_NODE        = 0,
+  MPC_INST_LEAF        = 1,
+  MPC_INST_EXPECT_LEAF = 2,
+  MPC_INST_SPAN        = 3
+};
+
+/*
+** Regular expressions and the other parsers that only fold
+** characters into a string are compiled to spans. What such
+** a parser returns is exactly the characters it consumed, so
+** a span is matched without building any output, testing
+** each character class against a bitmap, and the characters
+** are copied out in one allocation at the end. Choices,
+** repeats and errors run as they would in the program.
+*/
+
+enum {
+  MPC_SPAN_NONE,   MPC_SPAN_CLASS, MPC_SPAN_STRING, MPC_SPAN_LIFT,
+  MPC_SPAN_EXPECT, MPC_SPAN_MAYBE, MPC_SPAN_MANY,   MPC_SPAN_MANY1,
+  MPC_SPAN_COUNT,  MPC_SPAN_OR,    MPC_SPAN_AND
+};
+
+/*
+** A step of an or dispatch plan either runs an alternative,
+** merges in the errors of the alternatives it skips, or ends
+** the plan.
+*/
+
+enum {
+  MPC_STEP_END   = -2,
+  MPC_STEP_MERGE = -1
+};
+
+typedef struct {
+  int k;
+  int expected_num;
+  char **expected;
+} mpc_step_t;
+
+typedef struct mpc_inst_t mpc_inst_t;
+
+struct mpc_inst_t {
+  int op;
+  int leaf;
+  mpc_pdata_t data;
+  mpc_parser_t *p;
+  mpc_inst_t *x;
+  mpc_inst_t *sep;
+  mpc_inst_t **xs;
+  char *expected;
+  unsigned char first[32];
+  int nullable;
+  mpc_step_t **dispatch;
+  int span;
+  mpc_inst_t *scan;
+  size_t (*scan_fn)(mpc_inst_t*, const char*, size_t);
+  unsigned char nibbles[16];
+  int high;
+};
+
+typedef struct mpc_program_t {
+  mpc_inst_t *insts;
+  int insts_num;
+  mpc_inst_t **xs;
+  void **blocks;
+  int blocks_num;
+  int blocks_slots;
+} mpc_program_t;
+
+#if MPC_HAVE_COMPUTED_GOTO
+typedef const void *mpc_vm_resume_t;
+#else
+typedef int mpc_vm_resume_t;
+#endif
+
+typedef struct {
+  mpc_inst_t *ins;
+  mpc_vm_resume_t resume;
+  mpc_step_t *step;
+  int j;
+  long pos;
+  size_t base;
+} mpc_vm_frame_t;
+
+typedef struct {
+  char *chars;
+  size_t num;
+  size_t slots;
+} mpc_span_t;
+
+static void *mpc_program_keep(mpc_program_t *prog, void *x) {
+  if (prog->blocks_num == prog->blocks_slots) {
+    prog->blocks_slots = prog->blocks_slots ? prog->blocks_slots * 2 : 64;
+    prog->blocks = realloc(prog->blocks, sizeof(void*) * prog->blocks_slots);
+  }
+  prog->blocks[prog->blocks_num++] = x;
+  return x;
+}
+
+static void *mpc_program_alloc(mpc_program_t *prog, size_t n) {
+  return mpc_program_keep(prog, malloc(n));
+}
+
+static void mpc_program_delete(mpc_program_t *prog) {
+  int j;
+  if (prog == NULL) { return; }
+  for (j = 0; j < prog->blocks_num; j++) { free(prog->blocks[j]); }
+  free(prog->blocks);
+  free(prog->insts);
+  free(prog->xs);
+  free(prog);
+}
+
+/*
+** Failed expectations are the bulk of the errors built while
+** parsing, and nearly all of them are thrown away. Inside a
+** program the latest one is written to scratch space owned by
+** the run, and the expectations at the furthest position are
+** gathered in a list borrowing the instruction strings. They
+** only become a heap error when an error that is not a plain
+** expectation has to be merged with them, or at the end, and
+** the result is the same as mpc_err_merge would have built.
+*/
+
+typedef struct {
+  mpc_err_t x;
+  char *x_expected[1];
+  mpc_err_t far;
+  int far_active;
+  int far_slots;
+} mpc_vm_errs_t;
+
+static void mpc_vm_errs_init(mpc_input_t *i, mpc_vm_errs_t *v) {
+  v->x.filename = i->filename;
+  v->x.failure = NULL;
+  v->x.expected_num = 1;
+  v->x.expected = v->x_expected;
+  v->far = v->x;
+  v->far_active = 0;
+  v->far_slots = 4;
+  v->far.expected = malloc(sizeof(char*) * v->far_slots);
+}
+
+static long mpc_vm_err_pos(mpc_err_t *e, mpc_vm_errs_t *v) {
+  if (v->far_active) { return v->far.state.pos; }
+  return e ? e->state.pos : -1;
+}
+
+static mpc_err_t *mpc_vm_err_expect(mpc_input_t *i, mpc_err_t *e, mpc_vm_errs_t *v, char *expected) {
+  if (i->suppress || mpc_vm_err_pos(e, v) > i->state.pos) { return NULL; }
+  v->x.state = i->state;
+  v->x.received = mpc_input_peekc(i);
+  v->x.expected[0] = expected;
+  return &v->x;
+}
+
+static mpc_err_t *mpc_vm_err_keep(mpc_input_t *i, mpc_err_t *x, mpc_vm_errs_t *v) {
+  return x == &v->x ? mpc_err_copy(i, x) : x;
+}
+
+static mpc_err_t *mpc_vm_err_flush(mpc_input_t *i, mpc_err_t *e, mpc_vm_errs_t *v) {
+  if (!v->far_active) { return e; }
+  v->far_active = 0;
+  return mpc_err_merge(i, e, mpc_err_copy(i, &v->far));
+}
+
+static mpc_err_t *mpc_vm_err_many1(mpc_input_t *i, mpc_err_t *x, mpc_vm_errs_t *v, mpc_inst_t *q) {
+  if (x == &v->x && q->expected && x->expected[0] == q->x->data.expect.m) {
+    x->expected[0] = q->expected;
+    return x;
+  }
+  return mpc_err_many1(i, mpc_vm_err_keep(i, x, v));
+}
+
+static mpc_err_t *mpc_vm_err_merge(mpc_input_t *i, mpc_err_t *e, mpc_err_t *x, mpc_vm_errs_t *v);
+
+static mpc_err_t *mpc_vm_err_skipped(mpc_input_t *i, mpc_err_t *e, mpc_vm_errs_t *v, mpc_step_t *s) {
+  int j;
+  for (j = 0; j < s->expected_num; j++) {
+    e = mpc_vm_err_merge(i, e, mpc_vm_err_expect(i, e, v, s->expected[j]), v);
+  }
+  return e;
+}
+
+static mpc_err_t *mpc_vm_err_merge(mpc_input_t *i, mpc_err_t *e, mpc_err_t *x, mpc_vm_errs_t *v) {
+
+  int j;
+
+  if (x == NULL) { return e; }
+  if (x != &v->x) { return mpc_err_merge(i, mpc_vm_err_flush(i, e, v), x); }
+
+  if (!v->far_active && e && e->state.pos >= x->state.pos) {
+    if (e->state.pos > x->state.pos) { return e; }
+    if (e->failure) { return mpc_err_merge(i, e, mpc_err_copy(i, x)); }
+    e->received = x->received;
+    if (!mpc_err_contains_expected(i, e, x->expected[0])) {
+      mpc_err_add_expected(i, e, x->expected[0]);
+    }
+    return e;
+  }
+
+  if (!v->far_active || v->far.state.pos < x->state.pos) {
+    mpc_err_delete_internal(i, e);
+    v->far_active = 1;
+    v->far.state = x->state;
+    v->far.received = x->received;
+    v->far.expected_num = 1;
+    v->far.expected[0] = x->expected[0];
+    return NULL;
+  }
+
+  if (v->far.state.pos > x->state.pos) { return e; }
+
+  v->far.received = x->received;
+  for (j = 0; j < v->far.expected_num; j++) {
+    if (v->far.expected[j] == x->expected[0]) { return e; }
+    if (strcmp(v->far.expected[j], x->expected[0]) == 0) { return e; }
+  }
+  if (v->far.expected_num == v->far_slots) {
+    v->far_slots *= 2;
+    v->far.expected = realloc(v->far.expected, sizeof(char*) * v->far_slots);
+  }
+  v->far.expected[v->far.expected_num++] = x->expected[0];
+  return e;
+}
+
+static void mpc_span_reserve(mpc_span_t *s, size_t n) {
+  if (s->num + n <= s->slots) { return; }
+  if (s->slots == 0) { s->slots = 64; }
+  while (s->num + n > s->slots) { s->slots *= 2; }
+  s->chars = realloc(s->chars, s->slots);
+}
+
+static int mpc_span_push(mpc_span_t *s, char x) {
+  mpc_span_reserve(s, 1);
+  s->chars[s->num++] = x;
+  return 1;
+}
+
+/*
+** A repeat of a single character class over a string or mapping
+** first skips the whole run of class members in bulk. With byte
+** shuffles each block of characters is classified at once: the
+** low nibble of a character looks up which high nibbles are in
+** the class and the high nibble picks one of those bits, which
+** covers any set of the first 128 characters. Characters above
+** those are either all in the class or all out of it, else the
+** scan stays scalar.
+*/
+
+static size_t mpc_span_scan(mpc_inst_t *c, const char *x, size_t n) {
+  size_t k = 0;
+  while (k < n && mpc_set_has(c->first, x[k])) { k++; }
+  return k;
+}
+
+#if MPC_HAVE_SCAN
+
+MPC_TARGET("avx2")
+static size_t mpc_span_scan_avx2(mpc_inst_t *c, const char *x, size_t n) {
+
+  size_t k = 0;
+  __m256i lo, bits, low, y, m;
+  unsigned int r;
+
+  if (c->high >= 0) {
+    lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)c->nibbles));
+    bits = _mm256_setr_epi8(
+      1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+      1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    low = _mm256_set1_epi8(0x0F);
+    for (; k + 32 <= n; k += 32) {
+      y = _mm256_loadu_si256((const __m256i*)(x + k));
+      m = _mm256_and_si256(
+        _mm256_shuffle_epi8(lo, _mm256_and_si256(y, low)),
+        _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(y, 4), low)));
+      m = _mm256_cmpeq_epi8(m, _mm256_setzero_si256());
+      if (c->high) { m = _mm256_andnot_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), y), m); }
+      r = (unsigned int)_mm256_movemask_epi8(m);
+      if (r) { return k + (size_t)__builtin_ctz(r); }
+    }
+  }
+
+  return k + mpc_span_scan(c, x + k, n - k);
+}
+
+MPC_TARGET("ssse3")
+static size_t mpc_span_scan_ssse3(mpc_inst_t *c, const char *x, size_t n) {
+
+  size_t k = 0;
+  __m128i lo, bits, low, y, m;
+  unsigned int r;
+
+  if (c->high >= 0) {
+    lo = _mm_loadu_si128((const __m128i*)c->nibbles);
+    bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    low = _mm_set1_epi8(0x0F);
+    for (; k + 16 <= n; k += 16) {
+      y = _mm_loadu_si128((const __m128i*)(x + k));
+      m = _mm_and_si128(
+        _mm_shuffle_epi8(lo, _mm_and_si128(y, low)),
+        _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(y, 4), low)));
+      m = _mm_cmpeq_epi8(m, _mm_setzero_si128());
+      if (c->high) { m = _mm_andnot_si128(_mm_cmplt_epi8(y, _mm_setzero_si128()), m); }
+      r = (unsigned int)_mm_movemask_epi8(m);
+      if (r) { return k + (size_t)__builtin_ctz(r); }
+    }
+  }
+
+  return k + mpc_span_scan(c, x + k, n - k);
+}
+
+#endif
+
+static int mpc_span_bulk(mpc_input_t *i, mpc_inst_t *q, mpc_span_t *s) {
+
+  const char *x;
+  size_t n;
+
+  if (q->scan == NULL) { return 0; }
+  if (i->type != MPC_INPUT_STRING && i->type != MPC_INPUT_MMAP) { return 0; }
+  if (i->state.pos >= i->length) { return 0; }
+
+  x = i->string + i->state.pos;
+  n = q->scan_fn(q->scan, x, (size_t)(i->length - i->state.pos));
+  if (n == 0) { return 0; }
+
+  mpc_span_reserve(s, n);
+  memcpy(s->chars + s->num, x, n);
+  s->num += n;
+  mpc_input_advance(i, x, n);
+  return 1;
+}
+
+static int mpc_span_class(mpc_input_t *i, const unsigned char *first, mpc_span_t *s) {
+  char x;
+  if (mpc_input_terminated(i)) { return 0; }
+  x = mpc_input_getc(i);
+  if (!mpc_set_has(first, x)) { return mpc_input_failure(i, x); }
+  mpc_input_success(i, x, NULL);
+  return mpc_span_push(s, x);
+}
+
+static int mpc_span_run(mpc_input_t *i, mpc_inst_t *q, mpc_err_t **e, mpc_vm_errs_t *v, mpc_span_t *s, mpc_err_t **x) {
+
+  int j;
+  size_t n = s->num;
+  const char *c;
+
+  *x = NULL;
+
+  switch (q->span) {
+
+    case MPC_SPAN_CLASS: return mpc_span_class(i, q->first, s);
+    case MPC_SPAN_LIFT:  return 1;
+
+    case MPC_SPAN_STRING:
+      mpc_input_mark(i);
+      for (c = q->data.string.x; *c; c++) {
+        if (!mpc_input_char(i, *c, NULL)) {
+          mpc_input_rewind(i);
+          s->num = n;
+          return 0;
+        }
+        mpc_span_push(s, *c);
+      }
+      mpc_input_unmark(i);
+      return 1;
+
+    case MPC_SPAN_EXPECT:
+      mpc_input_suppress_enable(i);
+      j = mpc_span_run(i, q->x, e, v, s, x);
+      mpc_input_suppress_disable(i);
+      if (!j) { *x = mpc_vm_err_expect(i, *e, v, q->data.expect.m); }
+      return j;
+
+    case MPC_SPAN_MAYBE:
+      if (mpc_span_run(i, q->x, e, v, s, x)) { return 1; }
+      *e = mpc_vm_err_merge(i, *e, *x, v);
+      *x = NULL;
+      return 1;
+
+    case MPC_SPAN_MANY:
+      mpc_span_bulk(i, q, s);
+      while (mpc_span_run(i, q->x, e, v, s, x));
+      *e = mpc_vm_err_merge(i, *e, *x, v);
+      *x = NULL;
+      return 1;
+
+    case MPC_SPAN_MANY1:
+      for (j = mpc_span_bulk(i, q, s); mpc_span_run(i, q->x, e, v, s, x); j++);
+      if (j == 0) {
+        *x = mpc_vm_err_many1(i, *x, v, q);
+        return 0;
+      }
+      *e = mpc_vm_err_merge(i, *e, *x, v);
+      *x = NULL;
+      return 1;
+
+    case MPC_SPAN_COUNT:
+      for (j = 0; j < q->data.repeat.n; j++) {
+        if (!mpc_span_run(i, q->x, e, v, s, x)) {
+          s->num = n;
+          *x = mpc_err_count(i, mpc_vm_err_keep(i, *x, v), q->data.repeat.n);
+          return 0;
+        }
+      }
+      return 1;
+
+    case MPC_SPAN_OR:
+      for (j = 0; j < q->data.or.n; j++) {
+        if (mpc_span_run(i, q->xs[j], e, v, s, x)) { return 1; }
+        *e = mpc_vm_err_merge(i, *e, *x, v);
+      }
+      *x = NULL;
+      return 0;
+
+    case MPC_SPAN_AND:
+      mpc_input_mark(i);
+      for (j = 0; j < q->data.and.n; j++) {
+        if (!mpc_span_run(i, q->xs[j], e, v, s, x)) {
+          mpc_input_rewind(i);
+          s->num = n;
+          return 0;
+        }
+      }
+      mpc_input_unmark(i);
+      return 1;
+
+    default: return 0;
+  }
+}
+
+static int mpc_vm_span(mpc_input_t *i, mpc_inst_t *q, mpc_err_t **e, mpc_vm_errs_t *v, mpc_span_t *s, mpc_result_t *x) {
+
+  char *y;
+
+  s->num = 0;
+  if (!mpc_span_run(i, q, e, v, s, &x->error)) { return 0; }
+
+  y = mpc_malloc(i, s->num + 1);
+  if (s->num) { memcpy(y, s->chars, s->num); }
+  y[s->num] = '\0';
+  x->output = y;
+  return 1;
+}
+
+#if MPC_HAVE_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define MPC_VM_CASE(l)      vm_##l
+#define MPC_VM_ADDR(l)      &&vm_##l
+#define MPC_VM_GOTO(l)      goto vm_##l
+#define MPC_VM_DISPATCH(q)  goto *labels[(q)->op]
+#define MPC_VM_RESUME()     goto *f->resume
+#else
+#define MPC_VM_CASE(l)      case MPC_VM_##l
+#define MPC_VM_ADDR(l)      MPC_VM_##l
+#define MPC_VM_GOTO(l)      do { op = MPC_VM_##l; goto vm_dispatch; } while (0)
+#define MPC_VM_DISPATCH(q)  do { op = (q)->op; goto vm_dispatch; } while (0)
+#define MPC_VM_RESUME()     do { op = f->resume; goto vm_dispatch; } while (0)
+#endif
+
+#define MPC_VM_SUCCESS(v) do { x.output = (v); ok = 1; goto vm_pop; } while (0)
+#define MPC_VM_FAILURE(v) do { x.error = (v); ok = 0; goto vm_pop; } while (0)
+#define MPC_VM_RETURN()   goto vm_pop
+#define MPC_VM_CALL(q, l) do { f->resume = MPC_VM_ADDR(l); q_next = (q); goto vm_call; } while (0)
+#define MPC_VM_ADD() do { \
+  if (results_num == results_slots) { \
+    results_slots *= 2; \
+    results = realloc(results, sizeof(mpc_result_t) * results_slots); \
+  } \
+  results[results_num++] = x; f->j++; } while (0)
+#define MPC_VM_RESULTS()  (results + f->base)
+#define MPC_VM_FOLD(g)    mpc_parse_fold(i, (g), f->j, (mpc_val_t**)MPC_VM_RESULTS())
+
+static int mpc_vm_run(mpc_input_t *i, mpc_program_t *prog, mpc_result_t *r, mpc_err_t **e) {
+
+#if MPC_HAVE_COMPUTED_GOTO
+  static const void *const labels[] = {
+    &&vm_APPLY,  &&vm_APPLY_TO, &&vm_CHECK,  &&vm_CHECK_WITH,
+    &&vm_EXPECT, &&vm_PREDICT,  &&vm_NOT,    &&vm_MAYBE,
+    &&vm_MANY,   &&vm_MANY1,    &&vm_SEPBY1, &&vm_COUNT,
+    &&vm_OR,     &&vm_AND,      &&vm_MEMO
+  };
+#else
+  int op;
+#endif
+
+  int k, ok = 0;
+  mpc_vm_frame_t *frames, *f;
+  size_t frames_num = 1, frames_slots = MPC_PARSE_FRAMES_MIN;
+  mpc_result_t *results, *rs;
+  size_t results_num = 0, results_slots = MPC_PARSE_RESULTS_MIN;
+  mpc_inst_t *q_next;
+  mpc_memo_t *m;
+  mpc_result_t x;
+  mpc_vm_errs_t v;
+  mpc_span_t s;
+
+  mpc_vm_errs_init(i, &v);
+  s.chars = NULL;
+  s.num = 0;
+  s.slots = 0;
+
+  x.output = NULL;
+  frames = malloc(sizeof(mpc_vm_frame_t) * frames_slots);
+  results = malloc(sizeof(mpc_result_t) * results_slots);
+
+  /* The bottom frame only receives the result of the root */
+  f = &frames[0];
+  f->ins = NULL;
+  f->j = 0;
+  f->base = 0;
+  MPC_VM_CALL(prog->insts, DONE);
+
+vm_call:
+
+  if (q_next->leaf == MPC_INST_LEAF) {
+    ok = mpc_parse_leaf(i, q_next->p, &x);
+    MPC_VM_RESUME();
+  }
+
+  if (q_next->leaf == MPC_INST_EXPECT_LEAF) {
+    mpc_input_suppress_enable(i);
+    ok = mpc_parse_leaf(i, q_next->x->p, &x);
+    mpc_input_suppress_disable(i);
+    if (!ok) { x.error = mpc_vm_err_expect(i, *e, &v, q_next->data.expect.m); }
+    MPC_VM_RESUME();
+  }
+
+  if (q_next->leaf == MPC_INST_SPAN) {
+    ok = mpc_vm_span(i, q_next, e, &v, &s, &x);
+    MPC_VM_RESUME();
+  }
+
+  if (frames_num == frames_slots) {
+    if (sizeof(mpc_vm_frame_t) * frames_slots * 2 > mpc_parse_stack_max) {
+      x.error = mpc_err_fail(i, "Maximum parse stack size exceeded!");
+      ok = 0;
+      MPC_VM_RESUME();
+    }
+    frames_slots *= 2;
+    frames = realloc(frames, sizeof(mpc_vm_frame_t) * frames_slots);
+  }
+
+  f = &frames[frames_num++];
+  f->ins = q_next;
+  f->j = 0;
+  f->base = results_num;
+  MPC_VM_DISPATCH(q_next);
+
+vm_pop:
+
+  results_num = f->base;
+  frames_num--;
+  f = &frames[frames_num-1];
+  MPC_VM_RESUME();
+
+#if !MPC_HAVE_COMPUTED_GOTO
+vm_dispatch:
+
+  switch (op) {
+#endif
+
+  /* Application Parsers */
+
+  MPC_VM_CASE(APPLY): MPC_VM_CALL(f->ins->x, APPLY_1);
+  MPC_VM_CASE(APPLY_1):
+    if (ok) { MPC_VM_SUCCESS(mpc_parse_apply(i, f->ins->data.apply.f, x.output)); }
+    MPC_VM_RETURN();
+
+  MPC_VM_CASE(APPLY_TO): MPC_VM_CALL(f->ins->x, APPLY_TO_1);
+  MPC_VM_CASE(APPLY_TO_1):
+    if (ok) { MPC_VM_SUCCESS(mpc_parse_apply_to(i, f->ins->data.apply_to.f, x.output, f->ins->data.apply_to.d)); }
+    MPC_VM_RETURN();
+
+  MPC_VM_CASE(CHECK): MPC_VM_CALL(f->ins->x, CHECK_1);
+  MPC_VM_CASE(CHECK_1):
+    if (!ok) { MPC_VM_RETURN(); }
+    if (f->ins->data.check.f(&x.output)) { MPC_VM_SUCCESS(x.output); }
+    mpc_parse_dtor(i, f->ins->data.check.dx, x.output);
+    MPC_VM_FAILURE(mpc_err_fail(i, f->ins->data.check.e));
+
+  MPC_VM_CASE(CHECK_WITH): MPC_VM_CALL(f->ins->x, CHECK_WITH_1);
+  MPC_VM_CASE(CHECK_WITH_1):
+    if (!ok) { MPC_VM_RETURN(); }
+    if (f->ins->data.check_with.f(&x.output, f->ins->data.check_with.d)) { MPC_VM_SUCCESS(x.output); }
+    mpc_parse_dtor(i, f->ins->data.check_with.dx, x.output);
+    MPC_VM_FAILURE(mpc_err_fail(i, f->ins->data.check_with.e));
+
+  MPC_VM_CASE(EXPECT):
+    mpc_input_suppress_enable(i);
+    MPC_VM_CALL(f->ins->x, EXPECT_1);
+  MPC_VM_CASE(EXPECT_1):
+    mpc_input_suppress_disable(i);
+    if (ok) { MPC_VM_SUCCESS(x.output); }
+    MPC_VM_FAILURE(mpc_vm_err_expect(i, *e, &v, f->ins->data.expect.m));
+
+  MPC_VM_CASE(PREDICT):
+    mpc_input_backtrack_disable(i);
+    MPC_VM_CALL(f->ins->x, PREDICT_1);
+  MPC_VM_CASE(PREDICT_1):
+    mpc_input_backtrack_enable(i);
+    MPC_VM_RETURN();
+
+  /* Optional Parsers */
+
+  MPC_VM_CASE(NOT):
+    mpc_input_mark(i);
+    mpc_input_suppress_enable(i);
+    MPC_VM_CALL(f->ins->x, NOT_1);
+  MPC_VM_CASE(NOT_1):
+    if (ok) {
+      mpc_input_rewind(i);
+      mpc_input_suppress_disable(i);
+      mpc_parse_dtor(i, f->ins->data.not.dx, x.output);
+      MPC_VM_FAILURE(mpc_err_new(i, "opposite"));
+    }
+    mpc_input_unmark(i);
+    mpc_input_suppress_disable(i);
+    MPC_VM_SUCCESS(f->ins->data.not.lf());
+
+  MPC_VM_CASE(MAYBE): MPC_VM_CALL(f->ins->x, MAYBE_1);
+  MPC_VM_CASE(MAYBE_1):
+    if (ok) { MPC_VM_SUCCESS(x.output); }
+    *e = mpc_vm_err_merge(i, *e, x.error, &v);
+    MPC_VM_SUCCESS(f->ins->data.not.lf());
+
+  /* Repeat Parsers */
+
+  MPC_VM_CASE(MANY): MPC_VM_CALL(f->ins->x, MANY_1);
+  MPC_VM_CASE(MANY_1):
+    if (ok) {
+      MPC_VM_ADD();
+      MPC_VM_CALL(f->ins->x, MANY_1);
+    }
+    *e = mpc_vm_err_merge(i, *e, x.error, &v);
+    MPC_VM_SUCCESS(MPC_VM_FOLD(f->ins->data.repeat.f));
+
+  MPC_VM_CASE(MANY1): MPC_VM_CALL(f->ins->x, MANY1_1);
+  MPC_VM_CASE(MANY1_1):
+    if (ok) {
+      MPC_VM_ADD();
+      MPC_VM_CALL(f->ins->x, MANY1_1);
+    }
+    if (f->j == 0) { MPC_VM_FAILURE(mpc_vm_err_many1(i, x.error, &v, f->ins)); }
+    *e = mpc_vm_err_merge(i, *e, x.error, &v);
+    MPC_VM_SUCCESS(MPC_VM_FOLD(f->ins->data.repeat.f));
+
+  MPC_VM_CASE(SEPBY1): MPC_VM_CALL(f->ins->x, SEPBY1_1);
+  MPC_VM_CASE(SEPBY1_1):
+    if (!ok) { MPC_VM_FAILURE(mpc_vm_err_many1(i, x.error, &v, f->ins)); }
+    MPC_VM_ADD();
+    MPC_VM_CALL(f->ins->sep, SEPBY1_2);
+  MPC_VM_CASE(SEPBY1_2):
+    if (ok) { MPC_VM_CALL(f->ins->x, SEPBY1_3); }
+    *e = mpc_vm_err_merge(i, *e, x.error, &v);
+    MPC_VM_SUCCESS(MPC_VM_FOLD(f->ins->data.sepby1.f));
+  MPC_VM_CASE(SEPBY1_3):
+    if (ok) {
+      MPC_VM_ADD();
+      MPC_VM_CALL(f->ins->sep, SEPBY1_2);
+    }
+    *e = mpc_vm_err_merge(i, *e, x.error, &v);
+    MPC_VM_SUCCESS(MPC_VM_FOLD(f->ins->data.sepby1.f));
+
+  MPC_VM_CASE(COUNT): MPC_VM_CALL(f->ins->x, COUNT_1);
+  MPC_VM_CASE(COUNT_1):
+    if (ok) {
+      MPC_VM_ADD();
+      if (f->j == f->ins->data.repeat.n) { MPC_VM_SUCCESS(MPC_VM_FOLD(f->ins->data.repeat.f)); }
+      MPC_VM_CALL(f->ins->x, COUNT_1);
+    }
+    rs = MPC_VM_RESULTS();
+    for (k = 0; k < f->j; k++) {
+      mpc_parse_dtor(i, f->ins->data.repeat.dx, rs[k].output);
+    }
+    MPC_VM_FAILURE(mpc_err_count(i, mpc_vm_err_keep(i, x.error, &v), f->ins->data.repeat.n));
+
+  /* Combinatory Parsers */
+
+  MPC_VM_CASE(OR):
+    if (f->ins->data.or.n == 0) { MPC_VM_SUCCESS(NULL); }
+    if (f->ins->dispatch == NULL) { MPC_VM_CALL(f->ins->xs[0], OR_1); }
+    f->step = f->ins->dispatch[(unsigned char)mpc_input_peekc(i)];
+    MPC_VM_GOTO(OR_2);
+  MPC_VM_CASE(OR_1):
+    if (ok) { MPC_VM_SUCCESS(x.output); }
+    *e = mpc_vm_err_merge(i, *e, x.error, &v);
+    if (++f->j < f->ins->data.or.n) { MPC_VM_CALL(f->ins->xs[f->j], OR_1); }
+    MPC_VM_FAILURE(NULL);
+  MPC_VM_CASE(OR_2):
+    if (f->step->k == MPC_STEP_MERGE) {
+      *e = mpc_vm_err_skipped(i, *e, &v, f->step);
+      f->step++;
+    }
+    if (f->step->k == MPC_STEP_END) { MPC_VM_FAILURE(NULL); }
+    f->step++;
+    MPC_VM_CALL(f->ins->xs[f->step[-1].k], OR_3);
+  MPC_VM_CASE(OR_3):
+    if (ok) { MPC_VM_SUCCESS(x.output); }
+    *e = mpc_vm_err_merge(i, *e, x.error, &v);
+    MPC_VM_GOTO(OR_2);
+
+  MPC_VM_CASE(AND):
+    if (f->ins->data.and.n == 0) { MPC_VM_SUCCESS(NULL); }
+    mpc_input_mark(i);
+    MPC_VM_CALL(f->ins->xs[0], AND_1);
+  MPC_VM_CASE(AND_1):
+    if (!ok) {
+      mpc_input_rewind(i);
+      rs = MPC_VM_RESULTS();
+      for (k = 0; k < f->j; k++) {
+        mpc_parse_dtor(i, f->ins->data.and.dxs[k], rs[k].output);
+      }
+      MPC_VM_RETURN();
+    }
+    MPC_VM_ADD();
+    if (f->j < f->ins->data.and.n) { MPC_VM_CALL(f->ins->xs[f->j], AND_1); }
+    mpc_input_unmark(i);
+    MPC_VM_SUCCESS(MPC_VM_FOLD(f->ins->data.and.f));
+
+  /* Memoised Parsers */
+
+  MPC_VM_CASE(MEMO):
+
+    if (i->backtrack < 1) { MPC_VM_CALL(f->ins->x, MEMO_2); }
+
+    f->pos = i->state.pos;
+    m = mpc_memo_find(i, f->ins->p, f->pos);
+
+    if (m && m->status == MPC_MEMO_SUCCESS) {
+      mpc_input_restore(i, m->state, m->last);
+      MPC_VM_SUCCESS(f->ins->data.memo.cx(m->output));
+    }
+
+    if (m && m->status == MPC_MEMO_FAILURE) {
+      MPC_VM_FAILURE(mpc_err_copy(i, m->error));
+    }
+
+    MPC_VM_CALL(f->ins->x, MEMO_1);
+
+  MPC_VM_CASE(MEMO_1):
+    m = mpc_memo_find(i, f->ins->p, f->pos);
+    if (ok) {
+      if (!m) {
+        mpc_memo_add(i, f->ins->p, f->pos);
+      } else {
+        x.output = mpc_export(i, x.output);
+        m->status = MPC_MEMO_SUCCESS;
+        m->state = i->state;
+        m->last = i->last;
+        m->output = f->ins->data.memo.cx(x.output);
+      }
+    } else {
+      if (!m) { m = mpc_memo_add(i, f->ins->p, f->pos); }
+      m->status = MPC_MEMO_FAILURE;
+      m->error = mpc_err_copy(i, x.error);
+    }
+    MPC_VM_RETURN();
+
+  MPC_VM_CASE(MEMO_2):
+    MPC_VM_RETURN();
+
+  /* End */
+
+  MPC_VM_CASE(DONE):
+    goto vm_done;
+
+#if !MPC_HAVE_COMPUTED_GOTO
+  }
+#endif
+
+vm_done:
+
+  *e = mpc_vm_err_flush(i, *e, &v);
+  if (!ok) { x.error = mpc_vm_err_keep(i, x.error, &v); }
+  free(v.far.expected);
+  free(s.chars);
+  free(frames);
+  free(results);
+  *r = x;
+  return ok;
+}
+
+#if MPC_HAVE_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+#undef MPC_VM_CASE
+#undef MPC_VM_ADDR
+#undef MPC_VM_GOTO
+#undef MPC_VM_DISPATCH
+#undef MPC_VM_RESUME
+#undef MPC_VM_SUCCESS
+#undef MPC_VM_FAILURE
+#undef MPC_VM_RETURN
+#undef MPC_VM_CALL
+#undef MPC_VM_ADD
+#undef MPC_VM_RESULTS
+#undef MPC_VM_FOLD
+
+/*
+** Every parser node reachable from the root is given an
+** instruction of its own, so shared and recursive parsers
+** become plain pointers into the program.
+*/
+
+typedef struct {
+  mpc_parser_t **ps;
+  int ps_num;
+  int ps_slots;
+  int *table;
+  int table_slots;
+} mpc_compiler_t;
+
+static size_t mpc_compile_hash(mpc_compiler_t *c, mpc_parser_t *p) {
+  return ((((size_t)p) >> 4) * 2654435761u) & (size_t)(c->table_slots - 1);
+}
+
+static int mpc_compile_find(mpc_compiler_t *c, mpc_parser_t *p) {
+  size_t k = mpc_compile_hash(c, p);
+  while (c->table[k] >= 0) {
+    if (c->ps[c->table[k]] == p) { return c->table[k]; }
+    k = (k + 1) & (size_t)(c->table_slots - 1);
+  }
+  return -1;
+}
+
+static void mpc_compile_insert(mpc_compiler_t *c, int j) {
+  size_t k = mpc_compile_hash(c, c->ps[j]);
+  while (c->table[k] >= 0) { k = (k + 1) & (size_t)(c->table_slots - 1); }
+  c->table[k] = j;
+}
+
+static void mpc_compile_add(mpc_compiler_t *c, mpc_parser_t *p) {
+
+  int j;
+
+  if (c->ps_num == c->ps_slots) {
+    c->ps_slots *= 2;
+    c->ps = realloc(c->ps, sizeof(mpc_parser_t*) * c->ps_slots);
+  }
+  c->ps[c->ps_num++] = p;
+
+  if (c->ps_num * 2 <= c->table_slots) {
+    mpc_compile_insert(c, c->ps_num-1);
+    return;
+  }
+
+  c->table_slots *= 2;
+  c->table = realloc(c->table, sizeof(int) * c->table_slots);
+  for (j = 0; j < c->table_slots; j++) { c->table[j] = -1; }
+  for (j = 0; j < c->ps_num; j++) { mpc_compile_insert(c, j); }
+}
+
+static mpc_parser_t **mpc_compile_children(mpc_parser_t *p, mpc_parser_t **xs, int *n) {
+
+  *n = 1;
+
+  switch (p->type) {
+    case MPC_TYPE_APPLY:      xs[0] = p->data.apply.x; return xs;
+    case MPC_TYPE_APPLY_TO:   xs[0] = p->data.apply_to.x; return xs;
+    case MPC_TYPE_CHECK:      xs[0] = p->data.check.x; return xs;
+    case MPC_TYPE_CHECK_WITH: xs[0] = p->data.check_with.x; return xs;
+    case MPC_TYPE_EXPECT:     xs[0] = p->data.expect.x; return xs;
+    case MPC_TYPE_PREDICT:    xs[0] = p->data.predict.x; return xs;
+    case MPC_TYPE_NOT:        xs[0] = p->data.not.x; return xs;
+    case MPC_TYPE_MAYBE:      xs[0] = p->data.not.x; return xs;
+    case MPC_TYPE_MANY:       xs[0] = p->data.repeat.x; return xs;
+    case MPC_TYPE_MANY1:      xs[0] = p->data.repeat.x; return xs;
+    case MPC_TYPE_COUNT:      xs[0] = p->data.repeat.x; return xs;
+    case MPC_TYPE_MEMO:       xs[0] = p->data.memo.x; return xs;
+    case MPC_TYPE_SEPBY1:
+      xs[0] = p->data.sepby1.x;
+      xs[1] = p->data.sepby1.sep;
+      *n = 2;
+      return xs;
+    case MPC_TYPE_OR:  *n = p->data.or.n;  return p->data.or.xs;
+    case MPC_TYPE_AND: *n = p->data.and.n; return p->data.and.xs;
+    default: *n = 0; return NULL;
+  }
+}
+
+static void mpc_compile_visit(mpc_compiler_t *c, mpc_parser_t *p) {
+
+  int j, n;
+  mpc_parser_t *two[2];
+  mpc_parser_t **xs;
+
+  if (mpc_compile_find(c, p) >= 0) { return; }
+  mpc_compile_add(c, p);
+
+  xs = mpc_compile_children(p, two, &n);
+  for (j = 0; j < n; j++) { mpc_compile_visit(c, xs[j]); }
+}
+
+static int mpc_compile_leaf(mpc_parser_t *p) {
+  return (p->type < MPC_TYPE_APPLY && p->type != MPC_TYPE_EXPECT)
+    || p->type == MPC_TYPE_SOI || p->type == MPC_TYPE_EOI;
 }
 
-static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  mpc_free(i, c);
-  return a;
+static int mpc_compile_op(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_APPLY:      return MPC_VM_APPLY;
+    case MPC_TYPE_APPLY_TO:   return MPC_VM_APPLY_TO;
+    case MPC_TYPE_CHECK:      return MPC_VM_CHECK;
+    case MPC_TYPE_CHECK_WITH: return MPC_VM_CHECK_WITH;
+    case MPC_TYPE_EXPECT:     return MPC_VM_EXPECT;
+    case MPC_TYPE_PREDICT:    return MPC_VM_PREDICT;
+    case MPC_TYPE_NOT:        return MPC_VM_NOT;
+    case MPC_TYPE_MAYBE:      return MPC_VM_MAYBE;
+    case MPC_TYPE_MANY:       return MPC_VM_MANY;
+    case MPC_TYPE_MANY1:      return MPC_VM_MANY1;
+    case MPC_TYPE_SEPBY1:     return MPC_VM_SEPBY1;
+    case MPC_TYPE_COUNT:      return MPC_VM_COUNT;
+    case MPC_TYPE_OR:         return MPC_VM_OR;
+    case MPC_TYPE_AND:        return MPC_VM_AND;
+    case MPC_TYPE_MEMO:       return MPC_VM_MEMO;
+    default: return -1;
+  }
 }
 
-static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
-  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
-  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
-  return f(mpc_export(i, x));
+static char *mpc_compile_repeat(mpc_program_t *prog, const char *prefix, const char *x) {
+  char *y = mpc_program_alloc(prog, strlen(prefix) + strlen(x) + 1);
+  strcpy(y, prefix);
+  strcat(y, x);
+  return y;
 }
 
-static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
-  return f(mpc_export(i, x), d);
+/*
+** FIRST sets and nullability
+**
+** An instruction's first set holds the characters it can
+** start consuming input with, and nullable says whether it
+** can succeed without consuming any. Both are found by
+** iterating to a fixed point over the program, so recursive
+** grammars are covered. The input reports its end as a zero
+** character, which no parser consumes.
+*/
+
+static void mpc_first_add(unsigned char *first, int c) {
+  first[c >> 3] |= (unsigned char)(1 << (c & 7));
 }
 
-static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
-  if (d == free) { mpc_free(i, x); return; }
-  d(mpc_export(i, x));
+static int mpc_first_has(const unsigned char *first, int c) {
+  return (first[c >> 3] >> (c & 7)) & 1;
 }
 
-enum {
-  MPC_PARSE_STACK_MIN = 4
-};
+static void mpc_first_leaf(mpc_inst_t *q) {
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+  int c;
+  char x;
 
-#define MPC_MAX_RECURSION_DEPTH 1000
+  switch (q->p->type) {
 
-static mpc_result_t *mpc_grow_results(mpc_input_t *i, int j, mpc_result_t *results_stk, mpc_result_t *results){
-  mpc_result_t *tmp_results = results;
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      for (c = 1; c < 256; c++) { mpc_first_add(q->first, c); }
+      break;
 
-  if (j == MPC_PARSE_STACK_MIN) {
-    int results_slots = j + j / 2;
-    tmp_results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-    memcpy(tmp_results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-  } else if (j >= MPC_PARSE_STACK_MIN) {
-    int results_slots = j + j / 2;
-    tmp_results = mpc_realloc(i, tmp_results, sizeof(mpc_result_t) * results_slots);
-  }
+    case MPC_TYPE_SINGLE:
+      if (q->data.single.x) { mpc_first_add(q->first, (unsigned char)q->data.single.x); }
+      break;
 
-  return tmp_results;
-}
+    case MPC_TYPE_RANGE:
+      for (c = 1; c < 256; c++) {
+        x = (char)c;
+        if (x >= q->data.range.x && x <= q->data.range.y) { mpc_first_add(q->first, c); }
+      }
+      break;
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      memcpy(q->first, q->data.set.set, 32);
+      q->first[0] &= (unsigned char)~1;
+      break;
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
+    case MPC_TYPE_STRING:
+      if (q->data.string.x[0]) { mpc_first_add(q->first, (unsigned char)q->data.string.x[0]); }
+      else { q->nullable = 1; }
+      break;
 
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_UNDEFINED:
+      break;
+
+    default:
+      q->nullable = 1;
+      break;
   }
+}
 
-  switch (p->type) {
+static int mpc_first_union(mpc_inst_t *q, mpc_inst_t *x, int nullable) {
+  int j, changed = 0;
+  unsigned char b;
+  for (j = 0; j < 32; j++) {
+    b = q->first[j] | x->first[j];
+    if (b != q->first[j]) { q->first[j] = b; changed = 1; }
+  }
+  if (nullable && !q->nullable) { q->nullable = 1; changed = 1; }
+  return changed;
+}
 
-    /* Basic Parsers */
+static int mpc_first_step(mpc_inst_t *q) {
 
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+  int k, changed = 0;
 
-    /* Other parsers */
+  switch (q->op) {
 
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+    case MPC_VM_NOT:
+      if (!q->nullable) { q->nullable = 1; changed = 1; }
+      return changed;
 
-    /* Application Parsers */
+    case MPC_VM_MAYBE:
+    case MPC_VM_MANY:
+      return mpc_first_union(q, q->x, 1);
 
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
+    case MPC_VM_OR:
+      for (k = 0; k < q->data.or.n; k++) {
+        changed |= mpc_first_union(q, q->xs[k], q->xs[k]->nullable);
       }
+      if (q->data.or.n == 0 && !q->nullable) { q->nullable = 1; changed = 1; }
+      return changed;
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
+    case MPC_VM_AND:
+      for (k = 0; k < q->data.and.n; k++) {
+        changed |= mpc_first_union(q, q->xs[k], 0);
+        if (!q->xs[k]->nullable) { return changed; }
       }
+      if (!q->nullable) { q->nullable = 1; changed = 1; }
+      return changed;
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+    default:
+      return mpc_first_union(q, q->x, q->x->nullable);
+  }
+}
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+static void mpc_compile_first(mpc_program_t *prog) {
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+  int j, changed = 1;
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+  for (j = 0; j < prog->insts_num; j++) {
+    if (prog->insts[j].leaf == MPC_INST_LEAF) { mpc_first_leaf(&prog->insts[j]); }
+  }
 
-    /* Optional Parsers */
+  while (changed) {
+    changed = 0;
+    for (j = 0; j < prog->insts_num; j++) {
+      if (prog->insts[j].leaf != MPC_INST_LEAF) { changed |= mpc_first_step(&prog->insts[j]); }
+    }
+  }
+}
 
-    /* TODO: Update Not Error Message */
+/*
+** Or Dispatch
+**
+** An alternative that can neither start with the next
+** character nor match nothing is sure to fail, but it still
+** leaves its expectations in the error. For each character
+** the alternatives are run through abstractly to find what a
+** sure failure reports, and the or gets a plan per character
+** that runs the feasible alternatives in order and merges in
+** the errors of the others in their place. Alternatives whose
+** failure depends on more than the next character, like
+** anchors or checks, are always run.
+*/
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+enum {
+  MPC_SIM_UNKNOWN,
+  MPC_SIM_EMPTY,
+  MPC_SIM_FAIL,
+  MPC_SIM_DEPTH = 64
+};
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
+typedef struct {
+  char **xs;
+  int num;
+  int slots;
+} mpc_strs_t;
+
+static void mpc_strs_add(mpc_strs_t *s, char *x) {
+  if (x == NULL) { return; }
+  if (s->num == s->slots) {
+    s->slots = s->slots ? s->slots * 2 : 8;
+    s->xs = realloc(s->xs, sizeof(char*) * s->slots);
+  }
+  s->xs[s->num++] = x;
+}
+
+/*
+** Works out what q does at a character it cannot consume.
+** Expectations it merges into the error along the way are
+** added to ev, and the error it fails with is put in ret.
+*/
+static int mpc_compile_sim(mpc_program_t *prog, mpc_inst_t *q, int c, mpc_strs_t *ev, char **ret, int depth) {
+
+  int k, r;
+  char prefix[32];
+  mpc_strs_t hidden;
+
+  *ret = NULL;
+  if (depth > MPC_SIM_DEPTH) { return MPC_SIM_UNKNOWN; }
+
+  if (q->leaf == MPC_INST_LEAF) {
+    switch (q->p->type) {
+      case MPC_TYPE_ANY:
+      case MPC_TYPE_SINGLE:
+      case MPC_TYPE_RANGE:
+      case MPC_TYPE_ONEOF:
+      case MPC_TYPE_NONEOF:
+      case MPC_TYPE_SATISFY:
+      case MPC_TYPE_STRING:
+        if (c && mpc_first_has(q->first, c)) { return MPC_SIM_UNKNOWN; }
+        return q->nullable ? MPC_SIM_EMPTY : MPC_SIM_FAIL;
+      case MPC_TYPE_PASS:
+      case MPC_TYPE_LIFT:
+      case MPC_TYPE_LIFT_VAL:
+      case MPC_TYPE_STATE:
+        return MPC_SIM_EMPTY;
+      default:
+        return MPC_SIM_UNKNOWN;
+    }
+  }
+
+  hidden.xs = NULL;
+  hidden.num = 0;
+  hidden.slots = 0;
+
+  switch (q->op) {
+
+    case MPC_VM_APPLY:
+    case MPC_VM_APPLY_TO:
+    case MPC_VM_PREDICT:
+    case MPC_VM_MEMO:
+      return mpc_compile_sim(prog, q->x, c, ev, ret, depth+1);
+
+    case MPC_VM_CHECK:
+    case MPC_VM_CHECK_WITH:
+      r = mpc_compile_sim(prog, q->x, c, ev, ret, depth+1);
+      return r == MPC_SIM_FAIL ? MPC_SIM_FAIL : MPC_SIM_UNKNOWN;
+
+    /* Errors are suppressed below an expect or a not */
+
+    case MPC_VM_EXPECT:
+      r = mpc_compile_sim(prog, q->x, c, &hidden, ret, depth+1);
+      free(hidden.xs);
+      *ret = r == MPC_SIM_FAIL ? q->data.expect.m : NULL;
+      return r;
+
+    case MPC_VM_NOT:
+      r = mpc_compile_sim(prog, q->x, c, &hidden, ret, depth+1);
+      free(hidden.xs);
+      *ret = NULL;
+      if (r == MPC_SIM_FAIL) { return MPC_SIM_EMPTY; }
+      if (r == MPC_SIM_EMPTY) { *ret = "opposite"; return MPC_SIM_FAIL; }
+      return MPC_SIM_UNKNOWN;
+
+    case MPC_VM_MAYBE:
+    case MPC_VM_MANY:
+      r = mpc_compile_sim(prog, q->x, c, ev, ret, depth+1);
+      if (r == MPC_SIM_EMPTY && q->op == MPC_VM_MAYBE) { return MPC_SIM_EMPTY; }
+      if (r != MPC_SIM_FAIL) { return MPC_SIM_UNKNOWN; }
+      mpc_strs_add(ev, *ret);
+      *ret = NULL;
+      return MPC_SIM_EMPTY;
+
+    case MPC_VM_MANY1:
+    case MPC_VM_SEPBY1:
+    case MPC_VM_COUNT:
+      r = mpc_compile_sim(prog, q->x, c, ev, ret, depth+1);
+      if (r != MPC_SIM_FAIL) { return MPC_SIM_UNKNOWN; }
+      if (*ret == NULL) { return MPC_SIM_FAIL; }
+      if (q->op == MPC_VM_COUNT) {
+        sprintf(prefix, "%i of ", q->data.repeat.n);
+        *ret = mpc_compile_repeat(prog, prefix, *ret);
       } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
+        *ret = mpc_compile_repeat(prog, "one or more of ", *ret);
       }
+      return MPC_SIM_FAIL;
 
-    /* Repeat Parsers */
+    case MPC_VM_OR:
+      for (k = 0; k < q->data.or.n; k++) {
+        r = mpc_compile_sim(prog, q->xs[k], c, ev, ret, depth+1);
+        if (r != MPC_SIM_FAIL) { return r; }
+        mpc_strs_add(ev, *ret);
+      }
+      *ret = NULL;
+      return q->data.or.n ? MPC_SIM_FAIL : MPC_SIM_EMPTY;
 
-    case MPC_TYPE_MANY:
+    case MPC_VM_AND:
+      for (k = 0; k < q->data.and.n; k++) {
+        r = mpc_compile_sim(prog, q->xs[k], c, ev, ret, depth+1);
+        if (r != MPC_SIM_EMPTY) { return r; }
+      }
+      return MPC_SIM_EMPTY;
 
-      results = results_stk;
+    default:
+      return MPC_SIM_UNKNOWN;
+  }
+}
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        results = mpc_grow_results(i, j, results_stk, results);
-      }
+static int mpc_compile_plan_eq(mpc_step_t *a, mpc_step_t *b) {
+  for (;; a++, b++) {
+    if (a->k != b->k || a->expected_num != b->expected_num) { return 0; }
+    if (a->expected_num && memcmp(a->expected, b->expected, sizeof(char*) * a->expected_num) != 0) { return 0; }
+    if (a->k == MPC_STEP_END) { return 1; }
+  }
+}
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+static void mpc_compile_dispatch(mpc_program_t *prog, mpc_inst_t *q) {
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+  int c, k, j, r, mark, start, steps_num, distinct = 0, skips = 0;
+  int n = q->data.or.n;
+  char *ret;
+  mpc_inst_t *a;
+  mpc_strs_t ev;
+  mpc_step_t *steps = malloc(sizeof(mpc_step_t) * (2 * n + 2));
+  int *starts = malloc(sizeof(int) * (2 * n + 2));
+  mpc_step_t **plans = malloc(sizeof(mpc_step_t*) * 256);
+  mpc_step_t **owned = malloc(sizeof(mpc_step_t*) * 256);
 
-    case MPC_TYPE_MANY1:
+  ev.xs = NULL;
+  ev.slots = 0;
 
-      results = results_stk;
+  for (c = 0; c < 256; c++) {
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        results = mpc_grow_results(i, j, results_stk, results);
-      }
+    ev.num = 0;
+    start = 0;
+    steps_num = 0;
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+    for (k = 0; k <= n; k++) {
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+      if (k < n) {
+        a = q->xs[k];
+        if (!a->nullable && !(c && mpc_first_has(a->first, c))) {
+          mark = ev.num;
+          r = mpc_compile_sim(prog, a, c, &ev, &ret, 0);
+          if (r == MPC_SIM_FAIL) { mpc_strs_add(&ev, ret); skips++; continue; }
+          ev.num = mark;
+        }
+      }
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      if (ev.num > start) {
+        steps[steps_num].k = MPC_STEP_MERGE;
+        steps[steps_num].expected_num = ev.num - start;
+        starts[steps_num] = start;
+        steps_num++;
+        start = ev.num;
       }
 
-   case MPC_TYPE_SEPBY1:
+      steps[steps_num].k = k < n ? k : MPC_STEP_END;
+      steps[steps_num].expected_num = 0;
+      steps[steps_num].expected = NULL;
+      steps_num++;
+    }
 
-      results = results_stk;
+    for (j = 0; j < steps_num; j++) {
+      if (steps[j].k == MPC_STEP_MERGE) { steps[j].expected = ev.xs + starts[j]; }
+    }
 
-      if(mpc_parse_run(i, p->data.sepby1.x, &results[j], e, depth+1)){
-        j++;
-        results = mpc_grow_results(i, j, results_stk, results);
+    plans[c] = NULL;
+    for (j = 0; j < distinct; j++) {
+      if (mpc_compile_plan_eq(owned[j], steps)) { plans[c] = owned[j]; break; }
+    }
+    if (plans[c]) { continue; }
+
+    plans[c] = owned[distinct++] = malloc(sizeof(mpc_step_t) * steps_num);
+    memcpy(plans[c], steps, sizeof(mpc_step_t) * steps_num);
+    for (j = 0; j < steps_num; j++) {
+      if (steps[j].k != MPC_STEP_MERGE) { continue; }
+      plans[c][j].expected = mpc_program_alloc(prog, sizeof(char*) * steps[j].expected_num);
+      memcpy(plans[c][j].expected, steps[j].expected, sizeof(char*) * steps[j].expected_num);
+    }
+  }
 
-        while (
-          mpc_parse_run(i, p->data.sepby1.sep, &results[j], e, depth+1) &&
-          mpc_parse_run(i, p->data.sepby1.x, &results[j], e, depth+1)
-        ) {
-          j++;
-          results = mpc_grow_results(i, j, results_stk, results);
-        }
-      }
+  if (skips) {
+    q->dispatch = mpc_program_keep(prog, plans);
+    for (j = 0; j < distinct; j++) { mpc_program_keep(prog, owned[j]); }
+  } else {
+    free(plans);
+    for (j = 0; j < distinct; j++) { free(owned[j]); }
+  }
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        *e = mpc_err_merge(i, *e, results[j].error);
+  free(owned);
+  free(starts);
+  free(steps);
+  free(ev.xs);
+}
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+/*
+** Spans
+**
+** A parser can run as a span when it and everything below it
+** return the characters they consume: character classes,
+** strings, string lifts, and expectations, options, repeats,
+** choices and sequences folded with mpcf_strfold. Recursive
+** parsers never qualify, so a span is always matched with
+** bounded recursion.
+*/
 
+static int mpc_compile_span_kind(mpc_inst_t *q) {
+  switch (q->p->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF: return MPC_SPAN_CLASS;
+    case MPC_TYPE_STRING: return MPC_SPAN_STRING;
+    case MPC_TYPE_EXPECT: return MPC_SPAN_EXPECT;
+    case MPC_TYPE_LIFT:  return q->data.lift.lf == mpcf_ctor_str ? MPC_SPAN_LIFT : MPC_SPAN_NONE;
+    case MPC_TYPE_MAYBE: return q->data.not.lf == mpcf_ctor_str ? MPC_SPAN_MAYBE : MPC_SPAN_NONE;
+    case MPC_TYPE_MANY:  return q->data.repeat.f == mpcf_strfold ? MPC_SPAN_MANY : MPC_SPAN_NONE;
+    case MPC_TYPE_MANY1: return q->data.repeat.f == mpcf_strfold ? MPC_SPAN_MANY1 : MPC_SPAN_NONE;
     case MPC_TYPE_COUNT:
+      return q->data.repeat.f == mpcf_strfold && q->data.repeat.n > 0 ? MPC_SPAN_COUNT : MPC_SPAN_NONE;
+    case MPC_TYPE_OR:
+      return q->data.or.n > 0 ? MPC_SPAN_OR : MPC_SPAN_NONE;
+    case MPC_TYPE_AND:
+      return q->data.and.f == mpcf_strfold && q->data.and.n > 0 ? MPC_SPAN_AND : MPC_SPAN_NONE;
+    default: return MPC_SPAN_NONE;
+  }
+}
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+static int mpc_compile_span(mpc_program_t *prog, mpc_inst_t *q, char *seen) {
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+  int j, n, ok;
+  int k = (int)(q - prog->insts);
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+  if (seen[k]) { return seen[k] == 2; }
+  seen[k] = 1;
 
-    /* Combinatory Parsers */
+  q->span = mpc_compile_span_kind(q);
+  ok = q->span != MPC_SPAN_NONE;
 
-    case MPC_TYPE_OR:
+  if (ok && (q->span == MPC_SPAN_OR || q->span == MPC_SPAN_AND)) {
+    n = q->span == MPC_SPAN_OR ? q->data.or.n : q->data.and.n;
+    for (j = 0; ok && j < n; j++) { ok = mpc_compile_span(prog, q->xs[j], seen); }
+  } else if (ok && q->x) {
+    ok = mpc_compile_span(prog, q->x, seen);
+  }
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+  if (!ok) { q->span = MPC_SPAN_NONE; }
+  seen[k] = ok ? 2 : 3;
+  return ok;
+}
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+static void mpc_compile_scan(mpc_inst_t *q) {
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        }
-      }
+  int c, high = 0;
+  mpc_inst_t *x = q->x;
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+  if (x->span == MPC_SPAN_EXPECT) { x = x->x; }
+  if (x->span != MPC_SPAN_CLASS) { return; }
 
-    case MPC_TYPE_AND:
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+  for (c = 1; c < 128; c++) {
+    if (mpc_first_has(x->first, c)) { x->nibbles[c & 15] |= (unsigned char)(1 << (c >> 4)); }
+  }
+  for (c = 128; c < 256; c++) { high += mpc_first_has(x->first, c); }
+  x->high = high == 0 ? 0 : high == 128 ? 1 : -1;
+  q->scan = x;
+  q->scan_fn = mpc_span_scan;
+
+#if MPC_HAVE_SCAN
+  if (__builtin_cpu_supports("avx2")) {
+    q->scan_fn = mpc_span_scan_avx2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    q->scan_fn = mpc_span_scan_ssse3;
+  }
+#endif
+}
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+static int mpc_compile_span_root(mpc_inst_t *q) {
+  if (q->span == MPC_SPAN_EXPECT) { return mpc_compile_span_root(q->x); }
+  return q->span >= MPC_SPAN_MAYBE;
+}
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        }
-      }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+void mpc_compile(mpc_parser_t *p) {
 
-    /* End */
+  int j, k, n, xs_num = 0;
+  mpc_compiler_t c;
+  mpc_program_t *prog;
+  mpc_parser_t *two[2];
+  mpc_parser_t **xs;
+  mpc_inst_t *q;
+  char *seen;
 
-    default:
+  c.ps_num = 0;
+  c.ps_slots = 64;
+  c.ps = malloc(sizeof(mpc_parser_t*) * c.ps_slots);
+  c.table_slots = 128;
+  c.table = malloc(sizeof(int) * c.table_slots);
+  for (j = 0; j < c.table_slots; j++) { c.table[j] = -1; }
+
+  mpc_compile_visit(&c, p);
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  for (j = 0; j < c.ps_num; j++) {
+    if (c.ps[j]->type == MPC_TYPE_OR || c.ps[j]->type == MPC_TYPE_AND) {
+      mpc_compile_children(c.ps[j], two, &n);
+      xs_num += n;
+    }
   }
 
-  return 0;
+  prog = malloc(sizeof(mpc_program_t));
+  prog->insts_num = c.ps_num;
+  prog->insts = calloc(c.ps_num, sizeof(mpc_inst_t));
+  prog->xs = malloc(sizeof(mpc_inst_t*) * (xs_num + 1));
+  prog->blocks = NULL;
+  prog->blocks_num = 0;
+  prog->blocks_slots = 0;
+  xs_num = 0;
+
+  for (j = 0; j < c.ps_num; j++) {
+
+    q = &prog->insts[j];
+    q->p = c.ps[j];
+    q->data = c.ps[j]->data;
+    q->op = mpc_compile_op(c.ps[j]);
+    q->leaf = mpc_compile_leaf(c.ps[j]) ? MPC_INST_LEAF : MPC_INST_NODE;
+
+    xs = mpc_compile_children(c.ps[j], two, &n);
+    if (n == 0) { continue; }
+
+    if (c.ps[j]->type == MPC_TYPE_OR || c.ps[j]->type == MPC_TYPE_AND) {
+      q->xs = prog->xs + xs_num;
+      for (k = 0; k < n; k++) { q->xs[k] = &prog->insts[mpc_compile_find(&c, xs[k])]; }
+      xs_num += n;
+      continue;
+    }
 
-}
+    q->x = &prog->insts[mpc_compile_find(&c, xs[0])];
+    if (n == 2) { q->sep = &prog->insts[mpc_compile_find(&c, xs[1])]; }
+    if (q->op == MPC_VM_EXPECT && mpc_compile_leaf(xs[0])) { q->leaf = MPC_INST_EXPECT_LEAF; }
+  }
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+  /* Repeats of a single expectation keep their error message ready */
+  for (j = 0; j < c.ps_num; j++) {
+    q = &prog->insts[j];
+    if ((q->op == MPC_VM_MANY1 || q->op == MPC_VM_SEPBY1) && q->x->leaf == MPC_INST_EXPECT_LEAF) {
+      q->expected = mpc_compile_repeat(prog, "one or more of ", q->x->data.expect.m);
+    }
+  }
+
+  mpc_compile_first(prog);
+  for (j = 0; j < c.ps_num; j++) {
+    if (prog->insts[j].op == MPC_VM_OR) { mpc_compile_dispatch(prog, &prog->insts[j]); }
+  }
+
+  seen = calloc(c.ps_num, 1);
+  for (j = 0; j < c.ps_num; j++) {
+    q = &prog->insts[j];
+    if (mpc_compile_span(prog, q, seen) && mpc_compile_span_root(q)) { q->leaf = MPC_INST_SPAN; }
+  }
+  for (j = 0; j < c.ps_num; j++) {
+    q = &prog->insts[j];
+    if (q->span == MPC_SPAN_MANY || q->span == MPC_SPAN_MANY1) { mpc_compile_scan(q); }
+  }
+  free(seen);
+
+  free(c.ps);
+  free(c.table);
+
+  mpc_program_delete(p->program);
+  p->program = prog;
+}
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
+  x = p->program ? mpc_vm_run(i, p->program, r, &e) : mpc_parse_run(i, p, r, &e);
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
@@ -1352,25 +3433,59 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   return x;
 }
 
-int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+int mpc_nparse_borrowed(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
+  mpc_input_t *i = mpc_input_new_nstring_borrowed(filename, string, length);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
 }
 
+int mpc_parse_borrowed(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_nparse_borrowed(filename, string, strlen(string), p, r);
+}
+
+int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_borrowed(filename, string, p, r);
+}
+
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_nparse_borrowed(filename, string, length, p, r);
+}
+
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  long offset;
+  mpc_input_t *i = NULL;
+
+#if MPC_HAVE_MMAP
+  /* Regular files are mapped from the current position and the position is advanced after */
+  offset = ftell(file);
+  if (offset >= 0) { i = mpc_input_new_mmap(filename, fileno(file), offset); }
+  if (i) {
+    x = mpc_parse_input(i, p, r);
+    fseek(file, offset + i->state.pos, SEEK_SET);
+    mpc_input_delete(i);
+    return x;
+  }
+#else
+  (void)offset;
+#endif
+
+  i = mpc_input_new_file(filename, file);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
 }
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+int mpc_parse_mmap(const char *filename, int fd, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
+  mpc_input_t *i = mpc_input_new_mmap(filename, fd, 0);
+  if (i == NULL) {
+    r->output = NULL;
+    r->error = mpc_err_file(filename, "Unable to map file!");
+    return 0;
+  }
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1431,12 +3546,18 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
 
   if (p->retained && !force) { return; }
 
+  mpc_program_delete(p->program);
+  p->program = NULL;
+
   switch (p->type) {
 
     case MPC_TYPE_FAIL: free(p->data.fail.m); break;
 
     case MPC_TYPE_ONEOF:
     case MPC_TYPE_NONEOF:
+      free(p->data.set.x);
+      break;
+
     case MPC_TYPE_STRING:
       free(p->data.string.x);
       break;
@@ -1444,6 +3565,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1549,6 +3671,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
 
     case MPC_TYPE_ONEOF:
     case MPC_TYPE_NONEOF:
+      p->data.set.x = malloc(strlen(a->data.set.x)+1);
+      strcpy(p->data.set.x, a->data.set.x);
+      break;
+
     case MPC_TYPE_STRING:
       p->data.string.x = malloc(strlen(a->data.string.x)+1);
       strcpy(p->data.string.x, a->data.string.x);
@@ -1557,6 +3683,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     p->data.memo.x     = mpc_copy(a->data.memo.x);     break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1625,14 +3752,19 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
 
 mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
 
+  mpc_program_delete(p->program);
+  p->program = NULL;
+
   if (p->retained) {
     p->type = a->type;
     p->data = a->data;
+    p->program = a->program;
   } else {
     mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
     p->type = a2->type;
     p->data = a2->data;
     free(a2);
+    mpc_program_delete(a->program);
   }
 
   free(a);
@@ -1814,16 +3946,18 @@ mpc_parser_t *mpc_range(char s, char e) {
 mpc_parser_t *mpc_oneof(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
+  p->data.set.x = malloc(strlen(s) + 1);
+  strcpy(p->data.set.x, s);
+  mpc_set_build(p->data.set.set, s, 0);
   return mpc_expectf(p, "one of '%s'", s);
 }
 
 mpc_parser_t *mpc_noneof(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
+  p->data.set.x = malloc(strlen(s) + 1);
+  strcpy(p->data.set.x, s);
+  mpc_set_build(p->data.set.set, s, 1);
   return mpc_expectf(p, "none of '%s'", s);
 
 }
@@ -1926,6 +4060,15 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_dtor_t da, mpc_apply_t ca) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.dx = da;
+  p->data.memo.cx = ca;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2783,7 +4926,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
 
   if (p->type == MPC_TYPE_ONEOF) {
     s = mpcf_escape_new(
-      p->data.string.x,
+      p->data.set.x,
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[%s]", s);
@@ -2792,7 +4935,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
 
   if (p->type == MPC_TYPE_NONEOF) {
     s = mpcf_escape_new(
-      p->data.string.x,
+      p->data.set.x,
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[^%s]", s);
@@ -2811,6 +4954,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2932,6 +5076,13 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 
 /*
 ** AST
+**
+** Memoised grammar rules hand out the same output every
+** time they are reused, so a node may be shared. Its
+** refs field counts the extra owners: deleting a shared
+** node only drops a reference, and the functions that
+** modify a node first take a private copy of it if it
+** is shared. Children are shared along with the copy.
 */
 
 void mpc_ast_delete(mpc_ast_t *a) {
@@ -2939,6 +5090,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
   int i;
 
   if (a == NULL) { return; }
+  if (a->refs > 0) { a->refs--; return; }
 
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
@@ -2958,6 +5110,32 @@ static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a);
 }
 
+static mpc_ast_t *mpc_ast_share(mpc_ast_t *a) {
+  if (a != NULL) { a->refs++; }
+  return a;
+}
+
+static mpc_ast_t *mpc_ast_own(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *b;
+
+  if (a == NULL || a->refs == 0) { return a; }
+
+  b = mpc_ast_new(a->tag, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  if (a->children_num > 0) {
+    b->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+    for (i = 0; i < a->children_num; i++) {
+      b->children[i] = mpc_ast_share(a->children[i]);
+    }
+  }
+
+  a->refs--;
+  return b;
+}
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
@@ -2972,10 +5150,31 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   a->children_num = 0;
   a->children = NULL;
+  a->refs = 0;
   return a;
 
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *b;
+
+  if (a == NULL) { return NULL; }
+
+  b = mpc_ast_new(a->tag, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  if (a->children_num > 0) {
+    b->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+    for (i = 0; i < a->children_num; i++) {
+      b->children[i] = mpc_ast_copy(a->children[i]);
+    }
+  }
+
+  return b;
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -3023,6 +5222,7 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  r = mpc_ast_own(r);
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
@@ -3031,6 +5231,7 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -3040,6 +5241,7 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
@@ -3047,6 +5249,7 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  a = mpc_ast_own(a);
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -3054,6 +5257,7 @@ mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->state = s;
   return a;
 }
@@ -3276,6 +5480,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   for (i = 0; i < n; i++) {
 
     if (as[i] == NULL) { continue; }
+    if (as[i]->children_num > 0) { as[i] = mpc_ast_own(as[i]); }
 
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
@@ -3382,6 +5587,7 @@ mpc_parser_t *mpca_and(int n, ...) {
 }
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, (mpc_dtor_t)mpc_ast_delete, (mpc_apply_t)mpc_ast_share); }
 
 /*
 ** Grammar Parser
@@ -3653,9 +5859,19 @@ mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
   return res;
 }
 
+/*
+** Statements of a language are
+**
+**      <stmt> : <ident> <string_lit>? "@memo"? ":" <grammar> ";"
+**
+** where "@memo" makes the rule a packrat parser, so its
+** result at each input position is only computed once.
+*/
+
 typedef struct {
   char *ident;
   char *name;
+  int memo;
   mpc_parser_t *grammar;
 } mpca_stmt_t;
 
@@ -3663,10 +5879,12 @@ static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
   mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
   stmt->ident = ((char**)xs)[0];
   stmt->name = ((char**)xs)[1];
-  stmt->grammar = ((mpc_parser_t**)xs)[3];
+  stmt->memo = ((char**)xs)[2] != NULL;
+  stmt->grammar = ((mpc_parser_t**)xs)[4];
   (void) n;
   free(((char**)xs)[2]);
-  free(((char**)xs)[4]);
+  free(((char**)xs)[3]);
+  free(((char**)xs)[5]);
 
   return stmt;
 }
@@ -3712,6 +5930,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (stmt->memo) { stmt->grammar = mpca_memo(stmt->grammar); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
@@ -3743,9 +5962,10 @@ static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
     mpca_stmt_list_apply_to, st
   ));
 
-  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
-    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
-    free, free, free, mpc_soft_delete
+  mpc_define(Stmt, mpc_and(6, mpca_stmt_afold,
+    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_maybe(mpc_sym("@memo")),
+    mpc_sym(":"), Grammar, mpc_sym(";"),
+    free, free, free, free, mpc_soft_delete
   ));
 
   mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
@@ -3906,6 +6126,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3965,6 +6186,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)       { mpc_optimise_unretained(p->data.memo.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
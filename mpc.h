@@ -22,6 +22,21 @@ extern "C" {
 #include <errno.h>
 #include <ctype.h>
 
+/*
+** Allocator
+*/
+
+/*
+** Every allocation mpc makes, including the memory it hands back
+** (ASTs, errors, strings), goes through these functions. They default
+** to the C library and must be changed before any other mpc call.
+*/
+void mpc_set_allocator(
+  void *(*malloc_fn)(size_t),
+  void *(*calloc_fn)(size_t, size_t),
+  void *(*realloc_fn)(void *, size_t),
+  void (*free_fn)(void *));
+
 /*
 ** State Type
 */
@@ -71,6 +86,22 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Parse the caller's buffer in place, without copying it.
+** The buffer must stay alive and unchanged until the call
+** returns; the results never point into it. mpc_parse and
+** mpc_nparse are wrappers around these.
+*/
+int mpc_parse_borrowed(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_nparse_borrowed(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+
+/*
+** Parse a regular file through a read-only memory map
+** of its whole contents. mpc_parse_file and
+** mpc_parse_contents do this automatically when they can.
+*/
+int mpc_parse_mmap(const char *filename, int fd, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -97,6 +128,17 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p);
 void mpc_delete(mpc_parser_t *p);
 void mpc_cleanup(int n, ...);
 
+/*
+** Parse Stack
+*/
+
+/*
+** Parsers run on an explicit stack instead of the C stack, so the
+** nesting depth of the input is only limited by this many bytes of
+** stack frames (256 MiB by default). Parses that need more fail.
+*/
+void mpc_set_parse_stack_limit(size_t bytes);
+
 /*
 ** Basic Parsers
 */
@@ -147,6 +189,7 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_dtor_t da, mpc_apply_t ca);
 
 /*
 ** Common Parsers
@@ -288,9 +331,11 @@ typedef struct mpc_ast_t {
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  int refs;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
@@ -341,6 +386,7 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -372,6 +418,17 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
 void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
+
+/*
+** Compiles the grammar below a parser into a flat program that all the
+** mpc_parse functions then run in place of walking the parser graph.
+** Compile once the grammar is fully defined and optimised; defining or
+** undefining the parser drops the program, but changes to the parsers
+** below it need it compiling again. Regular expressions, including the
+** ones in mpca_lang grammars, are matched without building a string per
+** character once compiled.
+*/
+void mpc_compile(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
@@ -1,5 +1,16 @@
+/* Interfaces POSIX 2008 (open_memstream, posix_memalign, mmap) mesmo com -std=c99 */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "mpc.h"
 
@@ -25,19 +36,337 @@ void add_history(char* unused) {}
 /* Senão, se não for Windows, inclua as bibliotecas readline padrão */
 #else
 #include <editline/readline.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <sys/resource.h>
+#endif
+
+/*
+ * Memória. Toda alocação do interpretador, e a do mpc via
+ * mpc_set_allocator, passa por lmem_alloc, que guarda o tamanho num
+ * cabeçalho e soma o total em uso. Com um orçamento (circe -m, CIRCE_HEAP
+ * ou heap-limit), passar dele não derruba o processo: a alocação acontece,
+ * lmem_over é ligado e o avaliador devolve um erro no próximo ponto seguro,
+ * e a computação é desfeita liberando o que montou pelo caminho normal de
+ * lval_del. Tudo que cresce com a entrada (vetores, matrizes, buffers de
+ * linha e de registro, o texto que vai para o parser) passa antes por
+ * lmem_admit ou lmem_try_alloc e é recusado sem ser alocado.
+ *
+ * Se o próprio sistema recusar um malloc pequeno, a reserva de
+ * LMEM_RESERVE bytes separada no início é devolvida para que a alocação
+ * aconteça, e lmem_failed faz o próximo ponto seguro devolver o erro. Só
+ * uma segunda falha antes desse ponto encerra o processo.
+ */
+#define LMEM_HEADER 16
+
+static size_t lmem_budget;
+static size_t lmem_used;
+static size_t lmem_peak;
+static int lmem_over;
+
+enum { LMEM_RESERVE = 1 << 20 };
+static void* lmem_reserve;
+static int lmem_failed;
+
+void lmem_init(void) {
+    lmem_reserve = malloc(LMEM_RESERVE);
+}
+
+/* O malloc falhou: soltar a reserva para a próxima tentativa dar certo */
+void lmem_oom(void) {
+    void* r = __atomic_exchange_n(&lmem_reserve, NULL, __ATOMIC_ACQ_REL);
+    if (!r) {
+        fputs("Erro: memória do sistema esgotada\n", stderr);
+        exit(1);
+    }
+    free(r);
+    __atomic_store_n(&lmem_failed, 1, __ATOMIC_RELAXED);
+}
+
+void lmem_update(size_t used) {
+    size_t budget = __atomic_load_n(&lmem_budget, __ATOMIC_RELAXED);
+    int over = budget && used > budget;
+    if (over != __atomic_load_n(&lmem_over, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&lmem_over, over, __ATOMIC_RELAXED);
+    }
+}
+
+void lmem_charge(size_t n) {
+    size_t used = __atomic_add_fetch(&lmem_used, n, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&lmem_peak, __ATOMIC_RELAXED);
+    while (used > peak && !__atomic_compare_exchange_n(&lmem_peak, &peak, used, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    lmem_update(used);
+}
+
+void lmem_discharge(size_t n) {
+    lmem_update(__atomic_sub_fetch(&lmem_used, n, __ATOMIC_RELAXED));
+}
+
+/* O orçamento foi ultrapassado; checado nos pontos seguros */
+int lmem_exceeded(void) {
+    return __atomic_load_n(&lmem_over, __ATOMIC_RELAXED)
+        || __atomic_load_n(&lmem_failed, __ATOMIC_RELAXED);
+}
+
+/* Se cabem mais n bytes no orçamento */
+int lmem_admit(size_t n) {
+    size_t budget = __atomic_load_n(&lmem_budget, __ATOMIC_RELAXED);
+    size_t used = __atomic_load_n(&lmem_used, __ATOMIC_RELAXED);
+    return !budget || (used <= budget && n <= budget - used);
+}
+
+/*
+ * O parse do mpc não passa por pontos seguros, então ele só começa se a
+ * árvore estimada couber no orçamento: até LPARSE_COST bytes por byte de
+ * texto, medido com expressões curtas como (+ 1 2) repetidas.
+ */
+enum { LPARSE_COST = 320 };
+
+void* lmem_alloc(size_t n) {
+    char* p;
+    while (!(p = malloc(n + LMEM_HEADER))) { lmem_oom(); }
+    *(size_t*)p = n;
+    lmem_charge(n);
+    return p + LMEM_HEADER;
+}
+
+void* lmem_calloc(size_t n, size_t size) {
+    /* Só tamanhos fixos do interpretador chegam aqui; transbordar é um bug */
+    if (size && n > ((size_t)-1 - LMEM_HEADER) / size) { abort(); }
+    char* p;
+    while (!(p = calloc(1, n * size + LMEM_HEADER))) { lmem_oom(); }
+    *(size_t*)p = n * size;
+    lmem_charge(n * size);
+    return p + LMEM_HEADER;
+}
+
+void* lmem_realloc(void* q, size_t n) {
+    if (!q) { return lmem_alloc(n); }
+    char* p = (char*)q - LMEM_HEADER;
+    size_t old = *(size_t*)p;
+    char* r;
+    while (!(r = realloc(p, n + LMEM_HEADER))) { lmem_oom(); }
+    p = r;
+    *(size_t*)p = n;
+    if (n > old) { lmem_charge(n - old); } else { lmem_discharge(old - n); }
+    return p + LMEM_HEADER;
+}
+
+/* Para blocos que crescem com a entrada: NULL se não cabe, sem alocar */
+void* lmem_try_alloc(size_t n) {
+    if (n > (size_t)-1 - LMEM_HEADER || !lmem_admit(n)) { return NULL; }
+    char* p = malloc(n + LMEM_HEADER);
+    if (!p) { return NULL; }
+    *(size_t*)p = n;
+    lmem_charge(n);
+    return p + LMEM_HEADER;
+}
+
+/* Como lmem_try_alloc; se falhar, q continua válido */
+void* lmem_try_realloc(void* q, size_t n) {
+    if (!q) { return lmem_try_alloc(n); }
+    char* p = (char*)q - LMEM_HEADER;
+    size_t old = *(size_t*)p;
+    if (n > (size_t)-1 - LMEM_HEADER || (n > old && !lmem_admit(n - old))) { return NULL; }
+    p = realloc(p, n + LMEM_HEADER);
+    if (!p) { return NULL; }
+    *(size_t*)p = n;
+    if (n > old) { lmem_charge(n - old); } else { lmem_discharge(old - n); }
+    return p + LMEM_HEADER;
+}
+
+void lmem_free(void* q) {
+    if (!q) { return; }
+    char* p = (char*)q - LMEM_HEADER;
+    lmem_discharge(*(size_t*)p);
+    free(p);
+}
+
+char* lmem_strdup(const char* s) {
+    size_t n = strlen(s) + 1;
+    return memcpy(lmem_alloc(n), s, n);
+}
+
+/* Tamanho em bytes, com sufixo k, m ou g opcional; -1 se inválido */
+long long lmem_parse_size(const char* s) {
+    char* end;
+    errno = 0;
+    long long n = strtoll(s, &end, 10);
+    if (errno || end == s || n < 0) { return -1; }
+    switch (*end) {
+        case 'k': case 'K': n <<= 10; end++; break;
+        case 'm': case 'M': n <<= 20; end++; break;
+        case 'g': case 'G': n <<= 30; end++; break;
+    }
+    return *end ? -1 : n;
+}
+
+/*
+ * Pilha. A avaliação recursa na pilha do C uma vez por nível de
+ * aninhamento ou chamada fora de cauda, e a leitura uma vez por nível da
+ * árvore. Cada contexto que avalia (a thread principal, os workers e as
+ * corrotinas) anota o fundo utilizável da sua pilha, e lval_eval_in
+ * devolve um erro ao chegar nele em vez de estourar a pilha.
+ */
+enum {
+    LSTACK_MARGIN = 256 * 1024,
+    LTHREAD_STACK = 8 << 20,
+    LREAD_DEPTH = 4096
+};
+
+static __thread char* lstack_floor;
+
+/* O contexto atual tem size bytes de pilha abaixo de top */
+void lstack_set(char* top, size_t size) {
+    lstack_floor = size > LSTACK_MARGIN ? top - size + LSTACK_MARGIN : top;
+}
+
+/* Chamada no início de uma thread com size bytes de pilha */
+__attribute__((noinline)) void lstack_enter(size_t size) {
+    char top;
+    lstack_set(&top, size);
+}
+
+/* Não inlinada: uma corrotina pode continuar em outra thread (veja lworker_current) */
+__attribute__((noinline)) int lstack_exhausted(void) {
+    char here;
+    return lstack_floor && (uintptr_t)&here < (uintptr_t)lstack_floor;
+}
+
+/* Pilha da thread principal, pelo limite do processo */
+size_t lstack_main_size(void) {
+#ifndef _WIN32
+    struct rlimit r;
+    if (getrlimit(RLIMIT_STACK, &r) == 0 && r.rlim_cur != RLIM_INFINITY && r.rlim_cur < LTHREAD_STACK) {
+        return r.rlim_cur;
+    }
+    return LTHREAD_STACK;
+#else
+    return 1 << 20;
 #endif
+}
 
 /* Definindo tipos de valores possíveis. */
-enum {LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_SEXPR};
+enum {LVAL_ERR, LVAL_NUM, LVAL_DBL, LVAL_SYM, LVAL_STR, LVAL_VEC, LVAL_MAT, LVAL_FUN, LVAL_CHAN, LVAL_SEQ, LVAL_FFI, LVAL_SEXPR, LVAL_QEXPR};
+
+/* Tipos de elemento dos vetores numéricos */
+enum {LVEC_INT, LVEC_DBL};
+
+/*
+ * Strings com até LSTR_INLINE - 1 bytes ficam dentro do próprio lval. Até
+ * LSTR_ROPE_MIN bytes ficam num buffer plano; acima disso as concatenações
+ * viram nós de uma rope, que só é percorrida quando alguém precisa do texto.
+ *
+ * Buffers e ropes são compartilhados por contagem entre as cópias, e o hash
+ * e o texto achatado de uma rope ficam guardados neles, não no lval: como
+ * ler uma variável copia o valor, só assim o que uma cópia calculou serve
+ * para a próxima.
+ */
+enum {
+    LSTR_INLINE = 24,
+    LSTR_ROPE_MIN = 256,
+    LSTR_LEAF_MAX = 4096,
+    LSTR_DEPTH_MAX = 48
+};
+
+/* Nó de rope. Folhas têm texto em flat, nós internos têm left e right. */
+typedef struct lrope {
+    int refs;
+    int depth;
+    long len;
+    long cap;
+    char* flat;
+    struct lrope* left;
+    struct lrope* right;
+
+    /* Hash e texto contíguo (um buffer de string), calculados na primeira vez */
+    unsigned long hash;
+    char* text;
+} lrope;
+
+/* Cabeçalho de um buffer de string no heap, logo antes do texto */
+typedef struct {
+    long refs;
+    unsigned long hash;
+} lstr_head;
+
+#define LSTR_HEAD(p) ((lstr_head*)((char*)(p) - sizeof(lstr_head)))
+
+typedef struct {
+    long len;
+
+    /* Hash FNV-1a do texto, 0 enquanto não foi calculado */
+    unsigned long hash;
+
+    /* Texto numa rope, num buffer no heap ou inline, nessa ordem */
+    lrope* rope;
+    char* heap;
+    char small[LSTR_INLINE];
+} lstr;
+
+/*
+ * Como um símbolo foi resolvido pelo compilador: ainda livre, célula global,
+ * slot de argumento do frame atual, índice no vetor de capturas da closure
+ * ou forma especial (lambda, def).
+ */
+enum {LSYM_FREE, LSYM_GLOBAL, LSYM_LOCAL, LSYM_CAPTURE, LSYM_SPECIAL};
+
+struct lval;
+struct lfun;
+struct lglobal;
+struct lchan;
+struct lseq;
+struct lffi;
 
 /* Definindo o novo tipo lval */
 typedef struct lval {
     int type;
     long num;
+    double dbl;
 
     /* Erro e símbolo são representados como dados string */
-    char err;
-    char sym;
+    char* err;
+    char* sym;
+
+    /* Resolução do símbolo, preenchida por lval_compile() */
+    int sym_kind;
+    int slot;
+    struct lglobal* global;
+
+    /* Valor string */
+    lstr str;
+
+    /* Vetor numérico: vlen elementos int64_t ou double contíguos e alinhados */
+    int vtype;
+    long vlen;
+    void* vdata;
+
+    /* Matriz: rows x cols doubles em row-major, no mesmo buffer vdata */
+    long rows;
+    long cols;
+
+    /* Função: código compartilhado e valores capturados, copiados na criação */
+    struct lfun* fun;
+    struct lval** env;
+
+    /* Canal entre green threads, compartilhado por contagem */
+    struct lchan* chan;
+
+    /* Sequência preguiçosa, compartilhada por contagem */
+    struct lseq* seq;
+
+    /* Biblioteca ou função nativa do FFI */
+    struct lffi* ffi;
+
+    /* Chamada aritmética binária: operador e estado do quickening */
+    int qop;
+    int qstate;
+    int qknown;
 
     /* Contador de células e ponteiro para células */
     int count;
@@ -45,82 +374,696 @@ typedef struct lval {
 
 } lval;
 
+void lval_del(lval* v);
+
+/*
+ * Código de uma lambda, compartilhado entre todas as closures criadas a
+ * partir dela. capture_kind/capture_slot dizem de onde cada valor capturado
+ * é copiado no frame de quem cria a closure.
+ */
+typedef struct lfun {
+    int refs;
+    int nparams;
+    char** params;
+    int ncaptures;
+    char** captures;
+    int* capture_kind;
+    int* capture_slot;
+    lval* body;
+} lfun;
+
+void lfun_release(lfun* f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    for (int i = 0; i < f->nparams; i++) { lmem_free(f->params[i]); }
+    for (int i = 0; i < f->ncaptures; i++) { lmem_free(f->captures[i]); }
+    lmem_free(f->params);
+    lmem_free(f->captures);
+    lmem_free(f->capture_kind);
+    lmem_free(f->capture_slot);
+    if (f->body) { lval_del(f->body); }
+    lmem_free(f);
+}
+
 /* Construir um ponteiro par um novo Número lval */
 lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lmem_alloc(sizeof(lval));
     v->type = LVAL_NUM;
     v->num = x;
     return v;
 }
 
+/* Construir um ponteiro para um novo Número de ponto flutuante lval */
+lval* lval_dbl(double x) {
+    lval* v = lmem_alloc(sizeof(lval));
+    v->type = LVAL_DBL;
+    v->dbl = x;
+    return v;
+}
+
 /* Função para criar um ponteiro para novo lval de erro */
 lval* lval_err(char* m) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lmem_alloc(sizeof(lval));
     v->type = LVAL_ERR;
-    v->err = malloc(strlen(m) + 1);
+    v->err = lmem_alloc(strlen(m) + 1);
     strcpy(v->err, m);
     return v;
 }
 
+/* Erro devolvido nos pontos seguros e por alocações recusadas */
+lval* lmem_err(void) {
+    /* Uma falha do sistema é informada uma vez, e a reserva é refeita */
+    if (__atomic_exchange_n(&lmem_failed, 0, __ATOMIC_RELAXED)) {
+        void* r = malloc(LMEM_RESERVE);
+        void* none = NULL;
+        if (r && !__atomic_compare_exchange_n(&lmem_reserve, &none, r, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) { free(r); }
+        return lval_err("Memória esgotada: o sistema recusou uma alocação!");
+    }
+    size_t budget = __atomic_load_n(&lmem_budget, __ATOMIC_RELAXED);
+    if (!budget) { return lval_err("Memória esgotada: o sistema recusou uma alocação!"); }
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Memória esgotada: orçamento de %zu bytes excedido!", budget);
+    return lval_err(msg);
+}
+
 /* Função para criar um ponteiro para novo lval de símbolo */
 lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lmem_alloc(sizeof(lval));
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
+    v->sym = lmem_alloc(strlen(s) + 1);
     strcpy(v->sym, s);
+    v->sym_kind = LSYM_FREE;
+    return v;
+}
+
+/* Buffer de string para len bytes e o terminador, com uma referência */
+char* lstr_heap_alloc(long len) {
+    lstr_head* h = lmem_alloc(sizeof(lstr_head) + len + 1);
+    h->refs = 1;
+    h->hash = 0;
+    return (char*)(h + 1);
+}
+
+char* lstr_heap_ref(char* p) {
+    __atomic_add_fetch(&LSTR_HEAD(p)->refs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+void lstr_heap_release(char* p) {
+    if (!p || __atomic_sub_fetch(&LSTR_HEAD(p)->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    lmem_free(LSTR_HEAD(p));
+}
+
+/* Reservar espaço para uma string de len bytes, sem inicializar o texto */
+lval* lval_str_alloc(long len) {
+    lval* v = lmem_alloc(sizeof(lval));
+    v->type = LVAL_STR;
+    v->str.len = len;
+    v->str.hash = 0;
+    v->str.rope = NULL;
+    v->str.heap = len < LSTR_INLINE ? NULL : lstr_heap_alloc(len);
+    return v;
+}
+
+/* Ponteiro para o texto de uma string que não está numa rope */
+char* lval_str_buf(lval* v) {
+    return v->str.heap ? v->str.heap : v->str.small;
+}
+
+/* Função para criar um ponteiro para novo lval de string */
+lval* lval_str(const char* s, long len) {
+    lval* v = lval_str_alloc(len);
+    char* buf = lval_str_buf(v);
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    return v;
+}
+
+lrope* lrope_leaf(const char* s, long len) {
+    lrope* r = lmem_alloc(sizeof(lrope));
+    r->refs = 1;
+    r->depth = 0;
+    r->len = len;
+    r->cap = len < LSTR_ROPE_MIN ? LSTR_ROPE_MIN : len;
+    r->flat = lmem_alloc(r->cap);
+    memcpy(r->flat, s, len);
+    r->left = NULL;
+    r->right = NULL;
+    r->hash = 0;
+    r->text = NULL;
+    return r;
+}
+
+lrope* lrope_node(lrope* left, lrope* right) {
+    lrope* r = lmem_alloc(sizeof(lrope));
+    r->refs = 1;
+    r->depth = 1 + (left->depth > right->depth ? left->depth : right->depth);
+    r->len = left->len + right->len;
+    r->cap = 0;
+    r->flat = NULL;
+    r->left = left;
+    r->right = right;
+    r->hash = 0;
+    r->text = NULL;
+    return r;
+}
+
+/* A contagem de referências é atômica: ropes podem ser compartilhadas entre threads */
+lrope* lrope_ref(lrope* r) {
+    __atomic_add_fetch(&r->refs, 1, __ATOMIC_RELAXED);
+    return r;
+}
+
+void lrope_release(lrope* r) {
+    while (r && __atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        lrope* right = r->right;
+        if (r->left) { lrope_release(r->left); }
+        lmem_free(r->flat);
+        lstr_heap_release(r->text);
+        lmem_free(r);
+        r = right;
+    }
+}
+
+/* Visitar os pedaços de texto de uma rope, da esquerda para a direita */
+void lrope_each(lrope* r, void (*f)(const char*, long, void*), void* d) {
+    while (r->flat == NULL) {
+        lrope_each(r->left, f, d);
+        r = r->right;
+    }
+    f(r->flat, r->len, d);
+}
+
+void lrope_collect(lrope* r, lrope** leaves, int* n) {
+    while (r->flat == NULL) {
+        lrope_collect(r->left, leaves, n);
+        r = r->right;
+    }
+    leaves[(*n)++] = lrope_ref(r);
+}
+
+lrope* lrope_build(lrope** leaves, int n) {
+    if (n == 1) { return leaves[0]; }
+    return lrope_node(lrope_build(leaves, n / 2), lrope_build(leaves + n / 2, n - n / 2));
+}
+
+int lrope_leaves(lrope* r) {
+    int n = 0;
+    while (r->flat == NULL) {
+        n += lrope_leaves(r->left);
+        r = r->right;
+    }
+    return n + 1;
+}
+
+/* Reconstruir uma rope funda como uma árvore balanceada sobre as mesmas folhas */
+lrope* lrope_balance(lrope* r) {
+    int n = 0;
+    lrope** leaves = lmem_alloc(sizeof(lrope*) * lrope_leaves(r));
+    lrope_collect(r, leaves, &n);
+    lrope* b = lrope_build(leaves, n);
+    lmem_free(leaves);
+    lrope_release(r);
+    return b;
+}
+
+/* Converter qualquer string em rope, consumindo o lval */
+lrope* lval_str_rope(lval* v) {
+    lrope* r = v->str.rope ? lrope_ref(v->str.rope) : lrope_leaf(lval_str_buf(v), v->str.len);
+    lval_del(v);
+    return r;
+}
+
+/* Concatenar duas strings, consumindo ambas */
+lval* lval_str_concat(lval* a, lval* b) {
+    long len = a->str.len + b->str.len;
+
+    /* Resultados pequenos são simplesmente copiados */
+    if (len < LSTR_ROPE_MIN && !a->str.rope && !b->str.rope) {
+        lval* v = lval_str_alloc(len);
+        char* buf = lval_str_buf(v);
+        memcpy(buf, lval_str_buf(a), a->str.len);
+        memcpy(buf + a->str.len, lval_str_buf(b), b->str.len + 1);
+        lval_del(a);
+        lval_del(b);
+        return v;
+    }
+
+    /*
+     * Anexar um pedaço pequeno a uma rope que ninguém mais vê: cresce a folha
+     * mais à direita no lugar, com capacidade dobrando, em vez de alocar um
+     * nó por concatenação.
+     */
+    lrope* r = a->str.rope;
+    if (r && !b->str.rope && b->str.len < LSTR_ROPE_MIN && r->refs == 1) {
+        lrope* leaf = r;
+        while (leaf->flat == NULL && leaf->refs == 1) { leaf = leaf->right; }
+        if (leaf->flat && leaf->refs == 1 && leaf->len + b->str.len <= LSTR_LEAF_MAX) {
+            if (leaf->len + b->str.len > leaf->cap) {
+                while (leaf->len + b->str.len > leaf->cap) { leaf->cap *= 2; }
+                leaf->flat = lmem_realloc(leaf->flat, leaf->cap);
+            }
+            memcpy(leaf->flat + leaf->len, lval_str_buf(b), b->str.len);
+            leaf->len += b->str.len;
+            for (lrope* n = r; ; n = n->right) {
+                /* O texto mudou: o que foi guardado nos nós do caminho não vale mais */
+                if (n != leaf) { n->len += b->str.len; }
+                n->hash = 0;
+                lstr_heap_release(n->text);
+                n->text = NULL;
+                if (n == leaf) { break; }
+            }
+            a->str.len = len;
+            a->str.hash = 0;
+            lval_del(b);
+            return a;
+        }
+    }
+
+    lrope* node = lrope_node(lval_str_rope(a), lval_str_rope(b));
+    if (node->depth > LSTR_DEPTH_MAX) { node = lrope_balance(node); }
+
+    lval* v = lval_str_alloc(0);
+    v->str.len = len;
+    v->str.rope = node;
+    return v;
+}
+
+void lstr_copy_piece(const char* s, long len, void* d) {
+    char** out = d;
+    memcpy(*out, s, len);
+    *out += len;
+}
+
+/* Texto contíguo de uma rope, achatado uma vez e guardado nela */
+char* lrope_text(lrope* r) {
+    char* text = __atomic_load_n(&r->text, __ATOMIC_ACQUIRE);
+    if (text) { return text; }
+
+    char* buf = lstr_heap_alloc(r->len);
+    char* out = buf;
+    lrope_each(r, lstr_copy_piece, &out);
+    buf[r->len] = '\0';
+
+    /* Outra thread pode ter achatado a mesma rope ao mesmo tempo */
+    if (__atomic_compare_exchange_n(&r->text, &text, buf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return buf;
+    }
+    lstr_heap_release(buf);
+    return text;
+}
+
+/* Texto contíguo de uma string; o lval passa a apontar para o texto achatado */
+char* lval_str_flat(lval* v) {
+    if (v->str.rope) {
+        char* buf = lstr_heap_ref(lrope_text(v->str.rope));
+        lrope_release(v->str.rope);
+        v->str.rope = NULL;
+        v->str.heap = buf;
+    }
+    return lval_str_buf(v);
+}
+
+/* Copiar len bytes a partir de start, descendo só pelos ramos necessários */
+void lrope_copy_range(lrope* r, long start, long len, char* out) {
+    while (len > 0) {
+        if (r->flat) {
+            memcpy(out, r->flat + start, len);
+            return;
+        }
+        if (start < r->left->len) {
+            long n = r->left->len - start < len ? r->left->len - start : len;
+            lrope_copy_range(r->left, start, n, out);
+            out += n;
+            len -= n;
+            start = 0;
+        } else {
+            start -= r->left->len;
+        }
+        r = r->right;
+    }
+}
+
+void lstr_hash_piece(const char* s, long len, void* d) {
+    unsigned long* h = d;
+    for (long i = 0; i < len; i++) {
+        *h = (*h ^ (unsigned char)s[i]) * 1099511628211UL;
+    }
+}
+
+/* Hash FNV-1a, calculado na primeira vez e guardado no lval e na rope ou no buffer */
+unsigned long lval_str_hash(lval* v) {
+    if (v->str.hash) { return v->str.hash; }
+
+    unsigned long* shared = v->str.rope ? &v->str.rope->hash
+        : v->str.heap ? &LSTR_HEAD(v->str.heap)->hash : NULL;
+    unsigned long h = shared ? __atomic_load_n(shared, __ATOMIC_RELAXED) : 0;
+    if (h == 0) {
+        h = 14695981039346656037UL;
+        if (v->str.rope) {
+            lrope_each(v->str.rope, lstr_hash_piece, &h);
+        } else {
+            lstr_hash_piece(lval_str_buf(v), v->str.len, &h);
+        }
+        if (h == 0) { h = 1; }
+        if (shared) { __atomic_store_n(shared, h, __ATOMIC_RELAXED); }
+    }
+    v->str.hash = h;
+    return h;
+}
+
+/*
+ * Vetores numéricos guardam os elementos num único buffer alinhado em
+ * LVEC_ALIGN bytes, para que os kernels SIMD leiam linhas de cache inteiras.
+ * O buffer é compartilhado por contagem entre as cópias de um vetor, então
+ * ler uma variável não copia os elementos; quem escreve no buffer chama
+ * lval_vec_own antes.
+ */
+enum { LVEC_ALIGN = 64 };
+
+/* Cabeçalho nos LVEC_ALIGN bytes antes dos dados */
+typedef struct {
+    size_t size;
+    long refs;
+} lvec_head;
+
+#define LVEC_HEAD(q) ((lvec_head*)((char*)(q) - LVEC_ALIGN))
+
+void* lvec_raw(size_t size) {
+    void* p = NULL;
+#ifdef _WIN32
+    p = _aligned_malloc(size + LVEC_ALIGN, LVEC_ALIGN);
+#else
+    if (posix_memalign(&p, LVEC_ALIGN, size + LVEC_ALIGN) != 0) { p = NULL; }
+#endif
+    if (!p) { return NULL; }
+    ((lvec_head*)p)->size = size;
+    ((lvec_head*)p)->refs = 1;
+    lmem_charge(size);
+    return (char*)p + LVEC_ALIGN;
+}
+
+/* O tamanho fica num cabeçalho de LVEC_ALIGN bytes antes dos dados, como em lmem_alloc */
+void* lvec_alloc(size_t size) {
+    void* p;
+    if (size == 0) { size = LVEC_ALIGN; }
+    while (!(p = lvec_raw(size))) { lmem_oom(); }
+    return p;
+}
+
+/* Como lvec_alloc, mas NULL se size não cabe no orçamento ou na memória */
+void* lvec_try_alloc(size_t size) {
+    if (size == 0) { size = LVEC_ALIGN; }
+    if (size > (size_t)-1 - LVEC_ALIGN || !lmem_admit(size)) { return NULL; }
+    return lvec_raw(size);
+}
+
+void* lvec_ref(void* q) {
+    __atomic_add_fetch(&LVEC_HEAD(q)->refs, 1, __ATOMIC_RELAXED);
+    return q;
+}
+
+void lvec_free(void* q) {
+    lvec_head* p = LVEC_HEAD(q);
+    if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    lmem_discharge(p->size);
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+/* Função para criar um ponteiro para novo lval de vetor com n elementos */
+lval* lval_vec(int vtype, long n) {
+    void* data = n >= 0 && (unsigned long)n <= (size_t)-1 / 8 ? lvec_try_alloc(n * 8) : NULL;
+    if (!data) { return lmem_err(); }
+    lval* v = lmem_alloc(sizeof(lval));
+    v->type = LVAL_VEC;
+    v->vtype = vtype;
+    v->vlen = n;
+    v->vdata = data;
+    return v;
+}
+
+/* Tornar v o único dono do seu buffer, copiando se compartilhado; 0 se a cópia foi recusada */
+int lval_vec_own(lval* v) {
+    if (__atomic_load_n(&LVEC_HEAD(v->vdata)->refs, __ATOMIC_ACQUIRE) == 1) { return 1; }
+    void* data = lvec_try_alloc(v->vlen * 8);
+    if (!data) { return 0; }
+    memcpy(data, v->vdata, v->vlen * 8);
+    lvec_free(v->vdata);
+    v->vdata = data;
+    return 1;
+}
+
+/* Converter um vetor de inteiros em double no próprio buffer; 0 se a cópia foi recusada */
+int lval_vec_to_dbl(lval* v) {
+    if (v->vtype == LVEC_DBL) { return 1; }
+    if (!lval_vec_own(v)) { return 0; }
+    int64_t* xi = v->vdata;
+    double* xd = v->vdata;
+    for (long i = 0; i < v->vlen; i++) { xd[i] = (double)xi[i]; }
+    v->vtype = LVEC_DBL;
+    return 1;
+}
+
+/* Função para criar um ponteiro para novo lval de matriz rows x cols */
+lval* lval_mat(long rows, long cols) {
+    int fits = rows >= 0 && cols >= 0
+        && (cols == 0 || (unsigned long)rows <= (size_t)-1 / sizeof(double) / (unsigned long)cols);
+    void* data = fits ? lvec_try_alloc((size_t)rows * cols * sizeof(double)) : NULL;
+    if (!data) { return lmem_err(); }
+    lval* v = lmem_alloc(sizeof(lval));
+    v->type = LVAL_MAT;
+    v->vtype = LVEC_DBL;
+    v->rows = rows;
+    v->cols = cols;
+    v->vlen = rows * cols;
+    v->vdata = data;
     return v;
 }
 
 /* Função para criar um ponteiro para novo lval de expressão S */
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lmem_alloc(sizeof(lval));
     v->type = LVAL_SEXPR;
+    v->qop = 0;
+    v->qstate = 0;
+    v->qknown = 0;
     v->count = 0;
     v->cell = NULL;
     return v;
 }
 
-void lval_del(lval v) {
+/* Função para criar um ponteiro para novo lval de expressão Q (lista não avaliada) */
+lval* lval_qexpr(void) {
+    lval* v = lval_sexpr();
+    v->type = LVAL_QEXPR;
+    return v;
+}
+
+void lchan_release(struct lchan* c);
+void lseq_release(struct lseq* s);
+void lffi_release(struct lffi* f);
+
+void lval_del(lval* v) {
     switch (v->type) {
         /* Nada especial para números */
         case LVAL_NUM: break;
 
         /* Para erros e símbolos, liberar a memória alocada para as strings */
-        case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
+        case LVAL_ERR: lmem_free(v->err); break;
+        case LVAL_SYM: lmem_free(v->sym); break;
+        case LVAL_STR:
+            lstr_heap_release(v->str.heap);
+            lrope_release(v->str.rope);
+        break;
+        case LVAL_VEC:
+        case LVAL_MAT: lvec_free(v->vdata); break;
+        case LVAL_FUN:
+            if (v->env) {
+                for (int i = 0; i < v->fun->ncaptures; i++) {
+                    lval_del(v->env[i]);
+                }
+                lmem_free(v->env);
+            }
+            lfun_release(v->fun);
+        break;
+        case LVAL_CHAN: lchan_release(v->chan); break;
+        case LVAL_SEQ: lseq_release(v->seq); break;
+        case LVAL_FFI: lffi_release(v->ffi); break;
 
         /* Para expressões S, liberar todas as células */
         case LVAL_SEXPR:
+        case LVAL_QEXPR:
             for (int i = 0; i < v->count; i++) {
                 lval_del(v->cell[i]);
             }
-            free(v->cell);
+            lmem_free(v->cell);
         break;
     }
 
     /* Finalmente, liberar o próprio lval */
-    free(v);
+    lmem_free(v);
+}
+
+void lchan_ref(struct lchan* c);
+void lseq_ref(struct lseq* s);
+void lffi_ref(struct lffi* f);
+
+/* Copiar um lval; strings, vetores, código de funções e canais são compartilhados por contagem */
+lval* lval_copy(lval* v) {
+    lval* x = lmem_alloc(sizeof(lval));
+    *x = *v;
+
+    switch (v->type) {
+        case LVAL_ERR:
+            x->err = lmem_alloc(strlen(v->err) + 1);
+            strcpy(x->err, v->err);
+        break;
+        case LVAL_SYM:
+            x->sym = lmem_alloc(strlen(v->sym) + 1);
+            strcpy(x->sym, v->sym);
+            x->sym_kind = LSYM_FREE;
+        break;
+        case LVAL_STR:
+            if (v->str.heap) { lstr_heap_ref(v->str.heap); }
+            if (v->str.rope) { lrope_ref(v->str.rope); }
+        break;
+        case LVAL_VEC:
+        case LVAL_MAT: lvec_ref(v->vdata); break;
+        case LVAL_FUN:
+            __atomic_add_fetch(&v->fun->refs, 1, __ATOMIC_RELAXED);
+            if (v->env) {
+                x->env = lmem_alloc(sizeof(lval*) * v->fun->ncaptures);
+                for (int i = 0; i < v->fun->ncaptures; i++) {
+                    x->env[i] = lval_copy(v->env[i]);
+                }
+            }
+        break;
+        case LVAL_CHAN: lchan_ref(v->chan); break;
+        case LVAL_SEQ: lseq_ref(v->seq); break;
+        case LVAL_FFI: lffi_ref(v->ffi); break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            /* Como os símbolos, a cópia volta a ser uma expressão não compilada */
+            x->qop = 0;
+            x->qstate = 0;
+            x->qknown = 0;
+            x->cell = lmem_alloc(sizeof(lval*) * v->count);
+            for (int i = 0; i < v->count; i++) {
+                x->cell[i] = lval_copy(v->cell[i]);
+            }
+        break;
+    }
+    return x;
 }
 
 lval* lval_add(lval* v, lval* x) {
     v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    v->cell = lmem_realloc(v->cell, sizeof(lval*) * v->count);
     v->cell[v->count - 1] = x;
     return v;
 }
 
-/* Printar um lval */
-void lval_print(lval* v) {
+void lval_expr_print(FILE* f, lval* v, char open, char close);
+void lval_fprint(FILE* f, lval* v);
+
+void lstr_print_piece(const char* s, long len, void* d) {
+    FILE* f = d;
+    for (long i = 0; i < len; i++) {
+        switch (s[i]) {
+            case '\n': fputs("\\n", f); break;
+            case '\t': fputs("\\t", f); break;
+            case '\r': fputs("\\r", f); break;
+            case '\\': fputs("\\\\", f); break;
+            case '"': fputs("\\\"", f); break;
+            default: putc(s[i], f);
+        }
+    }
+}
+
+/* Printar uma string entre aspas, percorrendo a rope sem achatá-la */
+void lval_str_print(FILE* f, lval* v) {
+    putc('"', f);
+    if (v->str.rope) {
+        lrope_each(v->str.rope, lstr_print_piece, f);
+    } else {
+        lstr_print_piece(lval_str_buf(v), v->str.len, f);
+    }
+    putc('"', f);
+}
+
+/* Printar um double de forma que ele seja lido de volta como double */
+void lval_fprint_dbl(FILE* f, double x) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", x);
+    fputs(buf, f);
+    if (!strpbrk(buf, ".eni")) { fputs(".0", f); }
+}
+
+void lval_vec_print(FILE* f, lval* v) {
+    putc('[', f);
+    for (long i = 0; i < v->vlen; i++) {
+        if (i) { putc(' ', f); }
+        if (v->vtype == LVEC_INT) {
+            fprintf(f, "%lld", (long long)((int64_t*)v->vdata)[i]);
+        } else {
+            lval_fprint_dbl(f, ((double*)v->vdata)[i]);
+        }
+    }
+    putc(']', f);
+}
+
+/* Matrizes são impressas como a expressão que as constrói */
+void lval_mat_print(FILE* f, lval* v) {
+    fprintf(f, "(matrix %li %li ", v->rows, v->cols);
+    lval_vec_print(f, v);
+    putc(')', f);
+}
+
+/* Funções são impressas como a lambda que as criou */
+void lval_fun_print(FILE* f, lval* v) {
+    fputs("(lambda (", f);
+    for (int i = 0; i < v->fun->nparams; i++) {
+        if (i) { putc(' ', f); }
+        fputs(v->fun->params[i], f);
+    }
+    fputs(") ", f);
+    lval_fprint(f, v->fun->body);
+    putc(')', f);
+}
+
+void lffi_print(FILE* f, struct lffi* x);
+
+/* Printar um lval no stream f */
+void lval_fprint(FILE* f, lval* v) {
     switch (v->type) {
-        case LVAL_NUM: printf("%li", v->num); break;
-        case LVAL_ERR: printf("Error: %s", v.err); break;
-        case LVAL_SYM: printf("%s", v->sym); break;
-        case LVAL_SEXPR: lval_expr_print(v, '(', ')');
+        case LVAL_NUM: fprintf(f, "%li", v->num); break;
+        case LVAL_DBL: lval_fprint_dbl(f, v->dbl); break;
+        case LVAL_ERR: fprintf(f, "Error: %s", v->err); break;
+        case LVAL_SYM: fputs(v->sym, f); break;
+        case LVAL_STR: lval_str_print(f, v); break;
+        case LVAL_VEC: lval_vec_print(f, v); break;
+        case LVAL_MAT: lval_mat_print(f, v); break;
+        case LVAL_FUN: lval_fun_print(f, v); break;
+        case LVAL_CHAN: fputs("<canal>", f); break;
+        case LVAL_SEQ: fputs("<sequência>", f); break;
+        case LVAL_FFI: lffi_print(f, v->ffi); break;
+        case LVAL_SEXPR: lval_expr_print(f, v, '(', ')'); break;
+        case LVAL_QEXPR: lval_expr_print(f, v, '{', '}'); break;
     }
 }
 
+/* Printar um lval com nova linha no stream f */
+void lval_fprintln(FILE* f, lval* v) { lval_fprint(f, v); putc('\n', f); }
+
+/* Printar um lval */
+void lval_print(lval* v) { lval_fprint(stdout, v); }
+
 /* Printar um lval com nova linha */
-void lval_println(lval v) { lval_print(v); putchar('\n'); }
+void lval_println(lval* v) { lval_fprintln(stdout, v); }
 
 /* Usando o operador String para ver qual operacao deve-se realizar */
 lval* lval_pop(lval* v, int i) {
@@ -136,7 +1079,7 @@ lval* lval_pop(lval* v, int i) {
     v->count--;
     
     /* Realocando a memória usada */
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    v->cell = lmem_realloc(v->cell, sizeof(lval*) * v->count);
     return x;
 }
 
@@ -146,135 +1089,4871 @@ lval* lval_take(lval* v, int i) {
     return x;
 }
 
-void lval_expr_print(lval v, char open, char close) {
-    putchar(open);
-    for (int i = 0; i < v.count; i++) {
-        lval_print(*v.cell[i]);
-        if (i != (v.count - 1)) {
-            putchar(' ');
+void lval_expr_print(FILE* f, lval* v, char open, char close) {
+    putc(open, f);
+    for (int i = 0; i < v->count; i++) {
+        lval_fprint(f, v->cell[i]);
+        if (i != (v->count - 1)) {
+            putc(' ', f);
         }
     }
-    putchar(close);
+    putc(close, f);
 }
 
-lval* builtin_op(lval* a, char* op) {
-    for(int i = 0; i < a->count; i++) {
-        /* Verifica se todos os elementos são números */
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval_del(a);
-            return lval_err("Operador não pode operar sobre tipos não números!");
-        }
+/* Verificar que todos os argumentos são do tipo t */
+int lval_all_of(lval* a, int t) {
+    for (int i = 0; i < a->count; i++) {
+        if (a->cell[i]->type != t) { return 0; }
     }
-    lval* x = lval_pop(a, 0);
-    /* Se o operador é '-', e só tem um operando, faz a negação */
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;           
+    return 1;
+}
+
+lval* builtin_concat(lval* a) {
+    if (a->count == 0 || !lval_all_of(a, LVAL_STR)) {
+        lval_del(a);
+        return lval_err("concat espera uma ou mais strings!");
     }
 
+    lval* x = lval_pop(a, 0);
     while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
+        x = lval_str_concat(x, lval_pop(a, 0));
+    }
+    lval_del(a);
+    return x;
+}
 
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) {
+lval* builtin_len(lval* a) {
+    int t = a->count == 1 ? a->cell[0]->type : LVAL_ERR;
+    if (t != LVAL_STR && t != LVAL_VEC && t != LVAL_QEXPR) {
+        lval_del(a);
+        return lval_err("len espera uma string, um vetor ou uma lista!");
+    }
+    lval* x = lval_num(t == LVAL_STR ? a->cell[0]->str.len : t == LVAL_VEC ? a->cell[0]->vlen : a->cell[0]->count);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_substr(lval* a) {
+    if (a->count != 3 || a->cell[0]->type != LVAL_STR
+        || a->cell[1]->type != LVAL_NUM || a->cell[2]->type != LVAL_NUM) {
+        lval_del(a);
+        return lval_err("substr espera uma string, um início e um tamanho!");
+    }
+
+    lval* s = a->cell[0];
+    long start = a->cell[1]->num;
+    long len = a->cell[2]->num;
+    if (start < 0) { start = 0; }
+    if (start > s->str.len) { start = s->str.len; }
+    if (len < 0 || len > s->str.len - start) { len = s->str.len - start; }
+
+    lval* x = lval_str_alloc(len);
+    char* buf = lval_str_buf(x);
+    if (s->str.rope) {
+        lrope_copy_range(s->str.rope, start, len, buf);
+    } else {
+        memcpy(buf, lval_str_buf(s) + start, len);
+    }
+    buf[len] = '\0';
+
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_str_hash(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_STR) {
+        lval_del(a);
+        return lval_err("str-hash espera uma string!");
+    }
+    lval* x = lval_num((long)lval_str_hash(a->cell[0]));
+    lval_del(a);
+    return x;
+}
+
+/*
+ * Kernels dos vetores numéricos. Cada operação tem uma versão portátil,
+ * escrita com acumuladores independentes para que o compilador consiga
+ * vetorizar, e em x86-64 uma versão AVX2 escolhida em tempo de execução
+ * por lvec_init() quando a CPU suporta.
+ */
+
+enum { LVEC_LT, LVEC_GT, LVEC_LE, LVEC_GE, LVEC_EQ, LVEC_NE };
+
+int lvec_cmp_i(int64_t a, int op, int64_t b) {
+    switch (op) {
+        case LVEC_LT: return a < b;
+        case LVEC_GT: return a > b;
+        case LVEC_LE: return a <= b;
+        case LVEC_GE: return a >= b;
+        case LVEC_EQ: return a == b;
+        default: return a != b;
+    }
+}
+
+int lvec_cmp_d(double a, int op, double b) {
+    switch (op) {
+        case LVEC_LT: return a < b;
+        case LVEC_GT: return a > b;
+        case LVEC_LE: return a <= b;
+        case LVEC_GE: return a >= b;
+        case LVEC_EQ: return a == b;
+        default: return a != b;
+    }
+}
+
+int64_t lvec_sum_i_scalar(const int64_t* x, long n) {
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += x[i]; s1 += x[i+1]; s2 += x[i+2]; s3 += x[i+3];
+    }
+    for (; i < n; i++) { s0 += x[i]; }
+    return (int64_t)(s0 + s1 + s2 + s3);
+}
+
+double lvec_sum_d_scalar(const double* x, long n) {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += x[i]; s1 += x[i+1]; s2 += x[i+2]; s3 += x[i+3];
+    }
+    for (; i < n; i++) { s0 += x[i]; }
+    return (s0 + s1) + (s2 + s3);
+}
+
+int64_t lvec_dot_i_scalar(const int64_t* x, const int64_t* y, long n) {
+    uint64_t s0 = 0, s1 = 0;
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        s0 += (uint64_t)x[i] * (uint64_t)y[i];
+        s1 += (uint64_t)x[i+1] * (uint64_t)y[i+1];
+    }
+    for (; i < n; i++) { s0 += (uint64_t)x[i] * (uint64_t)y[i]; }
+    return (int64_t)(s0 + s1);
+}
+
+double lvec_dot_d_scalar(const double* x, const double* y, long n) {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += x[i] * y[i]; s1 += x[i+1] * y[i+1];
+        s2 += x[i+2] * y[i+2]; s3 += x[i+3] * y[i+3];
+    }
+    for (; i < n; i++) { s0 += x[i] * y[i]; }
+    return (s0 + s1) + (s2 + s3);
+}
+
+void lvec_add_i_scalar(int64_t* x, const int64_t* y, long n) {
+    for (long i = 0; i < n; i++) { x[i] = (int64_t)((uint64_t)x[i] + (uint64_t)y[i]); }
+}
+
+void lvec_add_d_scalar(double* x, const double* y, long n) {
+    for (long i = 0; i < n; i++) { x[i] += y[i]; }
+}
+
+void lvec_adds_i_scalar(int64_t* x, int64_t y, long n) {
+    for (long i = 0; i < n; i++) { x[i] = (int64_t)((uint64_t)x[i] + (uint64_t)y); }
+}
+
+void lvec_adds_d_scalar(double* x, double y, long n) {
+    for (long i = 0; i < n; i++) { x[i] += y; }
+}
+
+/* min e max recebem n > 0 */
+int64_t lvec_min_i_scalar(const int64_t* x, long n) {
+    int64_t m = x[0];
+    for (long i = 1; i < n; i++) { m = x[i] < m ? x[i] : m; }
+    return m;
+}
+
+int64_t lvec_max_i_scalar(const int64_t* x, long n) {
+    int64_t m = x[0];
+    for (long i = 1; i < n; i++) { m = x[i] > m ? x[i] : m; }
+    return m;
+}
+
+double lvec_min_d_scalar(const double* x, long n) {
+    double m = x[0];
+    for (long i = 1; i < n; i++) { m = x[i] < m ? x[i] : m; }
+    return m;
+}
+
+double lvec_max_d_scalar(const double* x, long n) {
+    double m = x[0];
+    for (long i = 1; i < n; i++) { m = x[i] > m ? x[i] : m; }
+    return m;
+}
+
+/* Os filtros escrevem os elementos aceitos em dst, que pode ser o próprio src */
+long lvec_filter_i_scalar(int64_t* dst, const int64_t* src, long n, int op, int64_t y) {
+    long k = 0;
+    for (long i = 0; i < n; i++) {
+        int64_t v = src[i];
+        dst[k] = v;
+        k += lvec_cmp_i(v, op, y);
+    }
+    return k;
+}
+
+long lvec_filter_d_scalar(double* dst, const double* src, long n, int op, double y) {
+    long k = 0;
+    for (long i = 0; i < n; i++) {
+        double v = src[i];
+        dst[k] = v;
+        k += lvec_cmp_d(v, op, y);
+    }
+    return k;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+#include <immintrin.h>
+
+#define LVEC_AVX2 __attribute__((target("avx2,fma")))
+
+LVEC_AVX2 int64_t lvec_hsum_i_avx2(__m256i v) {
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1);
+}
+
+LVEC_AVX2 double lvec_hsum_d_avx2(__m256d v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+LVEC_AVX2 int64_t lvec_sum_i_avx2(const int64_t* x, long n) {
+    __m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a0 = _mm256_add_epi64(a0, _mm256_loadu_si256((const __m256i*)(x + i)));
+        a1 = _mm256_add_epi64(a1, _mm256_loadu_si256((const __m256i*)(x + i + 4)));
+    }
+    return lvec_hsum_i_avx2(_mm256_add_epi64(a0, a1)) + lvec_sum_i_scalar(x + i, n - i);
+}
+
+LVEC_AVX2 double lvec_sum_d_avx2(const double* x, long n) {
+    __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a0 = _mm256_add_pd(a0, _mm256_loadu_pd(x + i));
+        a1 = _mm256_add_pd(a1, _mm256_loadu_pd(x + i + 4));
+    }
+    return lvec_hsum_d_avx2(_mm256_add_pd(a0, a1)) + lvec_sum_d_scalar(x + i, n - i);
+}
+
+LVEC_AVX2 double lvec_dot_d_avx2(const double* x, const double* y, long n) {
+    __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        a0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), a0);
+        a1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4), a1);
+    }
+    return lvec_hsum_d_avx2(_mm256_add_pd(a0, a1)) + lvec_dot_d_scalar(x + i, y + i, n - i);
+}
+
+LVEC_AVX2 void lvec_add_i_avx2(int64_t* x, const int64_t* y, long n) {
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)(x + i)),
+                                     _mm256_loadu_si256((const __m256i*)(y + i)));
+        _mm256_storeu_si256((__m256i*)(x + i), v);
+    }
+    lvec_add_i_scalar(x + i, y + i, n - i);
+}
+
+LVEC_AVX2 void lvec_add_d_avx2(double* x, const double* y, long n) {
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(x + i, _mm256_add_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+    }
+    lvec_add_d_scalar(x + i, y + i, n - i);
+}
+
+LVEC_AVX2 void lvec_adds_i_avx2(int64_t* x, int64_t y, long n) {
+    __m256i s = _mm256_set1_epi64x(y);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_si256((__m256i*)(x + i),
+            _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)(x + i)), s));
+    }
+    lvec_adds_i_scalar(x + i, y, n - i);
+}
+
+LVEC_AVX2 void lvec_adds_d_avx2(double* x, double y, long n) {
+    __m256d s = _mm256_set1_pd(y);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(x + i, _mm256_add_pd(_mm256_loadu_pd(x + i), s));
+    }
+    lvec_adds_d_scalar(x + i, y, n - i);
+}
+
+LVEC_AVX2 int64_t lvec_minmax_i_avx2(const int64_t* x, long n, int max) {
+    if (n < 8) { return max ? lvec_max_i_scalar(x, n) : lvec_min_i_scalar(x, n); }
+    __m256i m = _mm256_loadu_si256((const __m256i*)x);
+    long i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i gt = max ? _mm256_cmpgt_epi64(v, m) : _mm256_cmpgt_epi64(m, v);
+        m = _mm256_blendv_epi8(m, v, gt);
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, m);
+    int64_t r = max ? lvec_max_i_scalar(lanes, 4) : lvec_min_i_scalar(lanes, 4);
+    for (; i < n; i++) { r = max ? (x[i] > r ? x[i] : r) : (x[i] < r ? x[i] : r); }
+    return r;
+}
+
+LVEC_AVX2 int64_t lvec_min_i_avx2(const int64_t* x, long n) { return lvec_minmax_i_avx2(x, n, 0); }
+LVEC_AVX2 int64_t lvec_max_i_avx2(const int64_t* x, long n) { return lvec_minmax_i_avx2(x, n, 1); }
+
+LVEC_AVX2 double lvec_minmax_d_avx2(const double* x, long n, int max) {
+    if (n < 8) { return max ? lvec_max_d_scalar(x, n) : lvec_min_d_scalar(x, n); }
+    __m256d m = _mm256_loadu_pd(x);
+    long i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(x + i);
+        m = max ? _mm256_max_pd(v, m) : _mm256_min_pd(v, m);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, m);
+    double r = max ? lvec_max_d_scalar(lanes, 4) : lvec_min_d_scalar(lanes, 4);
+    for (; i < n; i++) { r = max ? (x[i] > r ? x[i] : r) : (x[i] < r ? x[i] : r); }
+    return r;
+}
+
+LVEC_AVX2 double lvec_min_d_avx2(const double* x, long n) { return lvec_minmax_d_avx2(x, n, 0); }
+LVEC_AVX2 double lvec_max_d_avx2(const double* x, long n) { return lvec_minmax_d_avx2(x, n, 1); }
+
+/*
+ * Compactação para os filtros: para cada máscara de 4 bits, os índices de
+ * 32 bits que levam as pistas aceitas de 64 bits para o começo do registro.
+ */
+static int32_t lvec_compress_lut[16][8];
+
+void lvec_compress_init(void) {
+    for (int m = 0; m < 16; m++) {
+        int k = 0;
+        for (int lane = 0; lane < 4; lane++) {
+            if (m & (1 << lane)) {
+                lvec_compress_lut[m][2*k] = 2*lane;
+                lvec_compress_lut[m][2*k+1] = 2*lane+1;
+                k++;
+            }
+        }
+        for (; k < 4; k++) {
+            lvec_compress_lut[m][2*k] = 0;
+            lvec_compress_lut[m][2*k+1] = 1;
+        }
+    }
+}
+
+LVEC_AVX2 __m256i lvec_cmp_i_avx2(__m256i v, int op, __m256i y) {
+    __m256i ones = _mm256_set1_epi64x(-1);
+    switch (op) {
+        case LVEC_LT: return _mm256_cmpgt_epi64(y, v);
+        case LVEC_GT: return _mm256_cmpgt_epi64(v, y);
+        case LVEC_LE: return _mm256_xor_si256(_mm256_cmpgt_epi64(v, y), ones);
+        case LVEC_GE: return _mm256_xor_si256(_mm256_cmpgt_epi64(y, v), ones);
+        case LVEC_EQ: return _mm256_cmpeq_epi64(v, y);
+        default: return _mm256_xor_si256(_mm256_cmpeq_epi64(v, y), ones);
+    }
+}
+
+LVEC_AVX2 __m256d lvec_cmp_d_avx2(__m256d v, int op, __m256d y) {
+    switch (op) {
+        case LVEC_LT: return _mm256_cmp_pd(v, y, _CMP_LT_OQ);
+        case LVEC_GT: return _mm256_cmp_pd(v, y, _CMP_GT_OQ);
+        case LVEC_LE: return _mm256_cmp_pd(v, y, _CMP_LE_OQ);
+        case LVEC_GE: return _mm256_cmp_pd(v, y, _CMP_GE_OQ);
+        case LVEC_EQ: return _mm256_cmp_pd(v, y, _CMP_EQ_OQ);
+        default: return _mm256_cmp_pd(v, y, _CMP_NEQ_UQ);
+    }
+}
+
+LVEC_AVX2 long lvec_filter_i_avx2(int64_t* dst, const int64_t* src, long n, int op, int64_t y) {
+    __m256i s = _mm256_set1_epi64x(y);
+    long i = 0, k = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        int m = _mm256_movemask_pd(_mm256_castsi256_pd(lvec_cmp_i_avx2(v, op, s)));
+        __m256i idx = _mm256_loadu_si256((const __m256i*)lvec_compress_lut[m]);
+        _mm256_storeu_si256((__m256i*)(dst + k), _mm256_permutevar8x32_epi32(v, idx));
+        k += __builtin_popcount(m);
+    }
+    return k + lvec_filter_i_scalar(dst + k, src + i, n - i, op, y);
+}
+
+LVEC_AVX2 long lvec_filter_d_avx2(double* dst, const double* src, long n, int op, double y) {
+    __m256d s = _mm256_set1_pd(y);
+    long i = 0, k = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(src + i);
+        int m = _mm256_movemask_pd(lvec_cmp_d_avx2(v, op, s));
+        __m256i idx = _mm256_loadu_si256((const __m256i*)lvec_compress_lut[m]);
+        __m256i p = _mm256_permutevar8x32_epi32(_mm256_castpd_si256(v), idx);
+        _mm256_storeu_si256((__m256i*)(dst + k), p);
+        k += __builtin_popcount(m);
+    }
+    return k + lvec_filter_d_scalar(dst + k, src + i, n - i, op, y);
+}
+
+#endif
+
+/*
+ * Pool de threads fork-join usado pelos builtins paralelos. lpool_run()
+ * executa as tarefas 0..n-1 com a thread chamadora ajudando; se o pool já
+ * está ocupado (por outra thread, ou porque a tarefa atual também quer
+ * paralelizar) as tarefas rodam na própria thread chamadora.
+ */
+
+typedef void (*lpool_fn)(void* ctx, int task);
+
+#ifndef _WIN32
+
+/* Thread que avalia: pilha de tamanho conhecido, para a guarda de lstack_exhausted */
+int lthread_create(pthread_t* t, void* (*fn)(void*), void* arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LTHREAD_STACK);
+    int r = pthread_create(t, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    return r;
+}
+
+typedef struct {
+    pthread_mutex_t run;
+    pthread_mutex_t lock;
+    pthread_cond_t go;
+    pthread_cond_t done;
+    int nthreads;
+    long generation;
+
+    lpool_fn fn;
+    void* ctx;
+    int ntasks;
+    int next;
+    int finished;
+
+    /* Workers que ainda podem pegar tarefas da geração atual */
+    int active;
+    /* Workers que já registraram a geração atual */
+    int acked;
+} lpool;
+
+static lpool lpool_global = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    -1, 0, NULL, NULL, 0, 0, 0, 0, 0
+};
+
+/* Pegar e executar tarefas até acabarem; devolve quantas foram executadas */
+int lpool_drain(lpool* p, lpool_fn fn, void* ctx, int ntasks) {
+    int count = 0;
+    while (1) {
+        int t = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+        if (t >= ntasks) { return count; }
+        fn(ctx, t);
+        count++;
+    }
+}
+
+void* lpool_worker(void* arg) {
+    lpool* p = arg;
+    long seen = 0;
+    lstack_enter(LTHREAD_STACK);
+
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        while (p->generation == seen) {
+            pthread_cond_wait(&p->go, &p->lock);
+        }
+        seen = p->generation;
+        lpool_fn fn = p->fn;
+        void* ctx = p->ctx;
+        int ntasks = p->ntasks;
+        p->acked++;
+        p->active++;
+        pthread_mutex_unlock(&p->lock);
+
+        int count = lpool_drain(p, fn, ctx, ntasks);
+
+        pthread_mutex_lock(&p->lock);
+        p->finished += count;
+        p->active--;
+        if (p->finished == ntasks && p->active == 0 && p->acked == p->nthreads) {
+            pthread_cond_signal(&p->done);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+/* Número de threads do pool, contando a thread chamadora */
+int lpool_size(void) {
+    lpool* p = &lpool_global;
+    pthread_mutex_lock(&p->lock);
+    if (p->nthreads < 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int want = cpus > 1 ? (int)cpus - 1 : 0;
+        p->nthreads = 0;
+        for (int i = 0; i < want; i++) {
+            pthread_t t;
+            if (lthread_create(&t, lpool_worker, p) != 0) { break; }
+            pthread_detach(t);
+            p->nthreads++;
+        }
+    }
+    int n = p->nthreads + 1;
+    pthread_mutex_unlock(&p->lock);
+    return n;
+}
+
+void lpool_run(int ntasks, lpool_fn fn, void* ctx) {
+    lpool* p = &lpool_global;
+
+    if (ntasks <= 1 || lpool_size() == 1 || pthread_mutex_trylock(&p->run) != 0) {
+        for (int t = 0; t < ntasks; t++) { fn(ctx, t); }
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->fn = fn;
+    p->ctx = ctx;
+    p->ntasks = ntasks;
+    p->next = 0;
+    p->finished = 0;
+    p->acked = 0;
+    p->generation++;
+    pthread_cond_broadcast(&p->go);
+    pthread_mutex_unlock(&p->lock);
+
+    int count = lpool_drain(p, fn, ctx, ntasks);
+
+    pthread_mutex_lock(&p->lock);
+    p->finished += count;
+    /*
+     * Esperar que todo worker tenha registrado esta geração e saído dela:
+     * um worker acordado tarde que ainda não a viu copiaria fn/ctx desta
+     * chamada depois do retorno e drenaria as tarefas da próxima geração.
+     */
+    while (p->finished < ntasks || p->active > 0 || p->acked < p->nthreads) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_unlock(&p->run);
+}
+
+#else
+
+int lpool_size(void) { return 1; }
+
+void lpool_run(int ntasks, lpool_fn fn, void* ctx) {
+    for (int t = 0; t < ntasks; t++) { fn(ctx, t); }
+}
+
+#endif
+
+/*
+ * Multiplicação de matrizes no estilo GotoBLAS: C é dividida em faixas de
+ * linhas, uma por tarefa do pool. Cada tarefa empacota blocos KC x NC de B
+ * e MC x KC de A em buffers contíguos e chama um micro-kernel que calcula
+ * um bloco LMAT_MR x LMAT_NR de C inteiro em registradores.
+ */
+
+enum {
+    LMAT_MR = 6,
+    LMAT_NR = 8,
+    LMAT_MC = 120,
+    LMAT_KC = 384,
+    LMAT_NC = 2048
+};
+
+/* C[0..mr, 0..nr] += Ap * Bp, com Ap e Bp empacotados para kc passos */
+void lmat_kernel_scalar(long kc, const double* ap, const double* bp, double* c, long ldc, long mr, long nr) {
+    double acc[LMAT_MR][LMAT_NR] = {{0}};
+    for (long p = 0; p < kc; p++) {
+        for (int i = 0; i < LMAT_MR; i++) {
+            double a = ap[i];
+            for (int j = 0; j < LMAT_NR; j++) { acc[i][j] += a * bp[j]; }
+        }
+        ap += LMAT_MR;
+        bp += LMAT_NR;
+    }
+    for (long i = 0; i < mr; i++) {
+        for (long j = 0; j < nr; j++) { c[i * ldc + j] += acc[i][j]; }
+    }
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+LVEC_AVX2 void lmat_kernel_avx2(long kc, const double* ap, const double* bp, double* c, long ldc, long mr, long nr) {
+    if (mr != LMAT_MR || nr != LMAT_NR) {
+        lmat_kernel_scalar(kc, ap, bp, c, ldc, mr, nr);
+        return;
+    }
+
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+    __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+
+    /* Trazer o bloco de C para o cache enquanto o laço roda */
+    for (int i = 0; i < LMAT_MR; i++) {
+        _mm_prefetch((const char*)(c + i * ldc), _MM_HINT_T0);
+        _mm_prefetch((const char*)(c + i * ldc + LMAT_NR - 1), _MM_HINT_T0);
+    }
+
+#pragma GCC unroll 4
+    for (long p = 0; p < kc; p++) {
+        __m256d b0 = _mm256_load_pd(bp);
+        __m256d b1 = _mm256_load_pd(bp + 4);
+        __m256d a;
+        a = _mm256_broadcast_sd(ap + 0); c00 = _mm256_fmadd_pd(a, b0, c00); c01 = _mm256_fmadd_pd(a, b1, c01);
+        a = _mm256_broadcast_sd(ap + 1); c10 = _mm256_fmadd_pd(a, b0, c10); c11 = _mm256_fmadd_pd(a, b1, c11);
+        a = _mm256_broadcast_sd(ap + 2); c20 = _mm256_fmadd_pd(a, b0, c20); c21 = _mm256_fmadd_pd(a, b1, c21);
+        a = _mm256_broadcast_sd(ap + 3); c30 = _mm256_fmadd_pd(a, b0, c30); c31 = _mm256_fmadd_pd(a, b1, c31);
+        a = _mm256_broadcast_sd(ap + 4); c40 = _mm256_fmadd_pd(a, b0, c40); c41 = _mm256_fmadd_pd(a, b1, c41);
+        a = _mm256_broadcast_sd(ap + 5); c50 = _mm256_fmadd_pd(a, b0, c50); c51 = _mm256_fmadd_pd(a, b1, c51);
+        ap += LMAT_MR;
+        bp += LMAT_NR;
+    }
+
+#define LMAT_STORE(ROW, LO, HI) \
+    _mm256_storeu_pd(c + ROW * ldc, _mm256_add_pd(_mm256_loadu_pd(c + ROW * ldc), LO)); \
+    _mm256_storeu_pd(c + ROW * ldc + 4, _mm256_add_pd(_mm256_loadu_pd(c + ROW * ldc + 4), HI));
+    LMAT_STORE(0, c00, c01)
+    LMAT_STORE(1, c10, c11)
+    LMAT_STORE(2, c20, c21)
+    LMAT_STORE(3, c30, c31)
+    LMAT_STORE(4, c40, c41)
+    LMAT_STORE(5, c50, c51)
+#undef LMAT_STORE
+}
+
+#endif
+
+static void (*lmat_kernel)(long, const double*, const double*, double*, long, long, long) = lmat_kernel_scalar;
+
+/* Empacotar A[0..mc, 0..kc] em fatias de LMAT_MR linhas, completando com zeros */
+void lmat_pack_a(long mc, long kc, const double* a, long lda, double* ap) {
+    for (long i0 = 0; i0 < mc; i0 += LMAT_MR) {
+        for (long p = 0; p < kc; p++) {
+            for (long i = 0; i < LMAT_MR; i++) {
+                *ap++ = i0 + i < mc ? a[(i0 + i) * lda + p] : 0.0;
+            }
+        }
+    }
+}
+
+/* Empacotar B[0..kc, 0..nc] em fatias de LMAT_NR colunas, completando com zeros */
+void lmat_pack_b(long kc, long nc, const double* b, long ldb, double* bp) {
+    for (long j0 = 0; j0 < nc; j0 += LMAT_NR) {
+        for (long p = 0; p < kc; p++) {
+            const double* row = b + p * ldb + j0;
+            for (long j = 0; j < LMAT_NR; j++) {
+                *bp++ = j0 + j < nc ? row[j] : 0.0;
+            }
+        }
+    }
+}
+
+typedef struct {
+    long m, n, k;
+    const double* a;
+    const double* b;
+    double* c;
+    long rows_per_task;
+} lmat_gemm_job;
+
+void lmat_gemm_task(void* ctx, int task) {
+    lmat_gemm_job* g = ctx;
+    long m0 = task * g->rows_per_task;
+    long m1 = m0 + g->rows_per_task < g->m ? m0 + g->rows_per_task : g->m;
+    if (m0 >= m1) { return; }
+
+    double* ap = lvec_alloc(sizeof(double) * LMAT_MC * LMAT_KC);
+    double* bp = lvec_alloc(sizeof(double) * LMAT_KC * (LMAT_NC + LMAT_NR));
+
+    for (long jc = 0; jc < g->n; jc += LMAT_NC) {
+        long nc = g->n - jc < LMAT_NC ? g->n - jc : LMAT_NC;
+        for (long pc = 0; pc < g->k; pc += LMAT_KC) {
+            long kc = g->k - pc < LMAT_KC ? g->k - pc : LMAT_KC;
+            lmat_pack_b(kc, nc, g->b + pc * g->n + jc, g->n, bp);
+
+            for (long ic = m0; ic < m1; ic += LMAT_MC) {
+                long mc = m1 - ic < LMAT_MC ? m1 - ic : LMAT_MC;
+                lmat_pack_a(mc, kc, g->a + ic * g->k + pc, g->k, ap);
+
+                for (long jr = 0; jr < nc; jr += LMAT_NR) {
+                    long nr = nc - jr < LMAT_NR ? nc - jr : LMAT_NR;
+                    for (long ir = 0; ir < mc; ir += LMAT_MR) {
+                        long mr = mc - ir < LMAT_MR ? mc - ir : LMAT_MR;
+                        lmat_kernel(kc, ap + ir * kc, bp + jr * kc,
+                            g->c + (ic + ir) * g->n + jc + jr, g->n, mr, nr);
+                    }
+                }
+            }
+        }
+    }
+
+    lvec_free(ap);
+    lvec_free(bp);
+}
+
+/* C (m x n) = A (m x k) * B (k x n), todas em row-major */
+void lmat_gemm(long m, long n, long k, const double* a, const double* b, double* c) {
+    memset(c, 0, sizeof(double) * m * n);
+
+    lmat_gemm_job g = { m, n, k, a, b, c, m };
+    int tasks = 1;
+    if ((double)m * n * k >= 64.0 * 64.0 * 64.0) {
+        tasks = lpool_size();
+        long rows = (m + tasks - 1) / tasks;
+        g.rows_per_task = (rows + LMAT_MR - 1) / LMAT_MR * LMAT_MR;
+        tasks = (int)((m + g.rows_per_task - 1) / g.rows_per_task);
+    }
+    lpool_run(tasks, lmat_gemm_task, &g);
+}
+
+typedef struct {
+    int64_t (*sum_i)(const int64_t*, long);
+    double (*sum_d)(const double*, long);
+    int64_t (*dot_i)(const int64_t*, const int64_t*, long);
+    double (*dot_d)(const double*, const double*, long);
+    void (*add_i)(int64_t*, const int64_t*, long);
+    void (*add_d)(double*, const double*, long);
+    void (*adds_i)(int64_t*, int64_t, long);
+    void (*adds_d)(double*, double, long);
+    int64_t (*min_i)(const int64_t*, long);
+    int64_t (*max_i)(const int64_t*, long);
+    double (*min_d)(const double*, long);
+    double (*max_d)(const double*, long);
+    long (*filter_i)(int64_t*, const int64_t*, long, int, int64_t);
+    long (*filter_d)(double*, const double*, long, int, double);
+} lvec_kernels;
+
+static lvec_kernels lvec_k = {
+    lvec_sum_i_scalar, lvec_sum_d_scalar,
+    lvec_dot_i_scalar, lvec_dot_d_scalar,
+    lvec_add_i_scalar, lvec_add_d_scalar,
+    lvec_adds_i_scalar, lvec_adds_d_scalar,
+    lvec_min_i_scalar, lvec_max_i_scalar,
+    lvec_min_d_scalar, lvec_max_d_scalar,
+    lvec_filter_i_scalar, lvec_filter_d_scalar
+};
+
+/* Escolher os kernels para a CPU atual; chamado uma vez em main() */
+void lvec_init(void) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        lvec_compress_init();
+        lvec_k.sum_i = lvec_sum_i_avx2;
+        lvec_k.sum_d = lvec_sum_d_avx2;
+        lvec_k.dot_d = lvec_dot_d_avx2;
+        lvec_k.add_i = lvec_add_i_avx2;
+        lvec_k.add_d = lvec_add_d_avx2;
+        lvec_k.adds_i = lvec_adds_i_avx2;
+        lvec_k.adds_d = lvec_adds_d_avx2;
+        lvec_k.min_i = lvec_min_i_avx2;
+        lvec_k.max_i = lvec_max_i_avx2;
+        lvec_k.min_d = lvec_min_d_avx2;
+        lvec_k.max_d = lvec_max_d_avx2;
+        lvec_k.filter_i = lvec_filter_i_avx2;
+        lvec_k.filter_d = lvec_filter_d_avx2;
+        lmat_kernel = lmat_kernel_avx2;
+    }
+#endif
+}
+
+/* Converter um escalar numérico em double */
+double lval_as_dbl(lval* v) {
+    return v->type == LVAL_DBL ? v->dbl : (double)v->num;
+}
+
+int lval_is_number(lval* v) {
+    return v->type == LVAL_NUM || v->type == LVAL_DBL;
+}
+
+/* Verificar os argumentos de um builtin de vetor: n vetores seguidos de escalares */
+lval* lval_vec_args(lval* a, const char* name, int nvec, int nscalar) {
+    char msg[128];
+    int ok = a->count == nvec + nscalar;
+    for (int i = 0; ok && i < a->count; i++) {
+        ok = i < nvec ? a->cell[i]->type == LVAL_VEC : lval_is_number(a->cell[i]);
+    }
+    if (ok) { return NULL; }
+    snprintf(msg, sizeof(msg), "%s espera %d vetor(es) e %d número(s)!", name, nvec, nscalar);
+    return lval_err(msg);
+}
+
+lval* builtin_vsum(lval* a) {
+    lval* err = lval_vec_args(a, "vsum", 1, 0);
+    if (err) { lval_del(a); return err; }
+
+    lval* v = a->cell[0];
+    lval* x = v->vtype == LVEC_INT
+        ? lval_num((long)lvec_k.sum_i(v->vdata, v->vlen))
+        : lval_dbl(lvec_k.sum_d(v->vdata, v->vlen));
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_vdot(lval* a) {
+    lval* err = lval_vec_args(a, "vdot", 2, 0);
+    if (err) { lval_del(a); return err; }
+
+    lval* v = a->cell[0];
+    lval* w = a->cell[1];
+    if (v->vlen != w->vlen) {
+        lval_del(a);
+        return lval_err("vdot espera vetores do mesmo tamanho!");
+    }
+
+    lval* x;
+    if (v->vtype == LVEC_INT && w->vtype == LVEC_INT) {
+        x = lval_num((long)lvec_k.dot_i(v->vdata, w->vdata, v->vlen));
+    } else if (lval_vec_to_dbl(v) && lval_vec_to_dbl(w)) {
+        x = lval_dbl(lvec_k.dot_d(v->vdata, w->vdata, v->vlen));
+    } else {
+        x = lmem_err();
+    }
+    lval_del(a);
+    return x;
+}
+
+/* vmap-add soma um escalar ou outro vetor, reaproveitando o buffer do primeiro */
+lval* builtin_vmap_add(lval* a) {
+    if (a->count == 2 && a->cell[0]->type == LVAL_VEC && a->cell[1]->type == LVAL_VEC) {
+        lval* v = a->cell[0];
+        lval* w = a->cell[1];
+        if (v->vlen != w->vlen) {
+            lval_del(a);
+            return lval_err("vmap-add espera vetores do mesmo tamanho!");
+        }
+        int dbl = v->vtype == LVEC_DBL || w->vtype == LVEC_DBL;
+        if (!lval_vec_own(v) || (dbl && (!lval_vec_to_dbl(v) || !lval_vec_to_dbl(w)))) {
+            lval_del(a);
+            return lmem_err();
+        }
+        if (dbl) {
+            lvec_k.add_d(v->vdata, w->vdata, v->vlen);
+        } else {
+            lvec_k.add_i(v->vdata, w->vdata, v->vlen);
+        }
+        return lval_take(a, 0);
+    }
+
+    lval* err = lval_vec_args(a, "vmap-add", 1, 1);
+    if (err) { lval_del(a); return err; }
+
+    lval* v = a->cell[0];
+    lval* y = a->cell[1];
+    int dbl = v->vtype == LVEC_DBL || y->type != LVAL_NUM;
+    if (!lval_vec_own(v) || (dbl && !lval_vec_to_dbl(v))) {
+        lval_del(a);
+        return lmem_err();
+    }
+    if (dbl) {
+        lvec_k.adds_d(v->vdata, lval_as_dbl(y), v->vlen);
+    } else {
+        lvec_k.adds_i(v->vdata, y->num, v->vlen);
+    }
+    return lval_take(a, 0);
+}
+
+lval* builtin_vminmax(lval* a, int max) {
+    lval* err = lval_vec_args(a, max ? "vmax" : "vmin", 1, 0);
+    if (err) { lval_del(a); return err; }
+
+    lval* v = a->cell[0];
+    if (v->vlen == 0) {
+        lval_del(a);
+        return lval_err("Vetor vazio!");
+    }
+
+    lval* x;
+    if (v->vtype == LVEC_INT) {
+        x = lval_num((long)(max ? lvec_k.max_i : lvec_k.min_i)(v->vdata, v->vlen));
+    } else {
+        x = lval_dbl((max ? lvec_k.max_d : lvec_k.min_d)(v->vdata, v->vlen));
+    }
+    lval_del(a);
+    return x;
+}
+
+/* vfilter v "op" x mantém os elementos e com e op x, no próprio buffer de v */
+lval* builtin_vfilter(lval* a) {
+    static const char* ops[] = {"<", ">", "<=", ">=", "==", "!="};
+
+    int op = -1;
+    if (a->count == 3 && a->cell[1]->type == LVAL_STR) {
+        for (int i = 0; i < 6; i++) {
+            if (strcmp(lval_str_flat(a->cell[1]), ops[i]) == 0) { op = i; }
+        }
+    }
+    if (op < 0 || a->cell[0]->type != LVAL_VEC || !lval_is_number(a->cell[2])) {
+        lval_del(a);
+        return lval_err("vfilter espera um vetor, um comparador (\"<\", \">\", \"<=\", \">=\", \"==\", \"!=\") e um número!");
+    }
+
+    lval* v = a->cell[0];
+    lval* y = a->cell[2];
+    int dbl = v->vtype == LVEC_DBL || y->type != LVAL_NUM;
+    if (!lval_vec_own(v) || (dbl && !lval_vec_to_dbl(v))) {
+        lval_del(a);
+        return lmem_err();
+    }
+    if (dbl) {
+        v->vlen = lvec_k.filter_d(v->vdata, v->vdata, v->vlen, op, lval_as_dbl(y));
+    } else {
+        v->vlen = lvec_k.filter_i(v->vdata, v->vdata, v->vlen, op, y->num);
+    }
+    return lval_take(a, 0);
+}
+
+lval* builtin_vref(lval* a) {
+    if (a->count != 2 || a->cell[0]->type != LVAL_VEC || a->cell[1]->type != LVAL_NUM) {
+        lval_del(a);
+        return lval_err("vref espera um vetor e um índice!");
+    }
+
+    lval* v = a->cell[0];
+    long i = a->cell[1]->num;
+    if (i < 0 || i >= v->vlen) {
+        lval_del(a);
+        return lval_err("Índice fora do vetor!");
+    }
+
+    lval* x = v->vtype == LVEC_INT
+        ? lval_num((long)((int64_t*)v->vdata)[i])
+        : lval_dbl(((double*)v->vdata)[i]);
+    lval_del(a);
+    return x;
+}
+
+/* matrix rows cols v: reaproveita o buffer do vetor v como matriz */
+lval* builtin_matrix(lval* a) {
+    if (a->count != 3 || a->cell[0]->type != LVAL_NUM
+        || a->cell[1]->type != LVAL_NUM || a->cell[2]->type != LVAL_VEC) {
+        lval_del(a);
+        return lval_err("matrix espera linhas, colunas e um vetor!");
+    }
+
+    long rows = a->cell[0]->num;
+    long cols = a->cell[1]->num;
+    lval* v = a->cell[2];
+    if (rows < 0 || cols < 0 || rows * cols != v->vlen) {
+        lval_del(a);
+        return lval_err("matrix: o vetor não tem linhas * colunas elementos!");
+    }
+
+    if (!lval_vec_to_dbl(v)) {
+        lval_del(a);
+        return lmem_err();
+    }
+    v->type = LVAL_MAT;
+    v->rows = rows;
+    v->cols = cols;
+    return lval_take(a, 2);
+}
+
+lval* builtin_matmul(lval* a) {
+    if (a->count != 2 || a->cell[0]->type != LVAL_MAT || a->cell[1]->type != LVAL_MAT) {
+        lval_del(a);
+        return lval_err("matmul espera duas matrizes!");
+    }
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    if (x->cols != y->rows) {
+        lval_del(a);
+        return lval_err("matmul: dimensões incompatíveis!");
+    }
+
+    lval* r = lval_mat(x->rows, y->cols);
+    if (r->type == LVAL_ERR) {
+        lval_del(a);
+        return r;
+    }
+    lmat_gemm(x->rows, y->cols, x->cols, x->vdata, y->vdata, r->vdata);
+    lval_del(a);
+    return r;
+}
+
+/* Transposição em blocos LMAT_TILE x LMAT_TILE, uma faixa de linhas por tarefa */
+enum { LMAT_TILE = 32 };
+
+typedef struct {
+    const double* src;
+    double* dst;
+    long rows;
+    long cols;
+} lmat_transpose_job;
+
+void lmat_transpose_task(void* ctx, int task) {
+    lmat_transpose_job* t = ctx;
+    long i0 = (long)task * LMAT_TILE;
+    long i1 = i0 + LMAT_TILE < t->rows ? i0 + LMAT_TILE : t->rows;
+    for (long j0 = 0; j0 < t->cols; j0 += LMAT_TILE) {
+        long j1 = j0 + LMAT_TILE < t->cols ? j0 + LMAT_TILE : t->cols;
+        for (long i = i0; i < i1; i++) {
+            for (long j = j0; j < j1; j++) {
+                t->dst[j * t->rows + i] = t->src[i * t->cols + j];
+            }
+        }
+    }
+}
+
+lval* builtin_transpose(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_MAT) {
+        lval_del(a);
+        return lval_err("transpose espera uma matriz!");
+    }
+
+    lval* x = a->cell[0];
+    lval* r = lval_mat(x->cols, x->rows);
+    if (r->type == LVAL_ERR) {
+        lval_del(a);
+        return r;
+    }
+    lmat_transpose_job t = { x->vdata, r->vdata, x->rows, x->cols };
+    int tasks = (int)((x->rows + LMAT_TILE - 1) / LMAT_TILE);
+    if (x->vlen < (1 << 16)) {
+        for (int i = 0; i < tasks; i++) { lmat_transpose_task(&t, i); }
+    } else {
+        lpool_run(tasks, lmat_transpose_task, &t);
+    }
+    lval_del(a);
+    return r;
+}
+
+/* Operações elemento a elemento, divididas em blocos de LMAT_CHUNK elementos */
+enum { LMAT_ADD, LMAT_SUB, LMAT_MUL };
+enum { LMAT_CHUNK = 1 << 16 };
+
+typedef struct {
+    double* x;
+    const double* y;
+    double s;
+    long n;
+    int op;
+} lmat_elem_job;
+
+void lmat_elem_task(void* ctx, int task) {
+    lmat_elem_job* e = ctx;
+    long i0 = (long)task * LMAT_CHUNK;
+    long n = e->n - i0 < LMAT_CHUNK ? e->n - i0 : LMAT_CHUNK;
+    double* x = e->x + i0;
+
+    if (e->y) {
+        const double* y = e->y + i0;
+        switch (e->op) {
+            case LMAT_ADD: lvec_k.add_d(x, y, n); break;
+            case LMAT_SUB: for (long i = 0; i < n; i++) { x[i] -= y[i]; } break;
+            case LMAT_MUL: for (long i = 0; i < n; i++) { x[i] *= y[i]; } break;
+        }
+    } else {
+        switch (e->op) {
+            case LMAT_ADD: lvec_k.adds_d(x, e->s, n); break;
+            case LMAT_SUB: lvec_k.adds_d(x, -e->s, n); break;
+            case LMAT_MUL: for (long i = 0; i < n; i++) { x[i] *= e->s; } break;
+        }
+    }
+}
+
+/* madd, msub e mmul aceitam outra matriz do mesmo formato ou um escalar */
+lval* builtin_melem(lval* a, int op, const char* name) {
+    char msg[128];
+    int ok = a->count == 2 && a->cell[0]->type == LVAL_MAT
+        && (a->cell[1]->type == LVAL_MAT || lval_is_number(a->cell[1]));
+    if (ok && a->cell[1]->type == LVAL_MAT) {
+        ok = a->cell[0]->rows == a->cell[1]->rows && a->cell[0]->cols == a->cell[1]->cols;
+    }
+    if (!ok) {
+        lval_del(a);
+        snprintf(msg, sizeof(msg), "%s espera uma matriz e outra do mesmo formato ou um número!", name);
+        return lval_err(msg);
+    }
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    if (!lval_vec_own(x)) {
+        lval_del(a);
+        return lmem_err();
+    }
+    lmat_elem_job e = {
+        x->vdata, y->type == LVAL_MAT ? y->vdata : NULL,
+        y->type == LVAL_MAT ? 0.0 : lval_as_dbl(y), x->vlen, op
+    };
+    int tasks = (int)((x->vlen + LMAT_CHUNK - 1) / LMAT_CHUNK);
+    lpool_run(tasks, lmat_elem_task, &e);
+    return lval_take(a, 0);
+}
+
+lval* builtin_mref(lval* a) {
+    if (a->count != 3 || a->cell[0]->type != LVAL_MAT
+        || a->cell[1]->type != LVAL_NUM || a->cell[2]->type != LVAL_NUM) {
+        lval_del(a);
+        return lval_err("mref espera uma matriz, uma linha e uma coluna!");
+    }
+
+    lval* m = a->cell[0];
+    long i = a->cell[1]->num;
+    long j = a->cell[2]->num;
+    if (i < 0 || i >= m->rows || j < 0 || j >= m->cols) {
+        lval_del(a);
+        return lval_err("Índice fora da matriz!");
+    }
+
+    lval* x = lval_dbl(((double*)m->vdata)[i * m->cols + j]);
+    lval_del(a);
+    return x;
+}
+
+/* Aritmética em ponto flutuante, quando algum operando é double */
+lval* builtin_op_dbl(lval* a, char* op) {
+    lval* x = lval_pop(a, 0);
+    double r = lval_as_dbl(x);
+    lval_del(x);
+
+    if ((strcmp(op, "-") == 0) && a->count == 0) { r = -r; }
+
+    while (a->count > 0) {
+        lval* y = lval_pop(a, 0);
+        double d = lval_as_dbl(y);
+        lval_del(y);
+
+        if (strcmp(op, "+") == 0) { r += d; }
+        if (strcmp(op, "-") == 0) { r -= d; }
+        if (strcmp(op, "*") == 0) { r *= d; }
+        if (strcmp(op, "/") == 0) {
+            if (d == 0) {
+                lval_del(a);
+                return lval_err("Erro: Divisão por zero!");
+            }
+            r /= d;
+        }
+    }
+
+    lval_del(a);
+    return lval_dbl(r);
+}
+
+lval* builtin_op(lval* a, char* op) {
+    int dbl = 0;
+    for(int i = 0; i < a->count; i++) {
+        /* Verifica se todos os elementos são números */
+        if (a->cell[i]->type == LVAL_DBL) { dbl = 1; continue; }
+        if (a->cell[i]->type != LVAL_NUM) {
+            lval_del(a);
+            return lval_err("Operador não pode operar sobre tipos não números!");
+        }
+    }
+    if (dbl) { return builtin_op_dbl(a, op); }
+
+    lval* x = lval_pop(a, 0);
+    /* Se o operador é '-', e só tem um operando, faz a negação */
+    if ((strcmp(op, "-") == 0) && a->count == 0) {
+        if (x->num == LONG_MIN) {
+            lval_del(x);
+            lval_del(a);
+            return lval_err("Erro: Transbordo de inteiro!");
+        }
+        x->num = -x->num;           
+    }
+
+    while (a->count > 0) {
+        lval* y = lval_pop(a, 0);
+        int over = 0;
+
+        if (strcmp(op, "+") == 0) { over = __builtin_add_overflow(x->num, y->num, &x->num); }
+        if (strcmp(op, "-") == 0) { over = __builtin_sub_overflow(x->num, y->num, &x->num); }
+        if (strcmp(op, "*") == 0) { over = __builtin_mul_overflow(x->num, y->num, &x->num); }
+        if (strcmp(op, "/") == 0) {
             if (y->num == 0) {
                 lval_del(x);
                 lval_del(y);
-                x = lval_err("Erro: Divisão por zero!");
-                break;
+                x = lval_err("Erro: Divisão por zero!");
+                break;
+            }
+            /* LONG_MIN / -1 não cabe em long e gera SIGFPE */
+            if (x->num == LONG_MIN && y->num == -1) { over = 1; }
+            else { x->num /= y->num; }
+        }
+
+        lval_del(y);
+        if (over) {
+            lval_del(x);
+            x = lval_err("Erro: Transbordo de inteiro!");
+            break;
+        }
+    }
+
+    lval_del(a);
+    return x;
+}   
+
+/* Comparações devolvem 1 ou 0; == e != também comparam strings */
+lval* builtin_cmp(lval* a, int op, const char* name) {
+    char msg[128];
+    if (a->count != 2) {
+        lval_del(a);
+        snprintf(msg, sizeof(msg), "%s espera dois argumentos!", name);
+        return lval_err(msg);
+    }
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    int r;
+    if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+        r = lvec_cmp_i(x->num, op, y->num);
+    } else if (lval_is_number(x) && lval_is_number(y)) {
+        r = lvec_cmp_d(lval_as_dbl(x), op, lval_as_dbl(y));
+    } else if ((op == LVEC_EQ || op == LVEC_NE) && x->type == LVAL_STR && y->type == LVAL_STR) {
+        r = x->str.len == y->str.len
+            && memcmp(lval_str_flat(x), lval_str_flat(y), x->str.len) == 0;
+        if (op == LVEC_NE) { r = !r; }
+    } else {
+        lval_del(a);
+        snprintf(msg, sizeof(msg), "%s não pode comparar esses tipos!", name);
+        return lval_err(msg);
+    }
+
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_load(lval* a);
+lval* builtin_list(lval* a);
+lval* builtin_map(lval* a);
+lval* builtin_reduce(lval* a);
+lval* builtin_pmap(lval* a);
+lval* builtin_range(lval* a);
+lval* builtin_iterate(lval* a);
+lval* builtin_seq(lval* a);
+lval* builtin_filter(lval* a);
+lval* builtin_take(lval* a);
+lval* builtin_collect(lval* a);
+lval* builtin_ffi_open(lval* a);
+lval* builtin_ffi_bind(lval* a);
+lval* builtin_stats(lval* a);
+lval* builtin_heap_limit(lval* a);
+lval* builtin_read_lines(lval* a);
+lval* builtin_read_ints(lval* a);
+lval* builtin_write(lval* a);
+lval* builtin_preduce(lval* a);
+lval* builtin_spawn(lval* a);
+lval* builtin_chan(lval* a);
+lval* builtin_send(lval* a);
+lval* builtin_recv(lval* a);
+lval* builtin_select(lval* a);
+
+lval* builtin(lval* a, char* func) {
+    /* Ponto seguro: nenhum builtin começa com o orçamento estourado */
+    if (lmem_exceeded()) {
+        lval_del(a);
+        return lmem_err();
+    }
+    if (strcmp("concat", func) == 0) { return builtin_concat(a); }
+    if (strcmp("len", func) == 0) { return builtin_len(a); }
+    if (strcmp("substr", func) == 0) { return builtin_substr(a); }
+    if (strcmp("str-hash", func) == 0) { return builtin_str_hash(a); }
+    if (strcmp("vsum", func) == 0) { return builtin_vsum(a); }
+    if (strcmp("vdot", func) == 0) { return builtin_vdot(a); }
+    if (strcmp("vmap-add", func) == 0) { return builtin_vmap_add(a); }
+    if (strcmp("vmin", func) == 0) { return builtin_vminmax(a, 0); }
+    if (strcmp("vmax", func) == 0) { return builtin_vminmax(a, 1); }
+    if (strcmp("vfilter", func) == 0) { return builtin_vfilter(a); }
+    if (strcmp("vref", func) == 0) { return builtin_vref(a); }
+    if (strcmp("matrix", func) == 0) { return builtin_matrix(a); }
+    if (strcmp("matmul", func) == 0) { return builtin_matmul(a); }
+    if (strcmp("transpose", func) == 0) { return builtin_transpose(a); }
+    if (strcmp("madd", func) == 0) { return builtin_melem(a, LMAT_ADD, "madd"); }
+    if (strcmp("msub", func) == 0) { return builtin_melem(a, LMAT_SUB, "msub"); }
+    if (strcmp("mmul", func) == 0) { return builtin_melem(a, LMAT_MUL, "mmul"); }
+    if (strcmp("mref", func) == 0) { return builtin_mref(a); }
+    if (strcmp("load", func) == 0) { return builtin_load(a); }
+    if (strcmp("list", func) == 0) { return builtin_list(a); }
+    if (strcmp("map", func) == 0) { return builtin_map(a); }
+    if (strcmp("reduce", func) == 0) { return builtin_reduce(a); }
+    if (strcmp("pmap", func) == 0) { return builtin_pmap(a); }
+    if (strcmp("range", func) == 0) { return builtin_range(a); }
+    if (strcmp("iterate", func) == 0) { return builtin_iterate(a); }
+    if (strcmp("seq", func) == 0) { return builtin_seq(a); }
+    if (strcmp("filter", func) == 0) { return builtin_filter(a); }
+    if (strcmp("take", func) == 0) { return builtin_take(a); }
+    if (strcmp("collect", func) == 0) { return builtin_collect(a); }
+    if (strcmp("ffi-open", func) == 0) { return builtin_ffi_open(a); }
+    if (strcmp("ffi-bind", func) == 0) { return builtin_ffi_bind(a); }
+    if (strcmp("stats", func) == 0) { return builtin_stats(a); }
+    if (strcmp("heap-limit", func) == 0) { return builtin_heap_limit(a); }
+    if (strcmp("read-lines", func) == 0) { return builtin_read_lines(a); }
+    if (strcmp("read-ints", func) == 0) { return builtin_read_ints(a); }
+    if (strcmp("write", func) == 0) { return builtin_write(a); }
+    if (strcmp("preduce", func) == 0) { return builtin_preduce(a); }
+    if (strcmp("spawn", func) == 0) { return builtin_spawn(a); }
+    if (strcmp("chan", func) == 0) { return builtin_chan(a); }
+    if (strcmp("send", func) == 0) { return builtin_send(a); }
+    if (strcmp("recv", func) == 0) { return builtin_recv(a); }
+    if (strcmp("select", func) == 0) { return builtin_select(a); }
+    if (strcmp("<", func) == 0) { return builtin_cmp(a, LVEC_LT, "<"); }
+    if (strcmp(">", func) == 0) { return builtin_cmp(a, LVEC_GT, ">"); }
+    if (strcmp("<=", func) == 0) { return builtin_cmp(a, LVEC_LE, "<="); }
+    if (strcmp(">=", func) == 0) { return builtin_cmp(a, LVEC_GE, ">="); }
+    if (strcmp("==", func) == 0) { return builtin_cmp(a, LVEC_EQ, "=="); }
+    if (strcmp("!=", func) == 0) { return builtin_cmp(a, LVEC_NE, "!="); }
+    if (strstr("+-/*", func)) { return builtin_op(a, func); }
+    lval_del(a);
+    return lval_err("Função desconhecida!");
+}
+
+/*
+ * FFI. (ffi-open "libm.so.6") carrega uma biblioteca compartilhada e
+ * (ffi-bind lib "pow" "d:dd") liga uma função dela a uma assinatura:
+ * o retorno antes dos dois pontos e os argumentos depois, com
+ *   i  int            l  long / int64_t      d  double
+ *   p  ponteiro, dado como número            v  sem retorno
+ *   b  buffer: os dados de um vetor, matriz ou string, sem cópia
+ * A chamada monta os argumentos em arrays na pilha, sem alocar nada.
+ */
+#define LFFI_INTS 6
+#define LFFI_DBLS 8
+#define LFFI_ARGS (LFFI_INTS + LFFI_DBLS)
+
+#if !defined(_WIN32) && defined(__x86_64__)
+#define LFFI_SUPPORTED 1
+#else
+#define LFFI_SUPPORTED 0
+#endif
+
+typedef struct lffi {
+    int refs;
+    char* name;
+
+    /* Biblioteca: handle do dlopen; função: a biblioteca que a mantém aberta */
+    void* handle;
+    struct lffi* lib;
+
+    void (*fn)(void);
+    char ret;
+    int nargs;
+    char args[LFFI_ARGS];
+} lffi;
+
+/*
+ * Toda função ligada é chamada por um destes dois tipos, que preenchem os
+ * seis registradores de inteiros e os oito de doubles. Isso só vale na ABI
+ * System V de x86-64 (Linux, BSDs, macOS), em que os dois bancos são
+ * preenchidos em ordem e independentes um do outro, registradores que a
+ * função não lê são ignorados e o retorno vem em rax ou xmm0; por isso
+ * LFFI_SUPPORTED se restringe a ela. Ainda assim a função precisa ser não
+ * variádica e ter só argumentos inteiros de até 64 bits, ponteiros e
+ * doubles, como as assinaturas aceitas por ffi-bind. Em outras ABIs
+ * (Windows x64, AArch64 da Apple, 32 bits) seria preciso uma libffi.
+ */
+typedef int64_t (*lffi_fn_i)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t,
+    double, double, double, double, double, double, double, double);
+typedef double (*lffi_fn_d)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t,
+    double, double, double, double, double, double, double, double);
+
+void lffi_release(lffi* f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    if (f->lib) { lffi_release(f->lib); }
+#if LFFI_SUPPORTED
+    if (f->handle) { dlclose(f->handle); }
+#endif
+    lmem_free(f->name);
+    lmem_free(f);
+}
+
+void lffi_ref(lffi* f) {
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+lval* lval_ffi(lffi* f) {
+    lval* v = lmem_alloc(sizeof(lval));
+    v->type = LVAL_FFI;
+    v->ffi = f;
+    return v;
+}
+
+void lffi_print(FILE* f, lffi* x) {
+    fprintf(f, x->fn ? "<nativa %s>" : "<biblioteca %s>", x->name);
+}
+
+/* Chamar a função nativa f com os argumentos av, que são só emprestados */
+lval* lffi_call(lffi* f, lval** av, int n) {
+    if (n != f->nargs) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Número errado de argumentos: esperava %d, recebeu %d!", f->nargs, n);
+        return lval_err(msg);
+    }
+
+    int64_t iv[LFFI_INTS] = {0};
+    double dv[LFFI_DBLS] = {0};
+    int ni = 0, nd = 0;
+    for (int i = 0; i < n; i++) {
+        lval* x = av[i];
+        int ok = 1;
+        switch (f->args[i]) {
+            case 'd':
+                ok = lval_is_number(x);
+                if (ok) { dv[nd++] = lval_as_dbl(x); }
+            break;
+            case 'i':
+            case 'l':
+            case 'p':
+                ok = x->type == LVAL_NUM;
+                if (ok) { iv[ni++] = x->num; }
+            break;
+            case 'b':
+                if (x->type == LVAL_VEC || x->type == LVAL_MAT) {
+                    /* O código nativo pode escrever no buffer: as outras cópias não veem */
+                    if (!lval_vec_own(x)) { return lmem_err(); }
+                    iv[ni++] = (int64_t)(intptr_t)x->vdata;
+                } else if (x->type == LVAL_STR) {
+                    iv[ni++] = (int64_t)(intptr_t)lval_str_flat(x);
+                } else {
+                    ok = 0;
+                }
+            break;
+        }
+        if (!ok) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Argumento %d de %s não combina com a assinatura!", i + 1, f->name);
+            return lval_err(msg);
+        }
+    }
+
+    if (f->ret == 'd') {
+        double r = ((lffi_fn_d)f->fn)(iv[0], iv[1], iv[2], iv[3], iv[4], iv[5],
+            dv[0], dv[1], dv[2], dv[3], dv[4], dv[5], dv[6], dv[7]);
+        return lval_dbl(r);
+    }
+    int64_t r = ((lffi_fn_i)f->fn)(iv[0], iv[1], iv[2], iv[3], iv[4], iv[5],
+        dv[0], dv[1], dv[2], dv[3], dv[4], dv[5], dv[6], dv[7]);
+    switch (f->ret) {
+        case 'i': return lval_num((int)r);
+        case 'v': return lval_sexpr();
+    }
+    return lval_num(r);
+}
+
+/* (ffi-open "caminho"); a string vazia abre o próprio programa */
+lval* builtin_ffi_open(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_STR) {
+        lval_del(a);
+        return lval_err("ffi-open espera o caminho de uma biblioteca!");
+    }
+#if LFFI_SUPPORTED
+    const char* path = lval_str_flat(a->cell[0]);
+    void* h = dlopen(path[0] ? path : NULL, RTLD_NOW | RTLD_LOCAL);
+    if (!h) {
+        lval* e = lval_err(dlerror());
+        lval_del(a);
+        return e;
+    }
+    lffi* f = lmem_calloc(1, sizeof(lffi));
+    f->refs = 1;
+    f->name = lmem_strdup(path);
+    f->handle = h;
+    lval_del(a);
+    return lval_ffi(f);
+#else
+    lval_del(a);
+    return lval_err("FFI não suportada nesta plataforma!");
+#endif
+}
+
+/* (ffi-bind lib "nome" "assinatura") */
+lval* builtin_ffi_bind(lval* a) {
+    if (a->count != 3 || a->cell[0]->type != LVAL_FFI || a->cell[0]->ffi->fn
+        || a->cell[1]->type != LVAL_STR || a->cell[2]->type != LVAL_STR) {
+        lval_del(a);
+        return lval_err("ffi-bind espera uma biblioteca, um nome e uma assinatura!");
+    }
+
+    /* Validar a assinatura: retorno, ':', argumentos que cabem nos registradores */
+    const char* sig = lval_str_flat(a->cell[2]);
+    int ok = strchr("ildpv", sig[0]) && sig[0] && sig[1] == ':';
+    int nargs = 0, ni = 0, nd = 0;
+    for (const char* c = sig + 2; ok && *c; c++) {
+        ok = strchr("ildpb", *c) != NULL && nargs < LFFI_ARGS;
+        if (*c == 'd') { nd++; } else { ni++; }
+        nargs++;
+    }
+    if (!ok || ni > LFFI_INTS || nd > LFFI_DBLS) {
+        lval_del(a);
+        return lval_err("Assinatura inválida!");
+    }
+
+    lffi* lib = a->cell[0]->ffi;
+    const char* name = lval_str_flat(a->cell[1]);
+    void* sym = NULL;
+#if LFFI_SUPPORTED
+    dlerror();
+    sym = dlsym(lib->handle, name);
+#endif
+    if (!sym) {
+        lval_del(a);
+        return lval_err("Símbolo não encontrado na biblioteca!");
+    }
+
+    lffi* f = lmem_calloc(1, sizeof(lffi));
+    f->refs = 1;
+    f->name = lmem_strdup(name);
+    f->lib = lib;
+    lffi_ref(lib);
+    /* POSIX garante que o ponteiro de dlsym serve como ponteiro de função */
+    memcpy(&f->fn, &sym, sizeof(f->fn));
+    f->ret = sig[0];
+    f->nargs = nargs;
+    memcpy(f->args, sig + 2, nargs);
+    lval_del(a);
+    return lval_ffi(f);
+}
+
+/*
+ * Variáveis globais. Cada nome tem uma célula fixa; o compilador guarda o
+ * ponteiro da célula no símbolo, então o acesso em tempo de execução não
+ * passa pela tabela. Valores substituídos por def são aposentados e não
+ * liberados, porque uma chamada em andamento pode estar usando o antigo.
+ */
+enum { LGLOBAL_BUCKETS = 1024 };
+
+typedef struct lglobal {
+    char* name;
+    unsigned long hash;
+    lval* val;
+    struct lglobal* next;
+
+    /* Última varredura do modo batch que passou por esta célula */
+    unsigned long mark;
+} lglobal;
+
+/* Tabela de células; dobra de tamanho quando tem mais de 2 nomes por balde */
+static lglobal** lglobal_table;
+static unsigned long lglobal_buckets;
+static unsigned long lglobal_count;
+static lval* lglobal_retired;
+
+#ifndef _WIN32
+static pthread_mutex_t lglobal_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LGLOBAL_LOCK() pthread_mutex_lock(&lglobal_lock)
+#define LGLOBAL_UNLOCK() pthread_mutex_unlock(&lglobal_lock)
+#else
+#define LGLOBAL_LOCK()
+#define LGLOBAL_UNLOCK()
+#endif
+
+/* Redistribuir as células; elas não mudam de endereço */
+void lglobal_grow(void) {
+    unsigned long n = lglobal_buckets ? lglobal_buckets * 2 : LGLOBAL_BUCKETS;
+    lglobal** table = lmem_calloc(n, sizeof(lglobal*));
+    for (unsigned long i = 0; i < lglobal_buckets; i++) {
+        lglobal* g = lglobal_table[i];
+        while (g) {
+            lglobal* next = g->next;
+            g->next = table[g->hash % n];
+            table[g->hash % n] = g;
+            g = next;
+        }
+    }
+    lmem_free(lglobal_table);
+    lglobal_table = table;
+    lglobal_buckets = n;
+}
+
+/* Célula global de name, criada sem valor na primeira vez */
+lglobal* lglobal_get(const char* name) {
+    unsigned long h = 2166136261UL;
+    for (const char* c = name; *c; c++) {
+        h = (h ^ (unsigned char)*c) * 16777619UL;
+    }
+
+    LGLOBAL_LOCK();
+    if (lglobal_count >= lglobal_buckets * 2) { lglobal_grow(); }
+    lglobal** bucket = &lglobal_table[h % lglobal_buckets];
+    lglobal* g = *bucket;
+    while (g && (g->hash != h || strcmp(g->name, name) != 0)) { g = g->next; }
+    if (!g) {
+        g = lmem_alloc(sizeof(lglobal));
+        g->name = lmem_alloc(strlen(name) + 1);
+        strcpy(g->name, name);
+        g->hash = h;
+        g->val = NULL;
+        g->mark = 0;
+        g->next = *bucket;
+        *bucket = g;
+        lglobal_count++;
+    }
+    LGLOBAL_UNLOCK();
+    return g;
+}
+
+/* Célula de name[0..n), ou NULL se o nome nunca foi visto; não cria */
+lglobal* lglobal_find(const char* name, size_t n) {
+    unsigned long h = 2166136261UL;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619UL;
+    }
+
+    LGLOBAL_LOCK();
+    lglobal* g = lglobal_buckets ? lglobal_table[h % lglobal_buckets] : NULL;
+    while (g && (g->hash != h || strncmp(g->name, name, n) != 0 || g->name[n] != '\0')) {
+        g = g->next;
+    }
+    LGLOBAL_UNLOCK();
+    return g;
+}
+
+void lglobal_set(lglobal* g, lval* v) {
+    LGLOBAL_LOCK();
+    lval* old = g->val;
+    g->val = v;
+    if (old) {
+        /* A lista de aposentados reaproveita as células de uma expressão S */
+        if (!lglobal_retired) { lglobal_retired = lval_sexpr(); }
+        lval_add(lglobal_retired, old);
+    }
+    LGLOBAL_UNLOCK();
+}
+
+/*
+ * Compilação: antes de avaliar, cada expressão lida é percorrida uma vez.
+ * Símbolos viram slots de argumento, índices de captura ou células globais,
+ * e cada (lambda (params) corpo) vira um lval de função com o corpo já
+ * compilado. Uma lambda que usa variáveis de lambdas externas as lista como
+ * capturas; se a variável vem de mais de um nível acima, as lambdas do meio
+ * também a capturam, então toda closure é um vetor plano de valores.
+ */
+enum { LFORM_DEF, LFORM_IF };
+
+/*
+ * Quickening. Uma chamada binária a + - * / ou a uma comparação começa
+ * observando: na primeira execução, se os dois operandos são inteiros, o
+ * site passa a LQ_FIXNUM e daí em diante calcula direto em C, com os
+ * operandos emprestados do frame e sem montar lista de argumentos nem
+ * procurar o builtin pelo nome. Resta só a guarda: os dois operandos
+ * continuam inteiros e a conta não transborda. Se ela falha, o site volta
+ * de vez ao caminho genérico do builtin.
+ */
+enum { LQOP_NONE, LQOP_ADD, LQOP_SUB, LQOP_MUL, LQOP_DIV,
+       LQOP_LT, LQOP_GT, LQOP_LE, LQOP_GE, LQOP_EQ, LQOP_NE };
+enum { LQ_OBSERVE, LQ_FIXNUM, LQ_GENERIC };
+
+int lquick_op(const char* name) {
+    static const char* ops[] = { "+", "-", "*", "/", "<", ">", "<=", ">=", "==", "!=" };
+    for (int i = 0; i < 10; i++) {
+        if (strcmp(ops[i], name) == 0) { return LQOP_ADD + i; }
+    }
+    return LQOP_NONE;
+}
+
+typedef struct lscope {
+    struct lscope* parent;
+    lfun* fun;
+} lscope;
+
+/* Onde name está visível em s; devolve 0 se só pode ser global */
+int lscope_resolve(lscope* s, const char* name, int* kind, int* slot) {
+    if (!s) { return 0; }
+
+    lfun* f = s->fun;
+    for (int i = 0; i < f->nparams; i++) {
+        if (strcmp(f->params[i], name) == 0) { *kind = LSYM_LOCAL; *slot = i; return 1; }
+    }
+    for (int i = 0; i < f->ncaptures; i++) {
+        if (strcmp(f->captures[i], name) == 0) { *kind = LSYM_CAPTURE; *slot = i; return 1; }
+    }
+
+    int pkind, pslot;
+    if (!lscope_resolve(s->parent, name, &pkind, &pslot)) { return 0; }
+
+    int n = f->ncaptures++;
+    f->captures = lmem_realloc(f->captures, sizeof(char*) * f->ncaptures);
+    f->capture_kind = lmem_realloc(f->capture_kind, sizeof(int) * f->ncaptures);
+    f->capture_slot = lmem_realloc(f->capture_slot, sizeof(int) * f->ncaptures);
+    f->captures[n] = lmem_alloc(strlen(name) + 1);
+    strcpy(f->captures[n], name);
+    f->capture_kind[n] = pkind;
+    f->capture_slot[n] = pslot;
+
+    *kind = LSYM_CAPTURE;
+    *slot = n;
+    return 1;
+}
+
+/* Trocar o conteúdo de v pelo de x e liberar o que era de v */
+void lval_replace(lval* v, lval* x) {
+    lval tmp = *v;
+    *v = *x;
+    *x = tmp;
+    lval_del(x);
+}
+
+void lval_compile(lval* v, lscope* s);
+
+void lval_compile_lambda(lval* v, lscope* s) {
+    lval* params = v->cell[1];
+    int ok = v->count == 3 && params->type == LVAL_SEXPR;
+    for (int i = 0; ok && i < params->count; i++) {
+        ok = params->cell[i]->type == LVAL_SYM;
+    }
+    if (!ok) {
+        lval_replace(v, lval_err("lambda espera uma lista de parâmetros e um corpo!"));
+        return;
+    }
+
+    lfun* f = lmem_calloc(1, sizeof(lfun));
+    f->refs = 1;
+    f->nparams = params->count;
+    f->params = lmem_alloc(sizeof(char*) * (params->count ? params->count : 1));
+    for (int i = 0; i < params->count; i++) {
+        f->params[i] = lmem_alloc(strlen(params->cell[i]->sym) + 1);
+        strcpy(f->params[i], params->cell[i]->sym);
+    }
+
+    lscope inner = { s, f };
+    f->body = lval_pop(v, 2);
+    lval_compile(f->body, &inner);
+
+    lval* x = lmem_alloc(sizeof(lval));
+    x->type = LVAL_FUN;
+    x->fun = f;
+    x->env = NULL;
+    lval_replace(v, x);
+}
+
+void lval_compile(lval* v, lscope* s) {
+    if (v->type == LVAL_SYM && v->sym_kind == LSYM_FREE) {
+        if (!lscope_resolve(s, v->sym, &v->sym_kind, &v->slot)) {
+            v->sym_kind = LSYM_GLOBAL;
+            v->global = lglobal_get(v->sym);
+        }
+        return;
+    }
+    if (v->type != LVAL_SEXPR) { return; }
+
+    lval* head = v->count > 0 ? v->cell[0] : NULL;
+    if (head && head->type == LVAL_SYM) {
+        if (strcmp(head->sym, "lambda") == 0 || strcmp(head->sym, "\\") == 0) {
+            if (v->count < 2) {
+                lval_replace(v, lval_err("lambda espera uma lista de parâmetros e um corpo!"));
+                return;
+            }
+            lval_compile_lambda(v, s);
+            return;
+        }
+        if (strcmp(head->sym, "if") == 0) {
+            if (v->count != 3 && v->count != 4) {
+                lval_replace(v, lval_err("if espera uma condição, um valor e opcionalmente outro!"));
+                return;
+            }
+            head->sym_kind = LSYM_SPECIAL;
+            head->slot = LFORM_IF;
+            for (int i = 1; i < v->count; i++) {
+                lval_compile(v->cell[i], s);
+            }
+            return;
+        }
+        if (strcmp(head->sym, "def") == 0) {
+            if (v->count != 3 || v->cell[1]->type != LVAL_SYM) {
+                lval_replace(v, lval_err("def espera um símbolo e um valor!"));
+                return;
+            }
+            head->sym_kind = LSYM_SPECIAL;
+            head->slot = LFORM_DEF;
+            v->cell[1]->sym_kind = LSYM_GLOBAL;
+            v->cell[1]->global = lglobal_get(v->cell[1]->sym);
+            lval_compile(v->cell[2], s);
+            return;
+        }
+    }
+
+    for (int i = 0; i < v->count; i++) {
+        lval_compile(v->cell[i], s);
+    }
+    if (v->count == 3 && head->type == LVAL_SYM && head->sym_kind == LSYM_GLOBAL) {
+        v->qop = lquick_op(head->sym);
+        v->qstate = LQ_OBSERVE;
+    }
+}
+
+/*
+ * Inferência de tipos. Depois da compilação, uma passada de baixo para
+ * cima marca as expressões que certamente dão um inteiro (ou um erro, que
+ * é sempre tratado antes): literais inteiros, comparações, contas de dois
+ * inteiros e ifs com os dois ramos inteiros. Num site aritmético, cada
+ * operando provado inteiro ganha um bit em qknown e a guarda de tipo dele
+ * deixa de ser feita. Variáveis e chamadas de funções ficam sem tipo, já
+ * que um def pode trocá-las a qualquer momento; se o próprio operador for
+ * redefinido, as provas deixam de valer todas de uma vez.
+ */
+enum { LTYPE_ANY, LTYPE_INT };
+
+static int lquick_redefined;
+static long linfer_checks;
+static long linfer_removed;
+
+int lval_infer(lval* v) {
+    if (v->type == LVAL_NUM) { return LTYPE_INT; }
+    if (v->type == LVAL_FUN) {
+        if (v->fun->body) { lval_infer(v->fun->body); }
+        return LTYPE_ANY;
+    }
+    if (v->type != LVAL_SEXPR) { return LTYPE_ANY; }
+
+    int t[3] = { LTYPE_ANY, LTYPE_ANY, LTYPE_ANY };
+    for (int i = 0; i < v->count; i++) {
+        int ti = lval_infer(v->cell[i]);
+        if (i > 0 && i < 3) { t[i - 1] = ti; }
+        if (i == 3) { t[2] = ti; }
+    }
+
+    lval* head = v->count > 0 ? v->cell[0] : NULL;
+    if (head && head->type == LVAL_SYM && head->sym_kind == LSYM_SPECIAL && head->slot == LFORM_IF) {
+        return v->count == 4 && t[1] == LTYPE_INT && t[2] == LTYPE_INT ? LTYPE_INT : LTYPE_ANY;
+    }
+    if (!v->qop) { return LTYPE_ANY; }
+
+    v->qknown = (t[0] == LTYPE_INT) | (t[1] == LTYPE_INT) << 1;
+    __atomic_add_fetch(&linfer_checks, 2, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&linfer_removed, (v->qknown & 1) + (v->qknown >> 1), __ATOMIC_RELAXED);
+
+    if (v->qop >= LQOP_LT) { return LTYPE_INT; }
+    return t[0] == LTYPE_INT && t[1] == LTYPE_INT ? LTYPE_INT : LTYPE_ANY;
+}
+
+/*
+ * (stats "infer"): {verificações removidas, verificações em sites aritméticos}
+ * (stats "heap"): {bytes em uso, pico, orçamento}
+ */
+lval* builtin_stats(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_STR) {
+        lval_del(a);
+        return lval_err("stats espera o nome de um contador!");
+    }
+
+    const char* name = lval_str_flat(a->cell[0]);
+    lval* x = lval_qexpr();
+    if (strcmp(name, "infer") == 0) {
+        lval_add(x, lval_num(__atomic_load_n(&linfer_removed, __ATOMIC_RELAXED)));
+        lval_add(x, lval_num(__atomic_load_n(&linfer_checks, __ATOMIC_RELAXED)));
+    } else if (strcmp(name, "heap") == 0) {
+        lval_add(x, lval_num((long)__atomic_load_n(&lmem_used, __ATOMIC_RELAXED)));
+        lval_add(x, lval_num((long)__atomic_load_n(&lmem_peak, __ATOMIC_RELAXED)));
+        lval_add(x, lval_num((long)__atomic_load_n(&lmem_budget, __ATOMIC_RELAXED)));
+    } else {
+        lval_del(x);
+        x = lval_err("Contador desconhecido!");
+    }
+    lval_del(a);
+    return x;
+}
+
+/* (heap-limit n): trocar o orçamento de memória por n bytes (0 = sem limite) */
+lval* builtin_heap_limit(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_NUM || a->cell[0]->num < 0) {
+        lval_del(a);
+        return lval_err("heap-limit espera um número de bytes!");
+    }
+    size_t old = __atomic_exchange_n(&lmem_budget, (size_t)a->cell[0]->num, __ATOMIC_RELAXED);
+    lmem_update(__atomic_load_n(&lmem_used, __ATOMIC_RELAXED));
+    lval_del(a);
+    return lval_num((long)old);
+}
+
+/*
+ * Frame de uma chamada: os argumentos ficam num vetor na pilha de C e as
+ * capturas são lidas direto da closure. Como as closures copiam o que
+ * capturam, nenhum frame sobrevive à sua chamada e nada é alocado para ele.
+ */
+enum { LFRAME_SLOTS = 8 };
+
+typedef struct {
+    lval** slots;
+    lval** env;
+} lframe;
+
+/* Valor de um símbolo compilado, sem copiar; NULL se não tem valor */
+lval* lval_lookup(lval* x, lframe* fr) {
+    switch (x->sym_kind) {
+        case LSYM_LOCAL: return fr->slots[x->slot];
+        case LSYM_CAPTURE: return fr->env[x->slot];
+        case LSYM_GLOBAL: return x->global->val;
+    }
+    return NULL;
+}
+
+lval* lval_eval_in(lval* x, lframe* fr);
+
+/* Conta inteira de um site; devolve 0 se a guarda de transbordo falha */
+int lquick_fix(int op, long x, long y, long* r) {
+    switch (op) {
+        case LQOP_ADD: return !__builtin_add_overflow(x, y, r);
+        case LQOP_SUB: return !__builtin_sub_overflow(x, y, r);
+        case LQOP_MUL: return !__builtin_mul_overflow(x, y, r);
+        case LQOP_DIV:
+            if (y == 0 || (x == LONG_MIN && y == -1)) { return 0; }
+            *r = x / y;
+            return 1;
+        case LQOP_LT: *r = x < y; return 1;
+        case LQOP_GT: *r = x > y; return 1;
+        case LQOP_LE: *r = x <= y; return 1;
+        case LQOP_GE: *r = x >= y; return 1;
+        case LQOP_EQ: *r = x == y; return 1;
+        case LQOP_NE: *r = x != y; return 1;
+    }
+    return 0;
+}
+
+/* Operando de um site: emprestado se é literal ou variável, senão avaliado */
+lval* lquick_arg(lval* y, lframe* fr, lval** owned) {
+    *owned = NULL;
+    if (y->type == LVAL_NUM || y->type == LVAL_DBL) { return y; }
+    if (y->type == LVAL_SYM) {
+        lval* v = lval_lookup(y, fr);
+        if (v) { return v; }
+    }
+    return *owned = lval_eval_in(y, fr);
+}
+
+/* Executar um site aritmético; NULL se ele já é genérico e nada foi avaliado */
+lval* lval_eval_quick(lval* x, lframe* fr) {
+    int state = __atomic_load_n(&x->qstate, __ATOMIC_RELAXED);
+    if (state == LQ_GENERIC) { return NULL; }
+
+    lval* ox;
+    lval* oy;
+    lval* a = lquick_arg(x->cell[1], fr, &ox);
+    if (a->type == LVAL_ERR) { return ox ? ox : lval_copy(a); }
+    lval* b = lquick_arg(x->cell[2], fr, &oy);
+    if (b->type == LVAL_ERR) {
+        if (ox) { lval_del(ox); }
+        return oy ? oy : lval_copy(b);
+    }
+
+    /* Operandos provados inteiros pela inferência dispensam a guarda de tipo */
+    int known = __atomic_load_n(&lquick_redefined, __ATOMIC_RELAXED) ? 0 : x->qknown;
+    long r;
+    if (((known & 1) || a->type == LVAL_NUM) && ((known & 2) || b->type == LVAL_NUM) && lquick_fix(x->qop, a->num, b->num, &r)) {
+        if (state == LQ_OBSERVE) { __atomic_store_n(&x->qstate, LQ_FIXNUM, __ATOMIC_RELAXED); }
+        if (oy) { lval_del(oy); }
+        if (ox) {
+            ox->num = r;
+            return ox;
+        }
+        return lval_num(r);
+    }
+
+    /* Guarda falhou: desotimizar e aplicar o builtin aos operandos já avaliados */
+    __atomic_store_n(&x->qstate, LQ_GENERIC, __ATOMIC_RELAXED);
+    lval* args = lval_sexpr();
+    lval_add(args, ox ? ox : lval_copy(a));
+    lval_add(args, oy ? oy : lval_copy(b));
+    return builtin(args, x->cell[0]->sym);
+}
+
+/* Criar uma closure a partir de uma lambda compilada, capturando do frame */
+lval* lval_closure(lval* x, lframe* fr) {
+    if (x->env || x->fun->ncaptures == 0) { return lval_copy(x); }
+
+    lfun* f = x->fun;
+    lval* v = lmem_alloc(sizeof(lval));
+    v->type = LVAL_FUN;
+    v->fun = f;
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    v->env = lmem_alloc(sizeof(lval*) * f->ncaptures);
+    for (int i = 0; i < f->ncaptures; i++) {
+        lval* y = f->capture_kind[i] == LSYM_LOCAL
+            ? fr->slots[f->capture_slot[i]]
+            : fr->env[f->capture_slot[i]];
+        v->env[i] = lval_copy(y);
+    }
+    return v;
+}
+
+/* Valores que podem ocupar a posição de operador */
+int lval_is_fn(lval* v) {
+    return v->type == LVAL_FUN || v->type == LVAL_SYM || v->type == LVAL_FFI;
+}
+
+/* Números diferentes de zero e expressões não vazias são verdadeiros */
+int lval_truthy(lval* v) {
+    switch (v->type) {
+        case LVAL_NUM: return v->num != 0;
+        case LVAL_DBL: return v->dbl != 0.0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: return v->count > 0;
+    }
+    return 1;
+}
+
+lval* lval_eval_def(lval* x, lframe* fr) {
+    lval* v = lval_eval_in(x->cell[2], fr);
+    if (v->type == LVAL_ERR) { return v; }
+    if (lquick_op(x->cell[1]->sym)) { __atomic_store_n(&lquick_redefined, 1, __ATOMIC_RELAXED); }
+    lglobal_set(x->cell[1]->global, v);
+    return lval_sexpr();
+}
+
+/* Avaliar os argumentos x->cell[1..] em fr para os slots de uma chamada */
+lval* lval_eval_args(lval* x, lframe* fr, lval** slots) {
+    int n = x->count - 1;
+    for (int i = 0; i < n; i++) {
+        slots[i] = lval_eval_in(x->cell[i + 1], fr);
+        if (slots[i]->type == LVAL_ERR) {
+            lval* err = slots[i];
+            for (int j = 0; j < i; j++) { lval_del(slots[j]); }
+            return err;
+        }
+    }
+    return NULL;
+}
+
+/* Tirar f do frame que vai ser descartado, se f mora nele */
+int lval_steal(lval** cells, int n, lval* f) {
+    for (int i = 0; i < n; i++) {
+        if (cells[i] == f) {
+            cells[i] = lval_sexpr();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Avaliar x no frame fr, sem consumir x.
+ *
+ * Chamadas em posição de cauda (o corpo de uma função e os ramos de um if)
+ * não recursam: o laço troca x pelo corpo da função chamada e o frame pelo
+ * dos argumentos novos. Os slots alternam entre dois vetores na pilha, então
+ * uma recursão de cauda roda em espaço de pilha constante e sem alocar
+ * frames. hold guarda a closure em execução quando ninguém mais a segura.
+ */
+lval* lval_eval_in(lval* x, lframe* fr) {
+    lval* bufs[2][LFRAME_SLOTS];
+    lval** cur = NULL;
+    int ncur = 0;
+    lval* hold = NULL;
+    lframe own;
+    lval* result;
+
+    /* Cada nível de recursão consome pilha do C; erro antes de ela acabar */
+    if (lstack_exhausted()) { return lval_err("Profundidade máxima de recursão excedida!"); }
+
+    while (1) {
+        /* Ponto seguro: desfazer a computação se o orçamento estourou */
+        if (lmem_exceeded()) { result = lmem_err(); break; }
+
+        if (x->type == LVAL_SYM) {
+            lval* v = lval_lookup(x, fr);
+            result = lval_copy(v ? v : x);
+            break;
+        }
+        if (x->type == LVAL_FUN) { result = lval_closure(x, fr); break; }
+        if (x->type != LVAL_SEXPR) { result = lval_copy(x); break; }
+
+        /* Se a expressão está vazia, retornar uma vazia */
+        if (x->count == 0) { result = lval_sexpr(); break; }
+
+        lval* head = x->cell[0];
+        if (head->type == LVAL_SYM && head->sym_kind == LSYM_SPECIAL) {
+            if (head->slot == LFORM_DEF) { result = lval_eval_def(x, fr); break; }
+
+            /* if: a condição não está em posição de cauda, o ramo escolhido está */
+            lval* c = lval_eval_in(x->cell[1], fr);
+            if (c->type == LVAL_ERR) { result = c; break; }
+            int t = lval_truthy(c);
+            lval_del(c);
+            if (!t && x->count == 3) { result = lval_sexpr(); break; }
+            x = x->cell[t ? 2 : 3];
+            continue;
+        }
+
+        /* Site aritmético com o builtin original, não redefinido por def */
+        if (x->qop && !head->global->val) {
+            result = lval_eval_quick(x, fr);
+            if (result) { break; }
+        }
+
+        /* O operador é usado emprestado quando é um símbolo com valor */
+        lval* f = NULL;
+        lval* owned = NULL;
+        if (head->type == LVAL_SYM) {
+            f = lval_lookup(head, fr);
+            if (!f) { f = head; }
+        } else {
+            f = owned = lval_eval_in(head, fr);
+        }
+
+        if (f->type != LVAL_FUN) {
+            if (f->type == LVAL_ERR || x->count == 1) {
+                /* Se a expressão tem apenas um elemento, retornar esse elemento */
+                result = owned ? owned : lval_copy(f);
+                owned = NULL;
+            } else if (f->type == LVAL_SYM) {
+                /* Avaliar os argumentos e aplicar o builtin */
+                lval* a = lval_sexpr();
+                result = NULL;
+                for (int i = 1; i < x->count; i++) {
+                    lval* y = lval_eval_in(x->cell[i], fr);
+                    if (y->type == LVAL_ERR) {
+                        lval_del(a);
+                        result = y;
+                        break;
+                    }
+                    lval_add(a, y);
+                }
+                if (!result) { result = builtin(a, f->sym); }
+            } else if (f->type == LVAL_FFI && x->count - 1 <= LFFI_ARGS) {
+                /* Variáveis vão emprestadas, então buffers chegam ao código nativo sem cópia */
+                lval* av[LFFI_ARGS];
+                lval* tmp[LFFI_ARGS];
+                int n = x->count - 1;
+                int i;
+                result = NULL;
+                for (i = 0; i < n && !result; i++) {
+                    lval* y = x->cell[i + 1];
+                    lval* v = y->type == LVAL_SYM ? lval_lookup(y, fr) : NULL;
+                    tmp[i] = v ? NULL : lval_eval_in(y, fr);
+                    av[i] = v ? v : tmp[i];
+                    if (av[i]->type == LVAL_ERR) { result = lval_copy(av[i]); }
+                }
+                if (!result) { result = lffi_call(f->ffi, av, n); }
+                while (i-- > 0) {
+                    if (tmp[i]) { lval_del(tmp[i]); }
+                }
+            } else if (f->type == LVAL_FFI) {
+                result = lval_err("Argumentos demais para uma função nativa!");
+            } else {
+                result = lval_err("Primeiro elemento não é um operador!");
+            }
+            if (owned) { lval_del(owned); }
+            break;
+        }
+
+        /* Chamada de função: avaliar os argumentos no frame atual */
+        int n = x->count - 1;
+        if (n != f->fun->nparams) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Número errado de argumentos: esperava %d, recebeu %d!", f->fun->nparams, n);
+            result = lval_err(msg);
+            if (owned) { lval_del(owned); }
+            break;
+        }
+        lval** args = n > LFRAME_SLOTS ? lmem_alloc(sizeof(lval*) * n)
+            : cur == bufs[0] ? bufs[1] : bufs[0];
+        result = lval_eval_args(x, fr, args);
+        if (result) {
+            if (args != bufs[0] && args != bufs[1]) { lmem_free(args); }
+            if (owned) { lval_del(owned); }
+            break;
+        }
+
+        /* Descartar o frame antigo, mantendo f vivo se ele morava nele */
+        if (!owned && cur && lval_steal(cur, ncur, f)) { owned = f; }
+        if (!owned && hold && hold->env && lval_steal(hold->env, hold->fun->ncaptures, f)) { owned = f; }
+        for (int i = 0; i < ncur; i++) { lval_del(cur[i]); }
+        if (cur && cur != bufs[0] && cur != bufs[1]) { lmem_free(cur); }
+        if (hold) { lval_del(hold); }
+
+        hold = owned;
+        cur = args;
+        ncur = n;
+        own.slots = cur;
+        own.env = f->env;
+        fr = &own;
+        x = f->fun->body;
+    }
+
+    for (int i = 0; i < ncur; i++) { lval_del(cur[i]); }
+    if (cur && cur != bufs[0] && cur != bufs[1]) { lmem_free(cur); }
+    if (hold) { lval_del(hold); }
+    return result;
+}
+
+/* Aplicar f (função ou builtin) aos argumentos de a, consumindo a */
+lval* lval_apply(lval* f, lval* a) {
+    if (f->type == LVAL_SYM) { return builtin(a, f->sym); }
+    if (f->type == LVAL_FFI) {
+        lval* x = lffi_call(f->ffi, a->cell, a->count);
+        lval_del(a);
+        return x;
+    }
+    if (f->type != LVAL_FUN) {
+        lval_del(a);
+        return lval_err("Primeiro elemento não é um operador!");
+    }
+    if (a->count != f->fun->nparams) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Número errado de argumentos: esperava %d, recebeu %d!", f->fun->nparams, a->count);
+        lval_del(a);
+        return lval_err(msg);
+    }
+
+    lframe fr = { a->cell, f->env };
+    lval* x = lval_eval_in(f->fun->body, &fr);
+    lval_del(a);
+    return x;
+}
+
+/* Compilar e avaliar uma expressão lida, consumindo-a */
+lval* lval_eval(lval* v) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_SYM) { return v; }
+    lval_compile(v, NULL);
+    lval_infer(v);
+    lval* x = lval_eval_in(v, NULL);
+    lval_del(v);
+    return x;
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+    errno = 0;
+    long x = strtol(t->contents, NULL, 10);
+    return errno != ERANGE ? lval_num(x) : lval_err("Número inválido!");
+}
+
+/* Decodificar a string literal direto no armazenamento do lval */
+lval* lval_read_str(mpc_ast_t* t) {
+    const char* s = t->contents + 1;
+    long raw = strlen(s) - 1;
+
+    long len = 0;
+    for (long i = 0; i < raw; i++, len++) {
+        if (s[i] == '\\') { i++; }
+    }
+
+    lval* v = lval_str_alloc(len);
+    char* out = lval_str_buf(v);
+    for (long i = 0; i < raw; i++) {
+        char c = s[i];
+        if (c == '\\') {
+            switch (s[++i]) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                default: c = s[i];
+            }
+        }
+        *out++ = c;
+    }
+    *out = '\0';
+    return v;
+}
+
+lval* lval_read_dbl(mpc_ast_t* t) {
+    errno = 0;
+    double x = strtod(t->contents, NULL);
+    return errno != ERANGE ? lval_dbl(x) : lval_err("Número inválido!");
+}
+
+/* Ler um vetor literal direto para o buffer, sem um lval por elemento */
+lval* lval_read_vec(mpc_ast_t* t) {
+    long n = 0;
+    int vtype = LVEC_INT;
+    for (int i = 0; i < t->children_num; i++) {
+        if (strstr(t->children[i]->tag, "decimal")) { vtype = LVEC_DBL; n++; }
+        else if (strstr(t->children[i]->tag, "number")) { n++; }
+    }
+
+    lval* v = lval_vec(vtype, n);
+    if (v->type == LVAL_ERR) { return v; }
+    long k = 0;
+    for (int i = 0; i < t->children_num; i++) {
+        mpc_ast_t* c = t->children[i];
+        if (!strstr(c->tag, "decimal") && !strstr(c->tag, "number")) { continue; }
+        if (vtype == LVEC_INT) {
+            ((int64_t*)v->vdata)[k++] = strtoll(c->contents, NULL, 10);
+        } else {
+            ((double*)v->vdata)[k++] = strtod(c->contents, NULL);
+        }
+    }
+    return v;
+}
+
+lval* lval_read_at(mpc_ast_t* t, int depth, int* deep) {
+    /* Se o simbolo ou número retorna a conversao daquele tipo */
+    if (strstr(t->tag, "vector")) { return lval_read_vec(t); }
+    if (strstr(t->tag, "decimal")) { return lval_read_dbl(t); }
+    if (strstr(t->tag, "number")) { return lval_read_num(t); }
+    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+    if (strstr(t->tag, "string")) { return lval_read_str(t); }
+
+    /* Se for root (>) ou sexpr */
+    lval* x = NULL;
+    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
+    if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
+    if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+
+    /* Aninhamento limitado, para que cópia, compilação e impressão caibam na pilha */
+    if (depth > LREAD_DEPTH) {
+        *deep = 1;
+        return x;
+    }
+
+    /* Preenchendo essas lista com qualquer expressao valida */
+    for (int i = 0; i < t->children_num && !*deep; i++) {
+        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
+        if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+        x = lval_add(x, lval_read_at(t->children[i], depth + 1, deep));
+    }
+
+    return x;
+}
+
+lval* lval_read(mpc_ast_t* t) {
+    int deep = 0;
+    lval* x = lval_read_at(t, 0, &deep);
+    if (deep) {
+        lval_del(x);
+        return lval_err("Expressão aninhada demais!");
+    }
+    return x;
+}
+
+/*
+ * Listas: {a b c} ou (list a b c). map e reduce as percorrem em ordem;
+ * pmap e preduce dividem a lista entre as threads do pool.
+ *
+ * O tamanho dos blocos se adapta ao custo medido: o primeiro elemento é
+ * avaliado na thread chamadora e cronometrado, e os blocos são escolhidos
+ * para levar uns LPAR_TARGET segundos cada, com pelo menos LPAR_SPLIT
+ * blocos por thread para equilibrar a carga.
+ *
+ * Os resultados não dependem do número de threads nem dos blocos: pmap
+ * guarda cada resultado na posição do seu elemento e, em caso de erro,
+ * devolve o erro do menor índice, como o map sequencial. preduce usa
+ * sempre a mesma árvore balanceada sobre os elementos (metades recursivas);
+ * os blocos são apenas subárvores dela, e a função deve ser associativa.
+ */
+
+#define LPAR_TARGET 1e-4
+enum { LPAR_SPLIT = 4 };
+
+double lclock_now(void) {
+#ifndef _WIN32
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Aplicar f a uma cópia de x (e de y, se houver) */
+lval* lval_apply1(lval* f, lval* x, lval* y) {
+    lval* a = lval_sexpr();
+    lval_add(a, lval_copy(x));
+    if (y) { lval_add(a, lval_copy(y)); }
+    return lval_apply(f, a);
+}
+
+lval* builtin_list(lval* a) {
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+/* Verificar (nome f lista) ou (nome f inicial lista) */
+lval* lval_map_args(lval* a, const char* name, int with_init) {
+    char msg[128];
+    int n = with_init ? 3 : 2;
+    int ok = a->count == n
+        && lval_is_fn(a->cell[0])
+        && a->cell[n - 1]->type == LVAL_QEXPR;
+    if (ok) { return NULL; }
+    snprintf(msg, sizeof(msg), with_init
+        ? "%s espera uma função, um valor inicial e uma lista!"
+        : "%s espera uma função e uma lista!", name);
+    return lval_err(msg);
+}
+
+/* Estágios de uma sequência preguiçosa, ver builtin_range */
+enum { LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE };
+
+lval* lseq_stage_add(struct lseq* s, int kind, lval* f, long n);
+lval* lseq_reduce(lval* f, lval* acc, struct lseq* s);
+
+lval* builtin_map(lval* a) {
+    /* Numa sequência, map é só mais um estágio */
+    if (a->count == 2 && a->cell[1]->type == LVAL_SEQ && lval_is_fn(a->cell[0])) {
+        lval* f = lval_pop(a, 0);
+        lval* x = lseq_stage_add(a->cell[0]->seq, LSEQ_MAP, f, 0);
+        lval_del(a);
+        return x;
+    }
+
+    lval* err = lval_map_args(a, "map", 0);
+    if (err) { lval_del(a); return err; }
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+    lval* r = lval_qexpr();
+    for (int i = 0; i < l->count; i++) {
+        lval* y = lval_apply1(f, l->cell[i], NULL);
+        if (y->type == LVAL_ERR) {
+            lval_del(r);
+            lval_del(a);
+            return y;
+        }
+        lval_add(r, y);
+    }
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_reduce(lval* a) {
+    if (a->count == 3 && a->cell[2]->type == LVAL_SEQ && lval_is_fn(a->cell[0])) {
+        lval* acc = lval_pop(a, 1);
+        lval* x = lseq_reduce(a->cell[0], acc, a->cell[1]->seq);
+        lval_del(a);
+        return x;
+    }
+
+    lval* err = lval_map_args(a, "reduce", 1);
+    if (err) { lval_del(a); return err; }
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[2];
+    lval* acc = lval_pop(a, 1);
+    for (int i = 0; i < l->count && acc->type != LVAL_ERR; i++) {
+        lval* y = lval_apply1(f, acc, l->cell[i]);
+        lval_del(acc);
+        acc = y;
+    }
+    lval_del(a);
+    return acc;
+}
+
+/* Quantos elementos por bloco, dado o custo de um elemento */
+long lpar_chunk(double cost, long n) {
+    long chunk = cost > 0 ? (long)(LPAR_TARGET / cost) : n;
+    long most = n / ((long)lpool_size() * LPAR_SPLIT);
+    if (chunk > most) { chunk = most; }
+    return chunk < 1 ? 1 : chunk;
+}
+
+typedef struct {
+    lval* f;
+    lval** items;
+    lval** out;
+    long start;
+    long chunk;
+    long n;
+
+    /* Menor índice com erro até agora; elementos depois dele não importam */
+    long first_err;
+} lpmap_job;
+
+void lpmap_task(void* ctx, int task) {
+    lpmap_job* j = ctx;
+    long lo = j->start + task * j->chunk;
+    long hi = lo + j->chunk < j->n ? lo + j->chunk : j->n;
+    for (long i = lo; i < hi; i++) {
+        if (i > __atomic_load_n(&j->first_err, __ATOMIC_RELAXED)) {
+            j->out[i] = NULL;
+            continue;
+        }
+        j->out[i] = lval_apply1(j->f, j->items[i], NULL);
+        if (j->out[i]->type == LVAL_ERR) {
+            long e = __atomic_load_n(&j->first_err, __ATOMIC_RELAXED);
+            while (i < e && !__atomic_compare_exchange_n(&j->first_err, &e, i, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+        }
+    }
+}
+
+lval* builtin_pmap(lval* a) {
+    lval* err = lval_map_args(a, "pmap", 0);
+    if (err) { lval_del(a); return err; }
+
+    lval* l = a->cell[1];
+    long n = l->count;
+    lpmap_job j = { a->cell[0], l->cell, lmem_alloc(sizeof(lval*) * (n ? n : 1)), 0, 1, n, n };
+
+    /* Cronometrar o primeiro elemento para escolher o tamanho dos blocos */
+    if (n > 0) {
+        double t = lclock_now();
+        lpmap_task(&j, 0);
+        j.start = 1;
+        j.chunk = lpar_chunk(lclock_now() - t, n - 1);
+        lpool_run((int)((n - 1 + j.chunk - 1) / j.chunk), lpmap_task, &j);
+    }
+
+    lval* r = lval_qexpr();
+    for (long i = 0; i < n; i++) {
+        if (i < j.first_err) {
+            lval_add(r, j.out[i]);
+        } else if (j.out[i]) {
+            if (i > j.first_err) { lval_del(j.out[i]); }
+        }
+    }
+    if (j.first_err < n) {
+        lval_del(r);
+        r = j.out[j.first_err];
+    }
+    lmem_free(j.out);
+    lval_del(a);
+    return r;
+}
+
+/*
+ * Árvore de redução fixa: [lo, hi) se divide em [lo, mid) e [mid, hi) com
+ * mid = lo + (hi - lo) / 2. Um erro à esquerda vence um erro à direita,
+ * então o erro devolvido é o da subárvore de menor índice que falhou.
+ * Depois que uma falha, as subárvores à direita dela param de chamar f e
+ * deixam NULL no lugar do resultado, que nunca seria usado.
+ */
+typedef struct {
+    lval* f;
+    lval** items;
+    long* lo;
+    long* hi;
+    lval** out;
+    int first_err;
+
+    /* A primeira redução da árvore, já feita ao cronometrar f */
+    long first_lo;
+    lval* first;
+} lpreduce_job;
+
+/* Início do par [lo, lo + 2) que a árvore reduz primeiro */
+long lpreduce_first(long n) {
+    long lo = 0, hi = n;
+    while (hi - lo > 2) {
+        long mid = lo + (hi - lo) / 2;
+        if (mid - lo >= 2) { hi = mid; } else { lo = mid; }
+    }
+    return lo;
+}
+
+/* Devolve a primeira redução guardada se [lo, hi) for ela */
+lval* lpreduce_cached(lpreduce_job* j, long lo, long hi) {
+    if (j->first == NULL || lo != j->first_lo || hi - lo != 2) { return NULL; }
+    lval* x = j->first;
+    j->first = NULL;
+    return x;
+}
+
+/* Uma subárvore à esquerda de task já falhou? */
+int lpreduce_cancelled(lpreduce_job* j, int task) {
+    return __atomic_load_n(&j->first_err, __ATOMIC_RELAXED) < task;
+}
+
+lval* lpreduce_tree(lpreduce_job* j, int task, long lo, long hi) {
+    if (hi - lo == 1) { return lval_copy(j->items[lo]); }
+    lval* c = lpreduce_cached(j, lo, hi);
+    if (c) { return c; }
+    long mid = lo + (hi - lo) / 2;
+    lval* x = lpreduce_tree(j, task, lo, mid);
+    if (!x || x->type == LVAL_ERR) { return x; }
+    lval* y = lpreduce_tree(j, task, mid, hi);
+    if (!y || y->type == LVAL_ERR) { lval_del(x); return y; }
+    if (lpreduce_cancelled(j, task)) {
+        lval_del(x);
+        lval_del(y);
+        return NULL;
+    }
+
+    lval* a = lval_sexpr();
+    lval_add(a, x);
+    lval_add(a, y);
+    return lval_apply(j->f, a);
+}
+
+void lpreduce_task(void* ctx, int task) {
+    lpreduce_job* j = ctx;
+    if (lpreduce_cancelled(j, task)) {
+        j->out[task] = NULL;
+        return;
+    }
+    lval* x = lpreduce_tree(j, task, j->lo[task], j->hi[task]);
+    j->out[task] = x;
+    if (x && x->type == LVAL_ERR) {
+        int e = __atomic_load_n(&j->first_err, __ATOMIC_RELAXED);
+        while (task < e && !__atomic_compare_exchange_n(&j->first_err, &e, task, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    }
+}
+
+/* Listar, em ordem, as subárvores com no máximo chunk elementos */
+void lpreduce_split(long lo, long hi, long chunk, long* los, long* his, int* n) {
+    if (hi - lo <= chunk) {
+        los[*n] = lo;
+        his[*n] = hi;
+        (*n)++;
+        return;
+    }
+    long mid = lo + (hi - lo) / 2;
+    lpreduce_split(lo, mid, chunk, los, his, n);
+    lpreduce_split(mid, hi, chunk, los, his, n);
+}
+
+/* Descartar os resultados das subárvores de [lo, hi), sem chamar f */
+void lpreduce_drop(lpreduce_job* j, long lo, long hi, long chunk, int* k) {
+    if (hi - lo <= chunk) {
+        lval* x = j->out[(*k)++];
+        if (x) { lval_del(x); }
+        return;
+    }
+    long mid = lo + (hi - lo) / 2;
+    lpreduce_drop(j, lo, mid, chunk, k);
+    lpreduce_drop(j, mid, hi, chunk, k);
+}
+
+/*
+ * Refazer os níveis de cima da árvore a partir dos resultados das
+ * subárvores. NULL só aparece à direita de um erro, que vence no fim.
+ */
+lval* lpreduce_join(lpreduce_job* j, long lo, long hi, long chunk, int* k) {
+    if (hi - lo <= chunk) { return j->out[(*k)++]; }
+    long mid = lo + (hi - lo) / 2;
+    lval* x = lpreduce_join(j, lo, mid, chunk, k);
+    if (!x || x->type == LVAL_ERR) {
+        lpreduce_drop(j, mid, hi, chunk, k);
+        return x;
+    }
+    lval* y = lpreduce_join(j, mid, hi, chunk, k);
+    if (!y || y->type == LVAL_ERR) { lval_del(x); return y; }
+
+    lval* c = lpreduce_cached(j, lo, hi);
+    if (c) {
+        lval_del(x);
+        lval_del(y);
+        return c;
+    }
+    lval* a = lval_sexpr();
+    lval_add(a, x);
+    lval_add(a, y);
+    return lval_apply(j->f, a);
+}
+
+lval* builtin_preduce(lval* a) {
+    lval* err = lval_map_args(a, "preduce", 1);
+    if (err) { lval_del(a); return err; }
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[2];
+    long n = l->count;
+    if (n == 0) { return lval_take(a, 1); }
+
+    lpreduce_job j;
+    j.f = f;
+    j.items = l->cell;
+    j.first = NULL;
+    j.first_lo = 0;
+    j.first_err = INT_MAX;
+
+    /*
+     * Cronometrar a primeira redução da própria árvore para escolher o
+     * tamanho das subárvores; o resultado é guardado e usado no lugar dela.
+     */
+    double cost = 0;
+    if (n > 1) {
+        j.first_lo = lpreduce_first(n);
+        double t = lclock_now();
+        j.first = lval_apply1(f, l->cell[j.first_lo], l->cell[j.first_lo + 1]);
+        cost = lclock_now() - t;
+
+        /* É a primeira chamada de f na ordem da árvore: o erro dela vence */
+        if (j.first->type == LVAL_ERR) {
+            lval_del(a);
+            return j.first;
+        }
+    }
+    long chunk = lpar_chunk(cost, n);
+
+    long nparts = 2 * (n / chunk + 1);
+    j.lo = lmem_alloc(sizeof(long) * nparts);
+    j.hi = lmem_alloc(sizeof(long) * nparts);
+    j.out = lmem_alloc(sizeof(lval*) * nparts);
+    int parts = 0;
+    lpreduce_split(0, n, chunk, j.lo, j.hi, &parts);
+    lpool_run(parts, lpreduce_task, &j);
+
+    int k = 0;
+    lval* x = lpreduce_join(&j, 0, n, chunk, &k);
+    if (j.first) { lval_del(j.first); }
+    lmem_free(j.lo);
+    lmem_free(j.hi);
+    lmem_free(j.out);
+
+    /* O valor inicial entra pela esquerda, como no reduce */
+    if (x->type != LVAL_ERR) {
+        lval* b = lval_sexpr();
+        lval_add(b, lval_pop(a, 1));
+        lval_add(b, x);
+        x = lval_apply(f, b);
+    }
+    lval_del(a);
+    return x;
+}
+
+/*
+ * Arquivos para leitura sequencial. Um arquivo regular é mapeado inteiro
+ * com mmap e percorrido direto na memória; pipes, a entrada padrão e o
+ * que mais não puder ser mapeado são lidos em blocos de LFILE_BUF bytes
+ * num buffer que só cresce se uma única linha não couber nele.
+ */
+enum { LFILE_BUF = 1 << 20 };
+
+typedef struct lfile {
+    int refs;
+
+    /* Mapeado: o conteúdo inteiro em data[0..len) */
+    int mapped;
+    char* data;
+    size_t len;
+
+    /* Stream: buf[start..end) ainda não foi consumido */
+    FILE* stream;
+    char* buf;
+    size_t start, end, cap;
+    int eof;
+
+    /* Uma linha não coube no orçamento ao crescer buf */
+    int full;
+
+#ifndef _WIN32
+    /* Cópias de uma sequência de linhas dividem o stream entre threads */
+    pthread_mutex_t lock;
+#endif
+} lfile;
+
+#ifndef _WIN32
+#define LFILE_LOCK(f) pthread_mutex_lock(&(f)->lock)
+#define LFILE_UNLOCK(f) pthread_mutex_unlock(&(f)->lock)
+#else
+#define LFILE_LOCK(f)
+#define LFILE_UNLOCK(f)
+#endif
+
+/* No modo batch lendo da entrada padrão, ela pertence ao leitor do pipeline */
+static int lfile_stdin_busy;
+
+/* Abrir path ("-" é a entrada padrão); NULL com errno se falhar */
+lfile* lfile_open(const char* path) {
+    FILE* stream = NULL;
+    if (strcmp(path, "-") == 0) {
+        if (lfile_stdin_busy) {
+            errno = EBUSY;
+            return NULL;
+        }
+        stream = stdin;
+    } else {
+#ifndef _WIN32
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) { return NULL; }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            lfile* f = lmem_calloc(1, sizeof(lfile));
+            f->refs = 1;
+            f->mapped = 1;
+            if (st.st_size > 0) {
+                void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p == MAP_FAILED) {
+                    int e = errno;
+                    close(fd);
+                    lmem_free(f);
+                    errno = e;
+                    return NULL;
+                }
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                f->data = p;
+                f->len = st.st_size;
+            }
+            close(fd);
+            return f;
+        }
+        stream = fdopen(fd, "rb");
+        if (!stream) { close(fd); return NULL; }
+#else
+        stream = fopen(path, "rb");
+        if (!stream) { return NULL; }
+#endif
+    }
+
+    lfile* f = lmem_calloc(1, sizeof(lfile));
+    f->refs = 1;
+    f->stream = stream;
+    f->cap = LFILE_BUF;
+    f->buf = lmem_alloc(f->cap);
+#ifndef _WIN32
+    pthread_mutex_init(&f->lock, NULL);
+#endif
+    return f;
+}
+
+/* Erro de um lfile_open que falhou */
+lval* lfile_err(void) {
+    if (errno == EBUSY && lfile_stdin_busy) {
+        return lval_err("A entrada padrão já é lida pelo modo batch!");
+    }
+    return lval_err(strerror(errno));
+}
+
+void lfile_ref(lfile* f) {
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+void lfile_release(lfile* f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+#ifndef _WIN32
+    if (f->data) { munmap(f->data, f->len); }
+#endif
+    if (f->stream && f->stream != stdin) { fclose(f->stream); }
+#ifndef _WIN32
+    if (f->stream) { pthread_mutex_destroy(&f->lock); }
+#endif
+    lmem_free(f->buf);
+    lmem_free(f);
+}
+
+/* Ler o próximo bloco do stream para o fim do buffer; 0 no fim */
+size_t lfile_fill(lfile* f) {
+    if (f->eof) { return 0; }
+    if (f->start > 0) {
+        memmove(f->buf, f->buf + f->start, f->end - f->start);
+        f->end -= f->start;
+        f->start = 0;
+    }
+    if (f->end == f->cap) {
+        char* buf = lmem_try_realloc(f->buf, f->cap * 2);
+        if (!buf) {
+            f->full = 1;
+            f->eof = 1;
+            return 0;
+        }
+        f->buf = buf;
+        f->cap *= 2;
+    }
+    size_t n = fread(f->buf + f->end, 1, f->cap - f->end, f->stream);
+    if (n == 0) { f->eof = 1; }
+    f->end += n;
+    return n;
+}
+
+/*
+ * Próxima linha, sem o '\n' (e sem um '\r' antes dele). Num arquivo
+ * mapeado a posição é *pos, então cada passada recomeça do início; um
+ * stream só pode ser consumido uma vez, e a linha fica no buffer só até a
+ * próxima leitura, então quem lê um stream segura LFILE_LOCK até copiá-la.
+ * Devolve 0 no fim, ou se uma linha não cabe no orçamento (f->full).
+ */
+int lfile_line(lfile* f, size_t* pos, const char** line, size_t* len) {
+    const char* p;
+    size_t n;
+    if (f->mapped) {
+        if (*pos >= f->len) { return 0; }
+        p = f->data + *pos;
+        const char* nl = memchr(p, '\n', f->len - *pos);
+        n = nl ? (size_t)(nl - p) : f->len - *pos;
+        *pos += n + (nl != NULL);
+    } else {
+        const char* nl;
+        while (!(nl = memchr(f->buf + f->start, '\n', f->end - f->start))) {
+            if (!lfile_fill(f)) { break; }
+        }
+        if (f->full) { return 0; }
+        if (f->start == f->end) { return 0; }
+        p = f->buf + f->start;
+        n = nl ? (size_t)(nl - p) : f->end - f->start;
+        f->start += n + (nl != NULL);
+    }
+    if (n > 0 && p[n - 1] == '\r') { n--; }
+    *line = p;
+    *len = n;
+    return 1;
+}
+
+/*
+ * Sequências preguiçosas. Uma sequência é uma fonte (range, iterate, as
+ * linhas de um arquivo ou os elementos de uma lista ou vetor) seguida de estágios map, filter e take.
+ * Aplicar um estágio a uma sequência só cria outra descrição, com a mesma
+ * fonte e um estágio a mais; nada é avaliado até um consumidor (reduce ou
+ * collect) puxar os elementos. Cada elemento atravessa todos os estágios
+ * de uma vez, então uma cadeia de operações é uma única passada e nenhuma
+ * lista intermediária é criada.
+ */
+enum { LSEQ_RANGE, LSEQ_ITERATE, LSEQ_ITEMS, LSEQ_LINES };
+typedef struct {
+    int kind;
+    lval* f;
+    long n;
+} lseq_stage;
+
+typedef struct lseq {
+    int refs;
+    int source;
+
+    /* range: inteiros, ou doubles se algum limite é double */
+    int dbl;
+    long istart, iend, istep;
+    double dstart, dend, dstep;
+
+    /* iterate: x, (f x), (f (f x)), ... ; itens: lista ou vetor */
+    lval* f;
+    lval* init;
+
+    /* linhas: o arquivo aberto */
+    lfile* file;
+
+    int nstages;
+    lseq_stage* stages;
+} lseq;
+
+void lseq_release(lseq* s) {
+    if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    if (s->f) { lval_del(s->f); }
+    if (s->init) { lval_del(s->init); }
+    if (s->file) { lfile_release(s->file); }
+    for (int i = 0; i < s->nstages; i++) {
+        if (s->stages[i].f) { lval_del(s->stages[i].f); }
+    }
+    lmem_free(s->stages);
+    lmem_free(s);
+}
+
+void lseq_ref(lseq* s) {
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+}
+
+lval* lval_seq(lseq* s) {
+    lval* v = lmem_alloc(sizeof(lval));
+    v->type = LVAL_SEQ;
+    v->seq = s;
+    return v;
+}
+
+lseq* lseq_new(int source) {
+    lseq* s = lmem_calloc(1, sizeof(lseq));
+    s->refs = 1;
+    s->source = source;
+    return s;
+}
+
+/* Nova sequência igual a s com mais um estágio; consome f */
+lval* lseq_stage_add(lseq* s, int kind, lval* f, long n) {
+    lseq* t = lseq_new(s->source);
+    *t = *s;
+    t->refs = 1;
+    if (t->f) { t->f = lval_copy(t->f); }
+    if (t->init) { t->init = lval_copy(t->init); }
+    if (t->file) { lfile_ref(t->file); }
+
+    t->nstages = s->nstages + 1;
+    t->stages = lmem_alloc(sizeof(lseq_stage) * t->nstages);
+    for (int i = 0; i < s->nstages; i++) {
+        t->stages[i] = s->stages[i];
+        if (t->stages[i].f) { t->stages[i].f = lval_copy(t->stages[i].f); }
+    }
+    t->stages[s->nstages].kind = kind;
+    t->stages[s->nstages].f = f;
+    t->stages[s->nstages].n = n;
+    return lval_seq(t);
+}
+
+/* Estado de uma passada por uma sequência */
+typedef struct {
+    lseq* s;
+    long i;
+    size_t pos;
+    lval* cur;
+    long taken_buf[8];
+    long* taken;
+} lseq_iter;
+
+void lseq_iter_init(lseq_iter* it, lseq* s) {
+    it->s = s;
+    it->i = 0;
+    it->pos = 0;
+    it->cur = s->source == LSEQ_ITERATE ? lval_copy(s->init) : NULL;
+    it->taken = s->nstages <= 8 ? it->taken_buf : lmem_alloc(sizeof(long) * s->nstages);
+    for (int k = 0; k < s->nstages; k++) { it->taken[k] = 0; }
+}
+
+void lseq_iter_free(lseq_iter* it) {
+    if (it->cur) { lval_del(it->cur); }
+    if (it->taken != it->taken_buf) { lmem_free(it->taken); }
+}
+
+/* Próximo elemento da fonte, ou NULL no fim */
+lval* lseq_source_next(lseq_iter* it) {
+    lseq* s = it->s;
+    long i = it->i++;
+
+    switch (s->source) {
+        case LSEQ_RANGE:
+            if (s->dbl) {
+                double x = s->dstart + i * s->dstep;
+                if (s->dstep > 0 ? x >= s->dend : x <= s->dend) { return NULL; }
+                return lval_dbl(x);
+            } else {
+                long x = s->istart + i * s->istep;
+                if (s->istep > 0 ? x >= s->iend : x <= s->iend) { return NULL; }
+                return lval_num(x);
+            }
+        case LSEQ_ITERATE: {
+            /* f só é aplicada quando o consumidor pede o próximo elemento */
+            if (i > 0 && it->cur->type != LVAL_ERR) {
+                lval* y = lval_apply1(s->f, it->cur, NULL);
+                lval_del(it->cur);
+                it->cur = y;
+            }
+            return lval_copy(it->cur);
+        }
+        case LSEQ_ITEMS: {
+            lval* l = s->init;
+            if (l->type == LVAL_VEC) {
+                if (i >= l->vlen) { return NULL; }
+                return l->vtype == LVEC_INT
+                    ? lval_num((long)((int64_t*)l->vdata)[i])
+                    : lval_dbl(((double*)l->vdata)[i]);
+            }
+            if (i >= l->count) { return NULL; }
+            return lval_copy(l->cell[i]);
+        }
+        case LSEQ_LINES: {
+            lfile* f = s->file;
+            const char* line;
+            size_t len;
+            lval* x;
+            if (!f->mapped) { LFILE_LOCK(f); }
+            if (!lfile_line(f, &it->pos, &line, &len)) {
+                x = f->full ? lmem_err() : NULL;
+            } else if (!lmem_admit(len + 1)) {
+                /* Num arquivo mapeado a linha não passou por buffer nenhum */
+                x = lmem_err();
+            } else {
+                x = lval_str(line, (long)len);
+            }
+            if (!f->mapped) { LFILE_UNLOCK(f); }
+            return x;
+        }
+    }
+    return NULL;
+}
+
+/* Próximo elemento depois de todos os estágios, NULL no fim ou um erro */
+lval* lseq_next(lseq_iter* it) {
+    lseq* s = it->s;
+
+    while (1) {
+        /* Ponto seguro: uma sequência infinita não pode encher a memória */
+        if (lmem_exceeded()) { return lmem_err(); }
+
+        /* Um take esgotado encerra a sequência antes de puxar mais da fonte */
+        for (int k = 0; k < s->nstages; k++) {
+            if (s->stages[k].kind == LSEQ_TAKE && it->taken[k] >= s->stages[k].n) { return NULL; }
+        }
+
+        lval* x = lseq_source_next(it);
+        if (!x || x->type == LVAL_ERR) { return x; }
+
+        int keep = 1;
+        for (int k = 0; k < s->nstages && keep; k++) {
+            lseq_stage* st = &s->stages[k];
+            if (st->kind == LSEQ_MAP) {
+                lval* y = lval_apply1(st->f, x, NULL);
+                lval_del(x);
+                x = y;
+                if (x->type == LVAL_ERR) { return x; }
+            } else if (st->kind == LSEQ_FILTER) {
+                lval* c = lval_apply1(st->f, x, NULL);
+                if (c->type == LVAL_ERR) { lval_del(x); return c; }
+                keep = lval_truthy(c);
+                lval_del(c);
+            } else {
+                it->taken[k]++;
+            }
+        }
+        if (keep) { return x; }
+        lval_del(x);
+    }
+}
+
+/* (range fim), (range início fim) ou (range início fim passo) */
+lval* builtin_range(lval* a) {
+    int ok = a->count >= 1 && a->count <= 3;
+    int dbl = 0;
+    for (int i = 0; ok && i < a->count; i++) {
+        ok = lval_is_number(a->cell[i]);
+        if (a->cell[i]->type == LVAL_DBL) { dbl = 1; }
+    }
+    if (!ok) {
+        lval_del(a);
+        return lval_err("range espera de um a três números!");
+    }
+
+    lseq* s = lseq_new(LSEQ_RANGE);
+    s->dbl = dbl;
+    lval* start = a->count > 1 ? a->cell[0] : NULL;
+    lval* end = a->count > 1 ? a->cell[1] : a->cell[0];
+    lval* step = a->count > 2 ? a->cell[2] : NULL;
+    if (dbl) {
+        s->dstart = start ? lval_as_dbl(start) : 0.0;
+        s->dend = lval_as_dbl(end);
+        s->dstep = step ? lval_as_dbl(step) : 1.0;
+    } else {
+        s->istart = start ? start->num : 0;
+        s->iend = end->num;
+        s->istep = step ? step->num : 1;
+    }
+    lval_del(a);
+
+    if (dbl ? s->dstep == 0.0 : s->istep == 0) {
+        lseq_release(s);
+        return lval_err("range espera um passo diferente de zero!");
+    }
+    return lval_seq(s);
+}
+
+/* (iterate f x): a sequência infinita x, (f x), (f (f x)), ... */
+lval* builtin_iterate(lval* a) {
+    if (a->count != 2 || !lval_is_fn(a->cell[0])) {
+        lval_del(a);
+        return lval_err("iterate espera uma função e um valor inicial!");
+    }
+    lseq* s = lseq_new(LSEQ_ITERATE);
+    s->init = lval_pop(a, 1);
+    s->f = lval_pop(a, 0);
+    lval_del(a);
+    return lval_seq(s);
+}
+
+/* (seq l): os elementos de uma lista ou vetor como sequência */
+lval* builtin_seq(lval* a) {
+    if (a->count != 1 || (a->cell[0]->type != LVAL_QEXPR && a->cell[0]->type != LVAL_VEC)) {
+        lval_del(a);
+        return lval_err("seq espera uma lista ou um vetor!");
+    }
+    lseq* s = lseq_new(LSEQ_ITEMS);
+    s->init = lval_take(a, 0);
+    return lval_seq(s);
+}
+
+/* (filter f l): lista filtrada, ou um estágio novo se l é uma sequência */
+lval* builtin_filter(lval* a) {
+    if (a->count != 2 || !lval_is_fn(a->cell[0])
+        || (a->cell[1]->type != LVAL_QEXPR && a->cell[1]->type != LVAL_SEQ)) {
+        lval_del(a);
+        return lval_err("filter espera uma função e uma lista ou sequência!");
+    }
+
+    if (a->cell[1]->type == LVAL_SEQ) {
+        lval* f = lval_pop(a, 0);
+        lval* x = lseq_stage_add(a->cell[0]->seq, LSEQ_FILTER, f, 0);
+        lval_del(a);
+        return x;
+    }
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+    lval* r = lval_qexpr();
+    for (int i = 0; i < l->count; i++) {
+        lval* c = lval_apply1(f, l->cell[i], NULL);
+        if (c->type == LVAL_ERR) {
+            lval_del(r);
+            lval_del(a);
+            return c;
+        }
+        if (lval_truthy(c)) { lval_add(r, lval_copy(l->cell[i])); }
+        lval_del(c);
+    }
+    lval_del(a);
+    return r;
+}
+
+/* (take n l): os n primeiros elementos */
+lval* builtin_take(lval* a) {
+    if (a->count != 2 || a->cell[0]->type != LVAL_NUM || a->cell[0]->num < 0
+        || (a->cell[1]->type != LVAL_QEXPR && a->cell[1]->type != LVAL_SEQ)) {
+        lval_del(a);
+        return lval_err("take espera um número e uma lista ou sequência!");
+    }
+
+    long n = a->cell[0]->num;
+    if (a->cell[1]->type == LVAL_SEQ) {
+        lval* x = lseq_stage_add(a->cell[1]->seq, LSEQ_TAKE, NULL, n);
+        lval_del(a);
+        return x;
+    }
+
+    lval* l = lval_take(a, 1);
+    while (l->count > n) { lval_del(lval_pop(l, l->count - 1)); }
+    return l;
+}
+
+/* (collect s): materializar uma sequência numa lista */
+lval* builtin_collect(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_SEQ) {
+        lval_del(a);
+        return lval_err("collect espera uma sequência!");
+    }
+
+    lseq_iter it;
+    lseq_iter_init(&it, a->cell[0]->seq);
+    lval* r = lval_qexpr();
+    lval* x;
+    while ((x = lseq_next(&it))) {
+        if (x->type == LVAL_ERR) {
+            lval_del(r);
+            r = x;
+            break;
+        }
+        lval_add(r, x);
+    }
+    lseq_iter_free(&it);
+    lval_del(a);
+    return r;
+}
+
+/* reduce sobre uma sequência: um elemento por vez, memória constante */
+lval* lseq_reduce(lval* f, lval* acc, lseq* s) {
+    lseq_iter it;
+    lseq_iter_init(&it, s);
+    lval* x;
+    while (acc->type != LVAL_ERR && (x = lseq_next(&it))) {
+        if (x->type == LVAL_ERR) {
+            lval_del(acc);
+            acc = x;
+            break;
+        }
+        lval* b = lval_sexpr();
+        lval_add(b, acc);
+        lval_add(b, x);
+        acc = lval_apply(f, b);
+    }
+    lseq_iter_free(&it);
+    return acc;
+}
+
+/* (read-lines "arquivo"): sequência preguiçosa com uma string por linha */
+lval* builtin_read_lines(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_STR) {
+        lval_del(a);
+        return lval_err("read-lines espera o caminho de um arquivo!");
+    }
+    lfile* f = lfile_open(lval_str_flat(a->cell[0]));
+    lval_del(a);
+    if (!f) { return lfile_err(); }
+
+    lseq* s = lseq_new(LSEQ_LINES);
+    s->file = f;
+    return lval_seq(s);
+}
+
+/*
+ * Leitor de inteiros em blocos: um número pode começar num bloco e
+ * terminar no seguinte, então o estado fica entre as chamadas. Qualquer
+ * caractere que não seja dígito, ou um '-' logo antes de um, separa
+ * números.
+ */
+typedef struct {
+    int64_t* data;
+    long len;
+    long cap;
+    int64_t acc;
+    int neg;
+    int in;
+    int minus;
+    int full;
+} lints;
+
+void lints_push(lints* s, int64_t x) {
+    if (s->len == s->cap) {
+        long cap = s->cap ? s->cap * 2 : 1024;
+        int64_t* d = lvec_try_alloc(cap * sizeof(int64_t));
+        if (!d) {
+            s->full = 1;
+            return;
+        }
+        if (s->data) {
+            memcpy(d, s->data, s->len * sizeof(int64_t));
+            lvec_free(s->data);
+        }
+        s->data = d;
+        s->cap = cap;
+    }
+    s->data[s->len++] = x;
+}
+
+void lints_scan(lints* s, const char* p, size_t n) {
+    const char* end = p + n;
+    while (p < end && !s->full) {
+        char c = *p;
+        if (c >= '0' && c <= '9') {
+            if (!s->in) {
+                s->in = 1;
+                s->neg = s->minus;
+                s->acc = 0;
+            }
+            /* Laço interno só com dígitos, que é onde o tempo vai */
+            uint64_t acc = (uint64_t)s->acc;
+            while (p < end && *p >= '0' && *p <= '9') {
+                acc = acc * 10 + (uint64_t)(*p++ - '0');
+            }
+            s->acc = (int64_t)acc;
+            s->minus = 0;
+            continue;
+        }
+        if (s->in) {
+            lints_push(s, s->neg ? -s->acc : s->acc);
+            s->in = 0;
+        }
+        s->minus = c == '-';
+        p++;
+    }
+}
+
+/* (read-ints "arquivo"): todos os inteiros do arquivo num vetor compacto */
+lval* builtin_read_ints(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_STR) {
+        lval_del(a);
+        return lval_err("read-ints espera o caminho de um arquivo!");
+    }
+    lfile* f = lfile_open(lval_str_flat(a->cell[0]));
+    lval_del(a);
+    if (!f) { return lfile_err(); }
+
+    lints s = {0};
+    if (f->mapped) {
+        lints_scan(&s, f->data, f->len);
+    } else {
+        while (!s.full && lfile_fill(f)) {
+            lints_scan(&s, f->buf + f->start, f->end - f->start);
+            f->start = f->end;
+        }
+    }
+    if (s.in) { lints_push(&s, s.neg ? -s.acc : s.acc); }
+    lfile_release(f);
+
+    if (s.full) {
+        if (s.data) { lvec_free(s.data); }
+        return lmem_err();
+    }
+
+    lval* v = lmem_alloc(sizeof(lval));
+    v->type = LVAL_VEC;
+    v->vtype = LVEC_INT;
+    v->vlen = s.len;
+    v->vdata = s.data ? (void*)s.data : lvec_alloc(0);
+    return v;
+}
+
+/* Escrever um elemento: strings como estão, o resto como é impresso */
+void lval_write_item(FILE* f, lval* x) {
+    if (x->type == LVAL_STR) {
+        fwrite(lval_str_flat(x), 1, x->str.len, f);
+        putc('\n', f);
+    } else {
+        lval_fprintln(f, x);
+    }
+}
+
+/*
+ * (write "arquivo" x): grava x no arquivo, substituindo o conteúdo. Uma
+ * string vai como está; vetores, listas e sequências vão um elemento por
+ * linha, e sequências são consumidas uma linha por vez, sem materializar.
+ * Devolve o número de bytes gravados.
+ */
+lval* builtin_write(lval* a) {
+    if (a->count != 2 || a->cell[0]->type != LVAL_STR) {
+        lval_del(a);
+        return lval_err("write espera o caminho de um arquivo e um valor!");
+    }
+
+    FILE* f = fopen(lval_str_flat(a->cell[0]), "wb");
+    if (!f) {
+        lval_del(a);
+        return lval_err(strerror(errno));
+    }
+    char* buf = lmem_alloc(LFILE_BUF);
+    setvbuf(f, buf, _IOFBF, LFILE_BUF);
+
+    lval* x = a->cell[1];
+    lval* err = NULL;
+    switch (x->type) {
+        case LVAL_STR:
+            fwrite(lval_str_flat(x), 1, x->str.len, f);
+        break;
+        case LVAL_VEC:
+        case LVAL_MAT:
+            for (long i = 0; i < x->vlen; i++) {
+                if (x->vtype == LVEC_INT) {
+                    fprintf(f, "%lld\n", (long long)((int64_t*)x->vdata)[i]);
+                } else {
+                    lval_fprint_dbl(f, ((double*)x->vdata)[i]);
+                    putc('\n', f);
+                }
+            }
+        break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < x->count; i++) { lval_write_item(f, x->cell[i]); }
+        break;
+        case LVAL_SEQ: {
+            lseq_iter it;
+            lseq_iter_init(&it, x->seq);
+            lval* y;
+            while ((y = lseq_next(&it))) {
+                if (y->type == LVAL_ERR) {
+                    err = y;
+                    break;
+                }
+                lval_write_item(f, y);
+                lval_del(y);
+            }
+            lseq_iter_free(&it);
+        }
+        break;
+        default:
+            lval_write_item(f, x);
+    }
+
+    long written = ftell(f);
+    int failed = ferror(f);
+    if (fclose(f) != 0) { failed = 1; }
+    lmem_free(buf);
+    lval_del(a);
+
+    if (err) { return err; }
+    if (failed) { return lval_err("Erro ao gravar o arquivo!"); }
+    return lval_num(written);
+}
+
+/*
+ * Green threads: (spawn f args...) roda f numa corrotina com pilha própria.
+ * As corrotinas são multiplexadas sobre um worker por núcleo; cada worker
+ * tem uma deque Chase-Lev, da qual ele tira trabalho pela base e os outros
+ * roubam pelo topo sem lock. Corrotinas criadas fora dos workers entram por
+ * uma fila global.
+ *
+ * Canais (chan n) têm capacidade fixa. send, recv e select bloqueiam só a
+ * corrotina, que é estacionada e volta para uma fila quando o canal muda;
+ * chamados fora de uma corrotina, bloqueiam a thread do SO numa condvar.
+ */
+
+#ifndef _WIN32
+
+enum { LGREEN_STACK = 1 << 20, LGREEN_STACK_CACHE = 64 };
+
+/* O que a corrotina pediu ao devolver o controle ao worker */
+enum { LGREEN_YIELD, LGREEN_PARK, LGREEN_DONE };
+
+/* Estado de estacionamento: o worker e quem acorda disputam essa palavra */
+enum { LPARK_RUNNING, LPARK_PARKING, LPARK_PARKED, LPARK_NOTIFIED };
+
+struct lworker;
+
+typedef struct lgreen {
+    ucontext_t ctx;
+    char* stack;
+    lval* fn;
+    lval* args;
+    int after;
+    int park;
+    struct lworker* worker;
+    struct lgreen* next;
+} lgreen;
+
+/* Vetor circular de uma deque; os antigos ficam vivos depois de crescer */
+typedef struct ldeque_array {
+    long cap;
+    lgreen** buf;
+    struct ldeque_array* prev;
+} ldeque_array;
+
+typedef struct {
+    long top;
+    long bottom;
+    ldeque_array* array;
+} ldeque;
+
+typedef struct lworker {
+    int id;
+    ldeque deque;
+    ucontext_t sched;
+} lworker;
+
+typedef struct {
+    pthread_once_t once;
+    int nworkers;
+    lworker* workers;
+
+    /* Fila global e pilhas livres, protegidas por lock */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    lgreen* head;
+    lgreen* tail;
+    char* stacks[LGREEN_STACK_CACHE];
+    int nstacks;
+
+    /* Workers dormindo e contador de trabalho novo, para não perder avisos */
+    int idle;
+    long epoch;
+} lsched;
+
+static lsched lsched_global = {
+    PTHREAD_ONCE_INIT, 0, NULL,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, NULL, {NULL}, 0, 0, 0
+};
+
+static __thread lworker* lworker_self;
+static __thread lgreen* lgreen_self;
+
+/*
+ * Uma corrotina pode continuar em outra thread depois de estacionar, então
+ * as variáveis por thread são sempre lidas por funções não inlinadas, para
+ * que o compilador não reaproveite o endereço da thread anterior.
+ */
+__attribute__((noinline)) lworker* lworker_current(void) { return lworker_self; }
+__attribute__((noinline)) lgreen* lgreen_current(void) { return lgreen_self; }
+
+ldeque_array* ldeque_array_new(long cap, ldeque_array* prev) {
+    ldeque_array* a = lmem_alloc(sizeof(ldeque_array));
+    a->cap = cap;
+    a->buf = lmem_alloc(sizeof(lgreen*) * cap);
+    a->prev = prev;
+    return a;
+}
+
+/* Só o dono empilha e desempilha pela base */
+void ldeque_push(ldeque* d, lgreen* g) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    ldeque_array* a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    if (b - t >= a->cap) {
+        ldeque_array* na = ldeque_array_new(a->cap * 2, a);
+        for (long i = t; i < b; i++) {
+            na->buf[i & (na->cap - 1)] = __atomic_load_n(&a->buf[i & (a->cap - 1)], __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&d->array, na, __ATOMIC_RELEASE);
+        a = na;
+    }
+    __atomic_store_n(&a->buf[b & (a->cap - 1)], g, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+lgreen* ldeque_pop(ldeque* d) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    ldeque_array* a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    lgreen* g = __atomic_load_n(&a->buf[b & (a->cap - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+        /* Último elemento: disputar com os ladrões */
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            g = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return g;
+}
+
+/* Qualquer thread rouba pelo topo */
+lgreen* ldeque_steal(ldeque* d) {
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) { return NULL; }
+
+    ldeque_array* a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    lgreen* g = __atomic_load_n(&a->buf[t & (a->cap - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return g;
+}
+
+/* Tornar g executável: na deque do worker atual, ou na fila global */
+void lsched_push(lgreen* g) {
+    lsched* s = &lsched_global;
+    lworker* w = lworker_current();
+    if (w) {
+        ldeque_push(&w->deque, g);
+    } else {
+        pthread_mutex_lock(&s->lock);
+        g->next = NULL;
+        if (s->tail) { s->tail->next = g; } else { s->head = g; }
+        s->tail = g;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    __atomic_add_fetch(&s->epoch, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+lgreen* lsched_find(lworker* w) {
+    lsched* s = &lsched_global;
+    lgreen* g = ldeque_pop(&w->deque);
+    if (g) { return g; }
+
+    if (__atomic_load_n(&s->head, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&s->lock);
+        g = s->head;
+        if (g) {
+            s->head = g->next;
+            if (!s->head) { s->tail = NULL; }
+        }
+        pthread_mutex_unlock(&s->lock);
+        if (g) { return g; }
+    }
+
+    for (int k = 1; k < s->nworkers; k++) {
+        g = ldeque_steal(&s->workers[(w->id + k) % s->nworkers].deque);
+        if (g) { return g; }
+    }
+    return NULL;
+}
+
+/* Devolver o controle ao worker, dizendo o que fazer com a corrotina */
+void lgreen_switch(lgreen* g, int after) {
+    g->after = after;
+    swapcontext(&g->ctx, &g->worker->sched);
+}
+
+void lgreen_entry(void) {
+    lgreen* g = lgreen_current();
+    lval* x = lval_apply(g->fn, g->args);
+    if (x->type == LVAL_ERR) {
+        fprintf(stderr, "Erro numa corrotina: %s\n", x->err);
+    }
+    lval_del(x);
+    lgreen_switch(g, LGREEN_DONE);
+}
+
+void lgreen_free(lgreen* g) {
+    lsched* s = &lsched_global;
+    lval_del(g->fn);
+    pthread_mutex_lock(&s->lock);
+    if (s->nstacks < LGREEN_STACK_CACHE) {
+        s->stacks[s->nstacks++] = g->stack;
+        g->stack = NULL;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (g->stack) { munmap(g->stack, LGREEN_STACK); }
+    lmem_free(g);
+}
+
+void* lworker_main(void* arg) {
+    lsched* s = &lsched_global;
+    lworker* w = arg;
+    lworker_self = w;
+
+    while (1) {
+        long epoch = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST);
+        lgreen* g = lsched_find(w);
+        if (!g) {
+            pthread_mutex_lock(&s->lock);
+            __atomic_add_fetch(&s->idle, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST) == epoch) {
+                pthread_cond_wait(&s->wake, &s->lock);
+            }
+            __atomic_sub_fetch(&s->idle, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&s->lock);
+            continue;
+        }
+
+        g->worker = w;
+        lgreen_self = g;
+        lstack_set(g->stack + LGREEN_STACK, LGREEN_STACK);
+        swapcontext(&w->sched, &g->ctx);
+        lstack_floor = NULL;
+        lgreen_self = NULL;
+
+        switch (g->after) {
+            case LGREEN_YIELD: ldeque_push(&w->deque, g); break;
+            case LGREEN_DONE: lgreen_free(g); break;
+            case LGREEN_PARK: {
+                /* Se alguém acordou g enquanto ele saía da pilha, ele volta à fila */
+                int expected = LPARK_PARKING;
+                if (!__atomic_compare_exchange_n(&g->park, &expected, LPARK_PARKED, 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    ldeque_push(&w->deque, g);
+                }
+            } break;
+        }
+    }
+    return NULL;
+}
+
+void lsched_start(void) {
+    lsched* s = &lsched_global;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    s->nworkers = cpus > 0 ? (int)cpus : 1;
+    s->workers = lmem_calloc(s->nworkers, sizeof(lworker));
+    for (int i = 0; i < s->nworkers; i++) {
+        s->workers[i].id = i;
+        s->workers[i].deque.array = ldeque_array_new(256, NULL);
+    }
+    for (int i = 0; i < s->nworkers; i++) {
+        pthread_t t;
+        pthread_create(&t, NULL, lworker_main, &s->workers[i]);
+        pthread_detach(t);
+    }
+}
+
+lval* builtin_spawn(lval* a) {
+    if (a->count == 0 || (a->cell[0]->type != LVAL_FUN && a->cell[0]->type != LVAL_SYM)) {
+        lval_del(a);
+        return lval_err("spawn espera uma função e seus argumentos!");
+    }
+
+    lsched* s = &lsched_global;
+    pthread_once(&s->once, lsched_start);
+
+    char* stack = NULL;
+    pthread_mutex_lock(&s->lock);
+    if (s->nstacks > 0) { stack = s->stacks[--s->nstacks]; }
+    pthread_mutex_unlock(&s->lock);
+    if (!stack) {
+        stack = mmap(NULL, LGREEN_STACK, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (stack == MAP_FAILED) {
+            lval_del(a);
+            return lval_err("spawn: sem memória para a pilha!");
+        }
+        /* Página de guarda no fim da pilha */
+        mprotect(stack, 4096, PROT_NONE);
+    }
+
+    lgreen* g = lmem_calloc(1, sizeof(lgreen));
+    g->stack = stack;
+    g->fn = lval_pop(a, 0);
+    g->args = a;
+    getcontext(&g->ctx);
+    g->ctx.uc_stack.ss_sp = stack;
+    g->ctx.uc_stack.ss_size = LGREEN_STACK;
+    g->ctx.uc_link = NULL;
+    makecontext(&g->ctx, lgreen_entry, 0);
+
+    lsched_push(g);
+    return lval_sexpr();
+}
+
+/*
+ * Quem espera num canal. Corrotinas estacionam; threads do SO dormem na
+ * condvar do próprio lwaiter. O lwaiter fica na pilha de quem espera, então
+ * quem acorda faz isso ainda com o lock do canal, e quem espera sempre passa
+ * pelo lock de cada canal antes de sair.
+ */
+typedef struct {
+    lgreen* g;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int woken;
+} lwaiter;
+
+typedef struct lwait_node {
+    lwaiter* w;
+    int linked;
+    struct lwait_node* prev;
+    struct lwait_node* next;
+} lwait_node;
+
+typedef struct lchan {
+    int refs;
+    pthread_mutex_t lock;
+    long cap;
+    long head;
+    long count;
+    lval** buf;
+
+    /* Listas de quem espera por espaço e por valores */
+    lwait_node* senders;
+    lwait_node* receivers;
+} lchan;
+
+void lchan_ref(lchan* c) {
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+}
+
+void lchan_release(lchan* c) {
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    for (long i = 0; i < c->count; i++) {
+        lval_del(c->buf[(c->head + i) % c->cap]);
+    }
+    pthread_mutex_destroy(&c->lock);
+    lmem_free(c->buf);
+    lmem_free(c);
+}
+
+void lwaiter_init(lwaiter* w) {
+    w->g = lgreen_current();
+    w->woken = 0;
+    if (!w->g) {
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+    }
+}
+
+void lwaiter_destroy(lwaiter* w) {
+    if (!w->g) {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+    }
+}
+
+/* Preparar a espera; deve vir antes de o lwaiter ficar visível num canal */
+void lwaiter_arm(lwaiter* w) {
+    if (w->g) {
+        __atomic_store_n(&w->g->park, LPARK_PARKING, __ATOMIC_RELEASE);
+    } else {
+        w->woken = 0;
+    }
+}
+
+/* Acordar w; chamado com o lock do canal */
+void lwaiter_wake(lwaiter* w) {
+    if (w->g) {
+        if (__atomic_exchange_n(&w->g->park, LPARK_NOTIFIED, __ATOMIC_ACQ_REL) == LPARK_PARKED) {
+            lsched_push(w->g);
+        }
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->woken = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void lwaiter_wait(lwaiter* w) {
+    if (w->g) {
+        lgreen_switch(w->g, LGREEN_PARK);
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    while (!w->woken) { pthread_cond_wait(&w->cond, &w->lock); }
+    pthread_mutex_unlock(&w->lock);
+}
+
+void lwait_link(lwait_node** list, lwait_node* n) {
+    n->linked = 1;
+    n->prev = NULL;
+    n->next = *list;
+    if (*list) { (*list)->prev = n; }
+    *list = n;
+}
+
+void lwait_unlink(lwait_node** list, lwait_node* n) {
+    if (!n->linked) { return; }
+    if (n->prev) { n->prev->next = n->next; } else { *list = n->next; }
+    if (n->next) { n->next->prev = n->prev; }
+    n->linked = 0;
+}
+
+/* Acordar um da lista, tirando-o dela */
+void lwait_wake_one(lwait_node** list) {
+    lwait_node* n = *list;
+    if (!n) { return; }
+    lwait_unlink(list, n);
+    lwaiter_wake(n->w);
+}
+
+/*
+ * Depois de qualquer mudança num canal: se há valores e alguém esperando
+ * por eles, ou espaço e alguém querendo enviar, acordar um. Assim nenhum
+ * valor fica parado enquanto um receptor dorme.
+ */
+void lchan_kick(lchan* c) {
+    if (c->count > 0) { lwait_wake_one(&c->receivers); }
+    if (c->count < c->cap) { lwait_wake_one(&c->senders); }
+}
+
+/* Tentar tirar um valor; NULL se o canal está vazio. Com o lock do canal. */
+lval* lchan_take(lchan* c) {
+    if (c->count == 0) { return NULL; }
+    lval* v = c->buf[c->head];
+    c->head = (c->head + 1) % c->cap;
+    c->count--;
+    lchan_kick(c);
+    return v;
+}
+
+void lchan_send(lchan* c, lval* v) {
+    lwaiter w;
+    lwait_node n = { &w, 0, NULL, NULL };
+    lwaiter_init(&w);
+
+    while (1) {
+        pthread_mutex_lock(&c->lock);
+        lwait_unlink(&c->senders, &n);
+        if (c->count < c->cap) {
+            c->buf[(c->head + c->count) % c->cap] = v;
+            c->count++;
+            lchan_kick(c);
+            pthread_mutex_unlock(&c->lock);
+            break;
+        }
+        lwaiter_arm(&w);
+        lwait_link(&c->senders, &n);
+        pthread_mutex_unlock(&c->lock);
+        lwaiter_wait(&w);
+    }
+    lwaiter_destroy(&w);
+}
+
+/* Receber do primeiro canal de cs que tiver valor; *which diz qual */
+lval* lchan_recv(lchan** cs, int nc, int* which) {
+    lwaiter w;
+    lwait_node stack_nodes[8];
+    lwait_node* nodes = nc <= 8 ? stack_nodes : lmem_alloc(sizeof(lwait_node) * nc);
+    for (int i = 0; i < nc; i++) {
+        nodes[i].w = &w;
+        nodes[i].linked = 0;
+    }
+    lwaiter_init(&w);
+
+    lval* v = NULL;
+    while (!v) {
+        /* Sair das listas de espera da rodada anterior */
+        for (int i = 0; i < nc; i++) {
+            pthread_mutex_lock(&cs[i]->lock);
+            lwait_unlink(&cs[i]->receivers, &nodes[i]);
+            pthread_mutex_unlock(&cs[i]->lock);
+        }
+
+        for (int i = 0; i < nc && !v; i++) {
+            pthread_mutex_lock(&cs[i]->lock);
+            v = lchan_take(cs[i]);
+            pthread_mutex_unlock(&cs[i]->lock);
+            *which = i;
+        }
+        if (v) { break; }
+
+        /* Registrar em todos e conferir de novo antes de dormir */
+        lwaiter_arm(&w);
+        for (int i = 0; i < nc && !v; i++) {
+            pthread_mutex_lock(&cs[i]->lock);
+            v = lchan_take(cs[i]);
+            if (!v) { lwait_link(&cs[i]->receivers, &nodes[i]); }
+            pthread_mutex_unlock(&cs[i]->lock);
+            *which = i;
+        }
+        if (!v) { lwaiter_wait(&w); }
+    }
+
+    /* Deixar os outros canais limpos e passar adiante avisos que não usamos */
+    for (int i = 0; i < nc; i++) {
+        pthread_mutex_lock(&cs[i]->lock);
+        lwait_unlink(&cs[i]->receivers, &nodes[i]);
+        lchan_kick(cs[i]);
+        pthread_mutex_unlock(&cs[i]->lock);
+    }
+    if (nodes != stack_nodes) { lmem_free(nodes); }
+    lwaiter_destroy(&w);
+    return v;
+}
+
+lval* builtin_chan(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_NUM || a->cell[0]->num < 1) {
+        lval_del(a);
+        return lval_err("chan espera uma capacidade maior que zero!");
+    }
+
+    lchan* c = lmem_calloc(1, sizeof(lchan));
+    c->refs = 1;
+    pthread_mutex_init(&c->lock, NULL);
+    c->cap = a->cell[0]->num;
+    c->buf = lmem_alloc(sizeof(lval*) * c->cap);
+    lval_del(a);
+
+    lval* v = lmem_alloc(sizeof(lval));
+    v->type = LVAL_CHAN;
+    v->chan = c;
+    return v;
+}
+
+lval* builtin_send(lval* a) {
+    if (a->count != 2 || a->cell[0]->type != LVAL_CHAN) {
+        lval_del(a);
+        return lval_err("send espera um canal e um valor!");
+    }
+    lval* v = lval_pop(a, 1);
+    lchan_send(a->cell[0]->chan, v);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_recv(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_CHAN) {
+        lval_del(a);
+        return lval_err("recv espera um canal!");
+    }
+    int which;
+    lval* v = lchan_recv(&a->cell[0]->chan, 1, &which);
+    lval_del(a);
+    return v;
+}
+
+/* select devolve (índice valor) do primeiro canal com valor */
+lval* builtin_select(lval* a) {
+    if (a->count == 0 || !lval_all_of(a, LVAL_CHAN)) {
+        lval_del(a);
+        return lval_err("select espera um ou mais canais!");
+    }
+
+    lchan* stack_cs[8];
+    lchan** cs = a->count <= 8 ? stack_cs : lmem_alloc(sizeof(lchan*) * a->count);
+    for (int i = 0; i < a->count; i++) { cs[i] = a->cell[i]->chan; }
+
+    int which;
+    lval* v = lchan_recv(cs, a->count, &which);
+    if (cs != stack_cs) { lmem_free(cs); }
+    lval_del(a);
+
+    lval* r = lval_sexpr();
+    lval_add(r, lval_num(which));
+    lval_add(r, v);
+    return r;
+}
+
+#else
+
+void lchan_ref(struct lchan* c) { (void)c; }
+void lchan_release(struct lchan* c) { (void)c; }
+
+lval* lgreen_unsupported(lval* a) {
+    lval_del(a);
+    return lval_err("Green threads não são suportadas no Windows!");
+}
+
+lval* builtin_spawn(lval* a) { return lgreen_unsupported(a); }
+lval* builtin_chan(lval* a) { return lgreen_unsupported(a); }
+lval* builtin_send(lval* a) { return lgreen_unsupported(a); }
+lval* builtin_recv(lval* a) { return lgreen_unsupported(a); }
+lval* builtin_select(lval* a) { return lgreen_unsupported(a); }
+
+#endif
+
+/*
+ * Módulos: (load "arquivo") avalia todas as expressões de um arquivo. As
+ * formas lidas são guardadas num cache binário ao lado do fonte
+ * (arquivo.cache). Quando tamanho e mtime do fonte batem com o cabeçalho,
+ * o cache é mapeado e decodificado direto em lvals, sem passar pelo mpc.
+ * Se só o mtime mudou, o hash FNV-1a do conteúdo decide se o cache serve.
+ */
+enum { LMOD_VERSION = 1 };
+
+/* Tags do cache; fixas, independentes da ordem de LVAL_* */
+enum { LMOD_NUM = 1, LMOD_DBL, LMOD_SYM, LMOD_STR, LMOD_VEC_INT, LMOD_VEC_DBL, LMOD_SEXPR, LMOD_QEXPR };
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint64_t hash;
+} lmod_header;
+
+static mpc_parser_t* circe_parser;
+
+#if defined(_WIN32)
+#define LMOD_MTIME_NSEC(st) 0
+#elif defined(__APPLE__)
+#define LMOD_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define LMOD_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+uint64_t lmod_hash(const char* s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+void lmod_put(FILE* f, int tag, const void* data, size_t len) {
+    unsigned char t = (unsigned char)tag;
+    fwrite(&t, 1, 1, f);
+    fwrite(data, 1, len, f);
+}
+
+/*
+ * Gravar uma forma no cache; 0 se ela contém um erro de leitura. Um erro
+ * pode ser passageiro (orçamento de memória), então a forma não é gravada
+ * e o arquivo é lido de novo no próximo load.
+ */
+int lmod_write(FILE* f, lval* v) {
+    uint64_t n;
+    switch (v->type) {
+        case LVAL_ERR: return 0;
+        case LVAL_NUM: {
+            int64_t x = v->num;
+            lmod_put(f, LMOD_NUM, &x, 8);
+        } break;
+        case LVAL_DBL: lmod_put(f, LMOD_DBL, &v->dbl, 8); break;
+        case LVAL_SYM:
+            n = strlen(v->sym);
+            lmod_put(f, LMOD_SYM, &n, 8);
+            fwrite(v->sym, 1, n, f);
+        break;
+        case LVAL_STR:
+            n = v->str.len;
+            lmod_put(f, LMOD_STR, &n, 8);
+            fwrite(lval_str_flat(v), 1, n, f);
+        break;
+        case LVAL_VEC:
+            n = v->vlen;
+            lmod_put(f, v->vtype == LVEC_INT ? LMOD_VEC_INT : LMOD_VEC_DBL, &n, 8);
+            fwrite(v->vdata, 8, n, f);
+        break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            n = v->count;
+            lmod_put(f, v->type == LVAL_SEXPR ? LMOD_SEXPR : LMOD_QEXPR, &n, 8);
+            for (int i = 0; i < v->count; i++) {
+                if (!lmod_write(f, v->cell[i])) { return 0; }
+            }
+        break;
+    }
+    return 1;
+}
+
+/* Ler len bytes do cache; 0 se o cache acabou antes */
+int lmod_get(const char** p, const char* end, void* dst, size_t len) {
+    if ((size_t)(end - *p) < len) { return 0; }
+    memcpy(dst, *p, len);
+    *p += len;
+    return 1;
+}
+
+/* Decodificar uma forma do cache; NULL se o cache está corrompido */
+lval* lmod_read(const char** p, const char* end) {
+    unsigned char tag;
+    uint64_t n;
+    if (!lmod_get(p, end, &tag, 1) || !lmod_get(p, end, &n, 8)) { return NULL; }
+
+    switch (tag) {
+        case LMOD_NUM: return lval_num((long)(int64_t)n);
+        case LMOD_DBL: {
+            double d;
+            memcpy(&d, &n, 8);
+            return lval_dbl(d);
+        }
+        case LMOD_SYM: {
+            if ((uint64_t)(end - *p) < n) { return NULL; }
+            lval* v = lval_sym("");
+            v->sym = lmem_realloc(v->sym, n + 1);
+            memcpy(v->sym, *p, n);
+            v->sym[n] = '\0';
+            *p += n;
+            return v;
+        }
+        case LMOD_STR: {
+            if ((uint64_t)(end - *p) < n) { return NULL; }
+            lval* v = lval_str(*p, (long)n);
+            *p += n;
+            return v;
+        }
+        case LMOD_VEC_INT:
+        case LMOD_VEC_DBL: {
+            if ((uint64_t)(end - *p) / 8 < n) { return NULL; }
+            lval* v = lval_vec(tag == LMOD_VEC_INT ? LVEC_INT : LVEC_DBL, (long)n);
+            if (v->type == LVAL_ERR) { return v; }
+            memcpy(v->vdata, *p, n * 8);
+            *p += n * 8;
+            return v;
+        }
+        case LMOD_SEXPR:
+        case LMOD_QEXPR: {
+            lval* v = tag == LMOD_SEXPR ? lval_sexpr() : lval_qexpr();
+            for (uint64_t i = 0; i < n; i++) {
+                lval* x = lmod_read(p, end);
+                if (!x) { lval_del(v); return NULL; }
+                lval_add(v, x);
             }
-            x->num /= y->num;
+            return v;
+        }
+    }
+    return NULL;
+}
+
+/* Conteúdo de um arquivo, mapeado quando possível */
+typedef struct {
+    char* data;
+    size_t len;
+    int mapped;
+} lmod_file;
+
+int lmod_map(const char* path, lmod_file* m) {
+    m->data = NULL;
+    m->len = 0;
+    m->mapped = 0;
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return 0; }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            m->data = p;
+            m->len = st.st_size;
+            m->mapped = 1;
         }
+    }
+    close(fd);
+    return m->mapped;
+#else
+    FILE* f = fopen(path, "rb");
+    if (!f) { return 0; }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    m->data = lmem_alloc(len > 0 ? len : 1);
+    m->len = fread(m->data, 1, len > 0 ? len : 0, f);
+    fclose(f);
+    return 1;
+#endif
+}
 
-        lval_del(y);
+void lmod_unmap(lmod_file* m) {
+#ifndef _WIN32
+    if (m->mapped) { munmap(m->data, m->len); }
+#else
+    lmem_free(m->data);
+#endif
+}
+
+/* Decodificar as formas do cache se o cabeçalho aceita o fonte */
+lval* lmod_decode(lmod_file* c, uint64_t size, uint64_t hash, int check_hash) {
+    lmod_header h;
+    if (c->len < sizeof(h)) { return NULL; }
+    memcpy(&h, c->data, sizeof(h));
+    if (memcmp(h.magic, "CIRC", 4) != 0 || h.version != LMOD_VERSION || h.size != size) { return NULL; }
+    if (check_hash && h.hash != hash) { return NULL; }
+
+    const char* p = c->data + sizeof(h);
+    lval* forms = lmod_read(&p, c->data + c->len);
+    if (forms && (forms->type != LVAL_SEXPR || p != c->data + c->len)) {
+        lval_del(forms);
+        forms = NULL;
+    }
+    return forms;
+}
+
+/* Gravar o cache num arquivo temporário e renomear por cima do antigo */
+void lmod_save(const char* cache, struct stat* st, uint64_t hash, lval* forms) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", cache, (long)getpid());
+    FILE* f = fopen(tmp, "wb");
+    if (!f) { return; }
+
+    lmod_header h;
+    memcpy(h.magic, "CIRC", 4);
+    h.version = LMOD_VERSION;
+    h.size = st->st_size;
+    h.mtime = st->st_mtime;
+    h.mtime_nsec = LMOD_MTIME_NSEC(*st);
+    h.hash = hash;
+    fwrite(&h, sizeof(h), 1, f);
+    int ok = lmod_write(f, forms);
+
+    if (fclose(f) != 0 || !ok) { remove(tmp); return; }
+#ifdef _WIN32
+    remove(cache);
+#endif
+    if (rename(tmp, cache) != 0) { remove(tmp); }
+}
+
+/* Formas lidas de path, do cache ou do parser; em caso de falha, um erro */
+lval* lmod_forms(const char* path) {
+    char msg[512];
+    char cache[4096];
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        snprintf(msg, sizeof(msg), "load: não foi possível abrir '%s'!", path);
+        return lval_err(msg);
+    }
+    snprintf(cache, sizeof(cache), "%s.cache", path);
+
+    /* Caminho rápido: tamanho e mtime iguais, nem o fonte é lido */
+    lmod_file c;
+    int have_cache = lmod_map(cache, &c);
+    if (have_cache && c.len >= sizeof(lmod_header)) {
+        lmod_header h;
+        memcpy(&h, c.data, sizeof(h));
+        if (h.mtime == (int64_t)st.st_mtime && h.mtime_nsec == (int64_t)LMOD_MTIME_NSEC(st)) {
+            lval* forms = lmod_decode(&c, st.st_size, 0, 0);
+            if (forms) { lmod_unmap(&c); return forms; }
+        }
+    }
+
+    lmod_file src;
+    if (!lmod_map(path, &src) && st.st_size > 0) {
+        if (have_cache) { lmod_unmap(&c); }
+        snprintf(msg, sizeof(msg), "load: não foi possível ler '%s'!", path);
+        return lval_err(msg);
+    }
+    uint64_t hash = lmod_hash(src.data, src.len);
+
+    /* mtime mudou mas o conteúdo não: reaproveitar o cache */
+    lval* forms = have_cache ? lmod_decode(&c, src.len, hash, 1) : NULL;
+    if (have_cache) { lmod_unmap(&c); }
+
+    if (!forms) {
+        /* O parse lê direto do mapeamento, sem copiar o fonte */
+        mpc_result_t r;
+        if (!lmem_admit(src.len * LPARSE_COST)) {
+            lmod_unmap(&src);
+            return lmem_err();
+        }
+        if (!mpc_nparse_borrowed(path, src.data, src.len, circe_parser, &r)) {
+            char* e = mpc_err_string(r.error);
+            lval* err = lval_err(e);
+            lmem_free(e);
+            mpc_err_delete(r.error);
+            lmod_unmap(&src);
+            return err;
+        }
+        forms = lval_read(r.output);
+        mpc_ast_delete(r.output);
+    }
+    lmod_unmap(&src);
+
+    lmod_save(cache, &st, hash, forms);
+    return forms;
+}
+
+lval* builtin_load(lval* a) {
+    if (a->count != 1 || a->cell[0]->type != LVAL_STR) {
+        lval_del(a);
+        return lval_err("load espera o caminho de um arquivo!");
     }
 
+    lval* forms = lmod_forms(lval_str_flat(a->cell[0]));
     lval_del(a);
+    if (forms->type == LVAL_ERR) { return forms; }
+
+    /* Avaliar as expressões em ordem, parando no primeiro erro */
+    lval* x = lval_sexpr();
+    for (int i = 0; i < forms->count && x->type != LVAL_ERR; i++) {
+        lval_del(x);
+        lval_compile(forms->cell[i], NULL);
+        lval_infer(forms->cell[i]);
+        x = lval_eval_in(forms->cell[i], NULL);
+    }
+    lval_del(forms);
+    if (x->type != LVAL_ERR) {
+        lval_del(x);
+        x = lval_sexpr();
+    }
     return x;
-}   
+}
 
-lval* lval_eval(lval* v);
+/* Fazer parse e avaliar uma linha de entrada, escrevendo o resultado em f */
+void circe_eval_line(mpc_parser_t* p, const char* name, const char* input, FILE* f) {
+    mpc_result_t r;
+    if (!lmem_admit(strlen(input) * LPARSE_COST)) {
+        lval* e = lmem_err();
+        lval_fprintln(f, e);
+        lval_del(e);
+        return;
+    }
+    if (mpc_parse(name, input, p, &r)) {
+        /* Uma entrada que já estourou o orçamento no parse nem é lida */
+        if (lmem_exceeded()) {
+            mpc_ast_delete(r.output);
+            lval* e = lmem_err();
+            lval_fprintln(f, e);
+            lval_del(e);
+            return;
+        }
+        lval* x = lval_read(r.output);
 
-lval* lval_eval_sexpr(lval* v) {
-    /* Avaliando todas as células */
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(v->cell[i]);
+        /* Uma linha com uma expressão só é essa expressão: "f" não chama f */
+        if (x->type == LVAL_SEXPR && x->count == 1) { x = lval_take(x, 0); }
+        x = lval_eval(x);
+        lval_fprintln(f, x);
+        lval_del(x);
+        mpc_ast_delete(r.output);
+    } else {
+        mpc_err_print_to(r.error, f);
+        mpc_err_delete(r.error);
     }
+}
 
-    /* Verificando por erros */
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) {
-            return lval_take(v, i);
+#ifndef _WIN32
+
+/*
+ * Modo batch: um pipeline de três estágios para arquivos com muitas
+ * expressões independentes.
+ *
+ *   leitor   -> separa a entrada em registros (uma linha, ou várias enquanto
+ *               houver parênteses abertos) e os agrupa em lotes;
+ *   workers  -> cada um faz parse, avalia e imprime um lote inteiro num
+ *               buffer próprio, compartilhando os parsers mpc só para leitura;
+ *   escritor -> emite os buffers na mesma ordem da entrada.
+ *
+ * Os registros andam em lotes para que exista um lock por lote e não por
+ * expressão, e no máximo LBATCH_WINDOW lotes ficam em voo ao mesmo tempo.
+ *
+ * Um lote que pode mudar as variáveis globais é uma barreira: ele só começa
+ * quando todos os lotes anteriores terminaram e nenhum lote posterior começa
+ * antes dele terminar. A decisão é tomada quando o lote chega à frente da
+ * fila, com as globais exatamente como a execução sequencial as deixaria:
+ * um símbolo do lote muda as globais se é def, load ou heap-limit, ou se o
+ * valor global dele (corpo de função, capturas, listas, sequências) contém
+ * um símbolo assim. Então (f) vira barreira quando f chama def por dentro,
+ * por mais indireta que seja a chamada. O leitor ainda separa registros que
+ * escrevem def ou load diretamente, só para não levar o resto do lote junto.
+ */
+
+enum { LBATCH_RECORDS = 512, LBATCH_BYTES = 1 << 16, LBATCH_WINDOW = 64 };
+
+typedef struct lbatch {
+    long seq;
+    int count;
+    int barrier;
+    int checked;
+
+    /* Registros do lote, cada um terminado por '\0' */
+    char* text;
+    size_t len;
+    size_t cap;
+
+    /* Saída do lote, na ordem dos registros */
+    char* out;
+    size_t out_len;
+
+    struct lbatch* next;
+} lbatch;
+
+typedef struct {
+    FILE* in;
+    FILE* out;
+    const char* name;
+    mpc_parser_t* parser;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_cond_t space;
+
+    /* Fila de lotes esperando por um worker */
+    lbatch* head;
+    lbatch* tail;
+
+    /* Lotes prontos, indexados por seq % LBATCH_WINDOW */
+    lbatch* ready[LBATCH_WINDOW];
+    long next_in;
+    long next_out;
+    int closed;
+
+    /* Lotes sendo avaliados, e se um deles é uma barreira */
+    int running;
+    int exclusive;
+
+    /* Contador das varreduras de lbatch_mutates */
+    unsigned long mark;
+} lpipeline;
+
+lbatch* lbatch_new(void) {
+    lbatch* b = lmem_calloc(1, sizeof(lbatch));
+    b->cap = LBATCH_BYTES + LBATCH_BYTES / 2;
+    b->text = lmem_alloc(b->cap);
+    return b;
+}
+
+/* Entregar um lote aos workers, esperando se a janela estiver cheia */
+void lpipeline_submit(lpipeline* pl, lbatch* b) {
+    pthread_mutex_lock(&pl->lock);
+    while (pl->next_in - pl->next_out >= LBATCH_WINDOW) {
+        pthread_cond_wait(&pl->space, &pl->lock);
+    }
+    b->seq = pl->next_in++;
+    if (pl->tail) { pl->tail->next = b; } else { pl->head = b; }
+    pl->tail = b;
+    pthread_cond_signal(&pl->work);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+/* Builtins e formas que mudam o estado global do interpretador */
+int lsym_mutator(const char* s, size_t n) {
+    static const char* names[] = {"def", "load", "heap-limit"};
+    for (int k = 0; k < 3; k++) {
+        if (strlen(names[k]) == n && strncmp(s, names[k], n) == 0) { return 1; }
+    }
+    return 0;
+}
+
+int lsym_mutates(const char* s, size_t n, unsigned long mark);
+
+/* Verificar se avaliar v pode chegar a um símbolo que muda as globais */
+int lval_mutates(lval* v, unsigned long mark) {
+    switch (v->type) {
+        case LVAL_SYM: return lsym_mutates(v->sym, strlen(v->sym), mark);
+        case LVAL_FUN:
+            if (lval_mutates(v->fun->body, mark)) { return 1; }
+            for (int i = 0; v->env && i < v->fun->ncaptures; i++) {
+                if (lval_mutates(v->env[i], mark)) { return 1; }
+            }
+            return 0;
+        case LVAL_SEQ:
+            /* Puxar linhas de um stream consome uma posição compartilhada */
+            if (v->seq->file && !v->seq->file->mapped) { return 1; }
+            if (v->seq->f && lval_mutates(v->seq->f, mark)) { return 1; }
+            if (v->seq->init && lval_mutates(v->seq->init, mark)) { return 1; }
+            for (int i = 0; i < v->seq->nstages; i++) {
+                if (v->seq->stages[i].f && lval_mutates(v->seq->stages[i].f, mark)) { return 1; }
+            }
+            return 0;
+        /* O que vai passar por um canal não se sabe antes de avaliar */
+        case LVAL_CHAN: return 1;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                if (lval_mutates(v->cell[i], mark)) { return 1; }
+            }
+            return 0;
+    }
+    return 0;
+}
+
+/*
+ * Um símbolo muda as globais se é um dos nomes fixos ou se o valor global
+ * dele muda. mark == 0 olha só os nomes fixos; senão cada célula é visitada
+ * uma vez por varredura, o que também corta a recursão de funções.
+ */
+int lsym_mutates(const char* s, size_t n, unsigned long mark) {
+    if (lsym_mutator(s, n)) { return 1; }
+    if (mark == 0) { return 0; }
+    lglobal* g = lglobal_find(s, n);
+    if (!g || g->mark == mark) { return 0; }
+    g->mark = mark;
+    return g->val && lval_mutates(g->val, mark);
+}
+
+/* Verificar os símbolos do texto de um registro, fora das strings */
+int lrecord_mutates(const char* s, size_t len, unsigned long mark) {
+    size_t i = 0;
+    while (i < len) {
+        if (s[i] == '"') {
+            for (i++; i < len && s[i] != '"'; i++) {
+                if (s[i] == '\\') { i++; }
+            }
+            i++;
+            continue;
         }
+        size_t j = i;
+        while (j < len && s[j] && ((s[j] >= 'a' && s[j] <= 'z') || (s[j] >= 'A' && s[j] <= 'Z')
+            || (s[j] >= '0' && s[j] <= '9') || strchr("_+-*/\\=<>!&", s[j]))) { j++; }
+        if (j == i) { i++; continue; }
+        if (lsym_mutates(s + i, j - i, mark)) { return 1; }
+        i = j;
     }
+    return 0;
+}
 
-    /* Se a expressão está vazia, retornar ela */
-    if (v->count == 0) {
-        return v;
+/* Verificar os registros de b contra as globais atuais */
+int lbatch_mutates(lbatch* b, unsigned long mark) {
+    char* record = b->text;
+    for (int i = 0; i < b->count; i++) {
+        size_t n = strlen(record);
+        if (lrecord_mutates(record, n, mark)) { return 1; }
+        record += n + 1;
     }
+    return 0;
+}
 
-    /* Se a expressão tem apenas um elemento, retornar esse elemento */
-    if (v->count == 1) {
-        return lval_take(v, 0);
+/*
+ * O último registro de b, a partir de start, escreve def ou load: entregar
+ * os registros anteriores e depois ele sozinho num lote de barreira.
+ */
+lbatch* lpipeline_barrier(lpipeline* pl, lbatch* b, size_t start) {
+    if (b->count > 1) {
+        lbatch* d = lbatch_new();
+        size_t len = b->len - start;
+        if (len > d->cap) {
+            d->cap = len;
+            d->text = lmem_realloc(d->text, d->cap);
+        }
+        memcpy(d->text, b->text + start, len);
+        d->len = len;
+        d->count = 1;
+        b->len = start;
+        b->count--;
+        lpipeline_submit(pl, b);
+        b = d;
     }
+    b->barrier = 1;
+    lpipeline_submit(pl, b);
+    return lbatch_new();
+}
 
-    /* Garantir que o primeiro elemento é um símbolo */
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_SYM) {
-        lval_del(f);
-        lval_del(v);
-        return lval_err("Primeiro elemento não é um operador!");
+void* lpipeline_reader(void* arg) {
+    lpipeline* pl = arg;
+    lbatch* b = lbatch_new();
+    char chunk[1 << 16];
+    size_t n;
+
+    /* Início do registro atual dentro de b->text e estado do registro */
+    size_t start = 0;
+    int refused = 0;
+    int depth = 0;
+    int blank = 1;
+    int in_str = 0;
+    int escaped = 0;
+
+    while ((n = fread(chunk, 1, sizeof(chunk), pl->in)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            char c = chunk[i];
+
+            /*
+             * Um registro que não cabe no orçamento é descartado enquanto é
+             * lido e vira um registro vazio, que o worker responde com o
+             * erro de memória.
+             */
+            if (refused) { b->len = start; }
+            if (b->len + 1 >= b->cap) {
+                char* text = lmem_try_realloc(b->text, b->cap * 2);
+                if (text) {
+                    b->text = text;
+                    b->cap *= 2;
+                } else {
+                    refused = 1;
+                    b->len = start;
+                }
+            }
+
+            /* Parênteses e quebras de linha dentro de strings não contam */
+            if (in_str) {
+                b->text[b->len++] = c;
+                if (escaped) { escaped = 0; }
+                else if (c == '\\') { escaped = 1; }
+                else if (c == '"') { in_str = 0; }
+                continue;
+            }
+
+            if (c != '\n') {
+                b->text[b->len++] = c;
+                if (c == '(' || c == '[' || c == '{') { depth++; }
+                if (c == ')' || c == ']' || c == '}') { depth--; }
+                if (c == '"') { in_str = 1; }
+                if (c != ' ' && c != '\t' && c != '\r') { blank = 0; }
+                continue;
+            }
+
+            /* Parênteses abertos: o registro continua na próxima linha */
+            if (depth > 0) {
+                b->text[b->len++] = '\n';
+                continue;
+            }
+
+            /* Linhas em branco não geram saída */
+            if (blank) {
+                b->len = start;
+            } else {
+                if (refused) { b->len = start; }
+                b->text[b->len++] = '\0';
+                b->count++;
+                if (lrecord_mutates(b->text + start, b->len - start, 0)) {
+                    b = lpipeline_barrier(pl, b, start);
+                }
+                start = b->len;
+            }
+            depth = 0;
+            blank = 1;
+            refused = 0;
+
+            if (b->count == LBATCH_RECORDS || b->len >= LBATCH_BYTES) {
+                lpipeline_submit(pl, b);
+                b = lbatch_new();
+                start = 0;
+            }
+        }
     }
 
-    /* Aplicar o operador */
-    lval* result = builtin_op(v, f->sym);
-    lval_del(f);
-    return result;
+    /* Último registro sem nova linha no fim */
+    if (!blank) {
+        if (refused) { b->len = start; }
+        b->text[b->len++] = '\0';
+        b->count++;
+        if (lrecord_mutates(b->text + start, b->len - start, 0)) {
+            b = lpipeline_barrier(pl, b, start);
+        }
+    }
+
+    if (b->count > 0) {
+        lpipeline_submit(pl, b);
+    } else {
+        lmem_free(b->text);
+        lmem_free(b);
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    pl->closed = 1;
+    pthread_cond_broadcast(&pl->work);
+    pthread_cond_broadcast(&pl->done);
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
 }
 
-lval* lval_eval(lval* v) {
-    /* Se o lval é uma expressão S */
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(v);
+void* lpipeline_worker(void* arg) {
+    lpipeline* pl = arg;
+    lstack_enter(LTHREAD_STACK);
+
+    while (1) {
+        pthread_mutex_lock(&pl->lock);
+        lbatch* b;
+        while (1) {
+            b = pl->head;
+            if (!b && pl->closed) {
+                pthread_mutex_unlock(&pl->lock);
+                return NULL;
+            }
+            if (b && !pl->exclusive) {
+                /* Os lotes que rodam agora não mudam as globais: é seguro olhar */
+                if (!b->checked) {
+                    b->checked = 1;
+                    if (!b->barrier && lbatch_mutates(b, ++pl->mark)) { b->barrier = 1; }
+                }
+                if (!b->barrier || pl->running == 0) { break; }
+            }
+            pthread_cond_wait(&pl->work, &pl->lock);
+        }
+        pl->head = b->next;
+        if (!pl->head) { pl->tail = NULL; }
+        pl->running++;
+        if (b->barrier) { pl->exclusive = 1; }
+        pthread_mutex_unlock(&pl->lock);
+
+        /* Avaliar o lote inteiro fora do lock */
+        FILE* f = open_memstream(&b->out, &b->out_len);
+        char* record = b->text;
+        for (int i = 0; i < b->count; i++) {
+            if (*record) {
+                circe_eval_line(pl->parser, pl->name, record, f);
+            } else {
+                lval* e = lmem_err();
+                lval_fprintln(f, e);
+                lval_del(e);
+            }
+            record += strlen(record) + 1;
+        }
+        fclose(f);
+        lmem_free(b->text);
+        b->text = NULL;
+
+        pthread_mutex_lock(&pl->lock);
+        pl->running--;
+        if (b->barrier) { pl->exclusive = 0; }
+        pl->ready[b->seq % LBATCH_WINDOW] = b;
+        pthread_cond_broadcast(&pl->done);
+        pthread_cond_broadcast(&pl->work);
+        pthread_mutex_unlock(&pl->lock);
     }
-    /* Senão, retornar o próprio lval */
-    return v;
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
-    errno = 0;
-    long x = strtol(t->contents, 10, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("Número inválido!");
+void* lpipeline_writer(void* arg) {
+    lpipeline* pl = arg;
+
+    while (1) {
+        pthread_mutex_lock(&pl->lock);
+        while (!pl->ready[pl->next_out % LBATCH_WINDOW]
+            && !(pl->closed && pl->next_out == pl->next_in)) {
+            pthread_cond_wait(&pl->done, &pl->lock);
+        }
+        lbatch* b = pl->ready[pl->next_out % LBATCH_WINDOW];
+        if (!b) {
+            pthread_mutex_unlock(&pl->lock);
+            return NULL;
+        }
+        pl->ready[pl->next_out % LBATCH_WINDOW] = NULL;
+        pl->next_out++;
+        pthread_cond_signal(&pl->space);
+        pthread_mutex_unlock(&pl->lock);
+
+        fwrite(b->out, 1, b->out_len, pl->out);
+        free(b->out); /* alocado pela libc em open_memstream */
+        lmem_free(b);
+    }
 }
 
-lval* lval_read(mpc_ast_t* t){
-    /* Se o simbolo ou número retorna a conversao daquele tipo */
-    if (strstr(t->tag, "number")) { return lval_read_num(t); }
-    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+/* Avaliar todas as expressões de in usando workers threads */
+void lpipeline_run(mpc_parser_t* p, const char* name, FILE* in, int workers) {
+    lpipeline pl;
+    memset(&pl, 0, sizeof(pl));
+    pl.in = in;
+    pl.out = stdout;
+    pl.name = name;
+    pl.parser = p;
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.work, NULL);
+    pthread_cond_init(&pl.done, NULL);
+    pthread_cond_init(&pl.space, NULL);
 
-    /* Se for root (>) ou sexpr */
-    lval* x = NULL;
-    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-    if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
+    /* Os registros não podem ler a entrada padrão de que o leitor tira os registros */
+    lfile_stdin_busy = in == stdin;
 
-    /* Preenchendo essas lista com qualquer expressao valida */
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-        if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-        x = lval_add(x, lval_read(t->children[i]));     
+    pthread_t reader, writer;
+    pthread_t* pool = lmem_alloc(sizeof(pthread_t) * workers);
+
+    pthread_create(&reader, NULL, lpipeline_reader, &pl);
+    pthread_create(&writer, NULL, lpipeline_writer, &pl);
+    for (int i = 0; i < workers; i++) {
+        lthread_create(&pool[i], lpipeline_worker, &pl);
+    }
+
+    pthread_join(reader, NULL);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(pool[i], NULL);
     }
+    pthread_join(writer, NULL);
+    fflush(pl.out);
+    lfile_stdin_busy = 0;
+
+    lmem_free(pool);
+    pthread_mutex_destroy(&pl.lock);
+    pthread_cond_destroy(&pl.work);
+    pthread_cond_destroy(&pl.done);
+    pthread_cond_destroy(&pl.space);
 }
 
+#endif
+
 int main(int argc, char** argv) {
 
+    /* Fundo da pilha da thread principal, para a guarda do avaliador */
+    lstack_enter(lstack_main_size());
+
+    /* Orçamento de memória: CIRCE_HEAP, ou -m na linha de comando */
+    lmem_init();
+    mpc_set_allocator(lmem_alloc, lmem_calloc, lmem_realloc, lmem_free);
+    const char* heap = getenv("CIRCE_HEAP");
+    if (heap && lmem_parse_size(heap) >= 0) { lmem_budget = (size_t)lmem_parse_size(heap); }
+
     /* Criando parsers */
+    mpc_parser_t* Decimal = mpc_new("decimal");
     mpc_parser_t* Number = mpc_new("number");
-    mpc_parser_t* Operator = mpc_new("symbol");
+    mpc_parser_t* Symbol = mpc_new("symbol");
+    mpc_parser_t* String = mpc_new("string");
+    mpc_parser_t* Vector = mpc_new("vector");
     mpc_parser_t* Sexpr = mpc_new("sexpr");
+    mpc_parser_t* Qexpr = mpc_new("qexpr");
     mpc_parser_t* Expr = mpc_new("expr");
     mpc_parser_t* Circe = mpc_new("circe");
 
@@ -282,37 +5961,89 @@ int main(int argc, char** argv) {
     /* Definindo a gramática */
     mpca_lang(MPCA_LANG_DEFAULT,
         "                                                     \
+            decimal  : /-?[0-9]+\\.[0-9]+/ ;                  \
             number   : /-?[0-9]+/ ;                           \
-            operator : '+' | '-' | '*' | '/' ;                \
-            expr     : <number> | <symbol> | <sexpr> ;\
-            circe    : /^/ <expr>* /$/ ;           \
+            symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;       \
+            string   : /\"(\\\\.|[^\"])*\"/ ;                   \
+            vector   : '[' (<decimal> | <number>)* ']' ;      \
+            sexpr    : '(' <expr>* ')' ;                      \
+            qexpr    : '{' <expr>* '}' ;                      \
+            expr     : <decimal> | <number> | <symbol>        \
+                     | <string> | <vector> | <sexpr>          \
+                     | <qexpr> ;                              \
+            circe    : /^/ <expr>* /$/ ;                      \
         ",
-        Number, Symbol, Sexpr, Expr, Circe);
+        Decimal, Number, Symbol, String, Vector, Sexpr, Qexpr, Expr, Circe);
+
+    /* Compilando a gramática para o programa plano do mpc */
+    mpc_compile(Circe);
+
+    lvec_init();
+    circe_parser = Circe;
+
+#ifndef _WIN32
+    /*
+     * Com arquivos na linha de comando, ou com a entrada vinda de um pipe,
+     * avaliar tudo em modo batch: circe [-j workers] [-m bytes] [arquivo ...]
+     */
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    while (first + 1 < argc) {
+        if (strcmp(argv[first], "-j") == 0) {
+            workers = atoi(argv[first + 1]);
+        } else if (strcmp(argv[first], "-m") == 0) {
+            long long n = lmem_parse_size(argv[first + 1]);
+            if (n < 0) {
+                fprintf(stderr, "Erro: tamanho inválido '%s'\n", argv[first + 1]);
+                return 1;
+            }
+            lmem_budget = (size_t)n;
+        } else {
+            break;
+        }
+        first += 2;
+    }
+    if (workers < 1) { workers = 1; }
+
+    if (first < argc || !isatty(STDIN_FILENO)) {
+        int status = 0;
+        if (first == argc) {
+            lpipeline_run(Circe, "<stdin>", stdin, workers);
+        }
+        for (int i = first; i < argc; i++) {
+            FILE* f = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "rb");
+            if (!f) {
+                fprintf(stderr, "Erro: não foi possível abrir '%s'\n", argv[i]);
+                status = 1;
+                continue;
+            }
+            lpipeline_run(Circe, argv[i], f, workers);
+            if (f != stdin) { fclose(f); }
+        }
+        mpc_cleanup(9, Decimal, Number, Symbol, String, Vector, Sexpr, Qexpr, Expr, Circe);
+        return status;
+    }
+#else
+    (void)argc;
+    (void)argv;
+#endif
 
     puts("Circe Version 0.0.0.0.5");
     puts("Press Ctrl+c to Exit\n");
 
     while (1) {
         char* input = readline("Circe> ");
+        if (!input) { break; }
         add_history(input);
 
-        mpc_result_t r;
-        if (mpc_parse("<stdin>", input, Circe, &r)) {
-            lval* x = lval_eval(lval_read(r.output));
-            lval_println(x);
-            lval_del(x);
-            mpc_ast_delete(r.output);
-        }else {
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
-        }
+        circe_eval_line(Circe, "<stdin>", input, stdout);
 
         /* Liberando a memória alocada para a entrada */
-        free(input);
+        free(input); /* alocado pela libc ou pelo readline do Windows */
     }
     
     /* Liberando e deletando parsers */
-    mpc_cleanup(4, Number, Operator, Expr, Circe);
+    mpc_cleanup(9, Decimal, Number, Symbol, String, Vector, Sexpr, Qexpr, Expr, Circe);
 
     return 0;
 }
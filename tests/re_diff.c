@@ -0,0 +1,203 @@
+/*
+** Differential test of compiled regular expressions.
+**
+**   re_diff [cases] [rng-seed]
+**
+** Generates random regular expressions and inputs, matches
+** each pair with mpc_re_mode interpreted and compiled (from
+** a string and from a pipe) in all four modes, and reports
+** every pair where the match or error message differs.
+**
+** Nullable expressions are never repeated with * or +, since
+** both the interpreter and the compiled program loop forever
+** on those. A case that still takes too long is printed and
+** ends the run.
+*/
+
+#include "../mpc.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <unistd.h>
+#define RE_HAVE_ALARM 1
+#else
+#define RE_HAVE_ALARM 0
+#endif
+
+static unsigned long rng_state = 1;
+
+/* xorshift32, in an unsigned long of any width */
+static unsigned long rng(void) {
+  rng_state ^= (rng_state << 13) & 0xFFFFFFFFUL;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= (rng_state << 5) & 0xFFFFFFFFUL;
+  return rng_state & 0x7FFFFFFFUL;
+}
+
+static double rnd(void) { return (double)rng() / 2147483648.0; }
+
+static char re[4096];
+static char in[512];
+static int mode;
+
+#if RE_HAVE_ALARM
+static void timeout(int sig) {
+  char msg[sizeof(re) + sizeof(in) + 64];
+  int n = sprintf(msg, "TIMEOUT mode %d /%s/ '%s'\n", mode, re, in);
+  (void)sig;
+  if (write(2, msg, n) < 0) {}
+  _exit(3);
+}
+#endif
+
+static const char *atoms[] = {
+  "a", "b", "c", "[ab]", "[^a]", "[a-c]", ".", "\\d", "\\w", "\\s",
+  "x", "-", "[0-9]", "\\.", NULL };
+
+static const char *input_chars[] = {
+  "a", "b", "c", "x", "-", "0", " ", "9", ".", "\n", "\xc3\xa9", "a", "a", "b", NULL };
+
+static int count(const char **xs) { int n = 0; while (xs[n]) { n++; } return n; }
+
+/* A random expression of at most 4 nesting levels into out; returns if nullable */
+static int re_gen(char *out, int depth) {
+
+  char x[4096], y[4096];
+  int nl, n1, n2, single, len;
+  double r = rnd(), q;
+
+  /* single: out is one atom or group, so a suffix applies to all of it */
+  if (depth > 3 || r < 0.35) {
+    strcpy(out, atoms[rng() % count(atoms)]);
+    nl = 0;
+    single = 1;
+  } else if (r < 0.55) {
+    nl = re_gen(x, depth + 1);
+    sprintf(out, "(%s)", x);
+    single = 1;
+  } else if (r < 0.7) {
+    n1 = re_gen(x, depth + 1);
+    n2 = re_gen(y, depth + 1);
+    sprintf(out, "(%s|%s)", x, y);
+    nl = n1 || n2;
+    single = 1;
+  } else {
+    n1 = re_gen(x, depth + 1);
+    n2 = re_gen(y, depth + 1);
+    sprintf(out, "%s%s", x, y);
+    nl = n1 && n2;
+    single = 0;
+  }
+
+  q = rnd();
+  if (nl && q < 0.3) { q = 0.35; }
+
+  if (q < 0.45 && !single) {
+    len = (int)strlen(out);
+    memmove(out + 1, out, len + 1);
+    out[0] = '(';
+    out[len+1] = ')';
+    out[len+2] = '\0';
+  }
+
+  if      (q < 0.15) { strcat(out, "*"); nl = 1; }
+  else if (q < 0.3)  { strcat(out, "+"); }
+  else if (q < 0.4)  { strcat(out, "?"); nl = 1; }
+  else if (q < 0.45) { sprintf(out + strlen(out), "{%d}", 1 + (int)(rng() % 3)); }
+
+  return nl;
+}
+
+static char *match_string(int ok, mpc_result_t *r) {
+  char *s, *e;
+  if (ok) {
+    s = malloc(strlen(r->output) + 5);
+    sprintf(s, "OK[%s]", (char*)r->output);
+    free(r->output);
+  } else {
+    e = mpc_err_string(r->error);
+    s = malloc(strlen(e) + 6);
+    sprintf(s, "ERR[%s]", e);
+    free(e);
+    mpc_err_delete(r->error);
+  }
+  return s;
+}
+
+static char *match_pipe(mpc_parser_t *p) {
+  mpc_result_t r;
+  int ok;
+  FILE *f = tmpfile();
+  fputs(in, f);
+  rewind(f);
+  ok = mpc_parse_pipe("input", f, p, &r);
+  fclose(f);
+  return match_string(ok, &r);
+}
+
+int main(int argc, char **argv) {
+
+  mpc_parser_t *p, *c;
+  mpc_result_t r;
+  char *x, *y, *z, *t;
+  int k, j, n, cases, bad = 0;
+
+  cases = argc > 1 ? atoi(argv[1]) : 20000;
+  rng_state = argc > 2 ? strtoul(argv[2], NULL, 10) | 1 : 1;
+
+#if RE_HAVE_ALARM
+  signal(SIGALRM, timeout);
+#endif
+
+  for (k = 0; k < cases; k++) {
+
+    re_gen(re, 0);
+    if (rnd() < 0.1) { memmove(re + 1, re, strlen(re) + 1); re[0] = '^'; }
+    if (rnd() < 0.1) { strcat(re, "$"); }
+    if (rnd() < 0.1) { strcat(re, "|"); re_gen(re + strlen(re), 0); }
+
+    /* Some inputs long enough for the vector scans of the compiled program */
+    in[0] = '\0';
+    n = rnd() < 0.25 ? 32 + (int)(rng() % 96) : (int)(rng() % 13);
+    for (j = 0; j < n; j++) {
+      t = (char*)input_chars[rng() % count(input_chars)];
+      strcat(in, strcmp(t, "\n") == 0 ? " " : t);
+    }
+
+    j = (int)(rng() % 5);
+    mode = j < 2 ? MPC_RE_DEFAULT : j - 1;
+
+#if RE_HAVE_ALARM
+    alarm(5);
+#endif
+
+    p = mpc_re_mode(re, mode);
+    c = mpc_re_mode(re, mode);
+    mpc_compile(c);
+
+    x = match_string(mpc_parse("input", in, p, &r), &r);
+    y = match_string(mpc_parse("input", in, c, &r), &r);
+    z = match_pipe(c);
+
+#if RE_HAVE_ALARM
+    alarm(0);
+#endif
+
+    if (strcmp(x, y) != 0 || strcmp(x, z) != 0) {
+      bad++;
+      if (bad <= 10) {
+        printf("DIFF mode %d /%s/ '%s'\n  interpreted    %s\n  compiled       %s\n  compiled, pipe %s\n",
+          mode, re, in, x, y, z);
+      }
+    }
+
+    free(x);
+    free(y);
+    free(z);
+    mpc_delete(p);
+    mpc_delete(c);
+  }
+
+  printf("regex: %d cases, %d diffs\n", cases, bad);
+  return bad > 0;
+}
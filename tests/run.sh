@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# Differential tests of the compiled mpc parser program against the
+# interpreter, and stack limits of the circe interpreter. Run from
+# anywhere; CC, CFLAGS and CIRCE_LIBS (the readline library) are
+# honoured, e.g.
+#
+#   CFLAGS="-O1 -g -fsanitize=address,undefined" tests/run.sh
+#
+# The compiled program picks its character class scan by CPU, so run this
+# on machines with and without AVX2 to cover every scan.
+
+set -e
+
+cd "$(dirname "$0")"
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+CIRCE_LIBS=${CIRCE_LIBS--ledit}
+OUT=${TMPDIR:-/tmp}/mpc-tests.$$
+mkdir -p "$OUT"
+trap 'rm -rf "$OUT"' EXIT
+
+# mpc itself stays warning-free as C89; the grammars here need C99 string lengths
+$CC $CFLAGS -std=c89 -pedantic -Wall -Werror -c -o "$OUT/mpc.o" ../mpc.c
+$CC $CFLAGS -std=c99 -pedantic -Wall -o "$OUT/vm_diff" vm_diff.c "$OUT/mpc.o" -lm
+$CC $CFLAGS -std=c99 -pedantic -Wall -o "$OUT/re_diff" re_diff.c "$OUT/mpc.o" -lm
+$CC $CFLAGS -std=c99 -Wall -o "$OUT/circe" ../parsing.c "$OUT/mpc.o" $CIRCE_LIBS -lpthread -lm -ldl
+
+# Memoised rule nested 4000 deep: ((..(1+2)+2..)+2)
+awk 'BEGIN { d = 4000; s = ""; for (i = 0; i < d; i++) s = s "(";
+  s = s "1+2"; for (i = 0; i < d; i++) s = s (i < d - 1 ? ")+2" : ")"); print s }' > "$OUT/deep.txt"
+
+# Nested 20000 deep: ((..(+ 1 2)..))
+awk 'BEGIN { d = 20000; s = ""; for (i = 0; i < d; i++) s = s "(";
+  s = s "+ 1 2"; for (i = 0; i < d; i++) s = s ")"; print s }' > "$OUT/nest.txt"
+
+# Recursion far deeper than any C stack
+printf '%s\n' '(def down (lambda (n) (if (== n 0) 0 (+ 1 (down (- n 1))))))' \
+  '(down 10000000)' > "$OUT/down.txt"
+
+# circe <expected last line> <name> <args>: deep input is an error, not a crash
+circe() {
+  want=$1 name=$2
+  shift 2
+  got=$("$OUT/circe" "$@" 2>&1 | tail -n 1)
+  if [ "$got" = "$want" ]; then
+    echo "circe $name: ok"
+  else
+    echo "circe $name: expected '$want', got '$got'"
+    status=1
+  fi
+}
+
+status=0
+circe "Error: Expressão aninhada demais!" "nesting" "$OUT/nest.txt"
+circe "Error: Expressão aninhada demais!" "nesting, batch" -j 1 "$OUT/nest.txt"
+circe "Error: Profundidade máxima de recursão excedida!" "recursion" "$OUT/down.txt"
+circe "Error: Profundidade máxima de recursão excedida!" "recursion, batch" -j 2 "$OUT/down.txt"
+"$OUT/vm_diff" circe data/circe.txt 1000 || status=1
+"$OUT/vm_diff" c data/c.txt 1000 || status=1
+"$OUT/vm_diff" expr data/expr.txt 1000 || status=1
+"$OUT/vm_diff" expr "$OUT/deep.txt" 0 || status=1
+"$OUT/re_diff" 20000 || status=1
+
+exit $status
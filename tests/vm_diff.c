@@ -0,0 +1,208 @@
+/*
+** Differential test of the compiled parser program.
+**
+**   vm_diff <grammar> <seed-file> [cases] [rng-seed]
+**
+** Parses the seed file and then `cases` mutations of it (a
+** random prefix with a few random characters inserted) with
+** the grammar interpreted, compiled, and compiled reading
+** from a pipe, and reports every input where the printed AST
+** or error message differs. Grammars: circe, c, expr.
+*/
+
+#include "../mpc.h"
+
+static unsigned long rng_state = 1;
+
+/* xorshift32, in an unsigned long of any width */
+static unsigned long rng(void) {
+  rng_state ^= (rng_state << 13) & 0xFFFFFFFFUL;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= (rng_state << 5) & 0xFFFFFFFFUL;
+  return rng_state & 0x7FFFFFFFUL;
+}
+
+static char *result_string(int ok, mpc_result_t *r) {
+
+  FILE *f;
+  long n;
+  char *s;
+
+  if (!ok) {
+    s = mpc_err_string(r->error);
+    mpc_err_delete(r->error);
+    return s;
+  }
+
+  f = tmpfile();
+  mpc_ast_print_to(r->output, f);
+  mpc_ast_delete(r->output);
+  n = ftell(f);
+  rewind(f);
+  s = malloc(n + 1);
+  n = (long)fread(s, 1, n, f);
+  s[n] = '\0';
+  fclose(f);
+  return s;
+}
+
+static char *run_string(mpc_parser_t *p, const char *in) {
+  mpc_result_t r;
+  int ok = mpc_parse("input", in, p, &r);
+  return result_string(ok, &r);
+}
+
+static char *run_pipe(mpc_parser_t *p, const char *in) {
+  mpc_result_t r;
+  int ok;
+  FILE *f = tmpfile();
+  fputs(in, f);
+  rewind(f);
+  ok = mpc_parse_pipe("input", f, p, &r);
+  fclose(f);
+  return result_string(ok, &r);
+}
+
+static const char *grammar_circe =
+  " decimal : /-?[0-9]+\\.[0-9]+/ ;                      "
+  " number  : /-?[0-9]+/ ;                               "
+  " symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;          "
+  " string  : /\"(\\\\.|[^\"])*\"/ ;                      "
+  " vector  : '[' (<decimal> | <number>)* ']' ;          "
+  " sexpr   : '(' <expr>* ')' ;                          "
+  " qexpr   : '{' <expr>* '}' ;                          "
+  " expr    : <decimal> | <number> | <symbol>            "
+  "         | <string> | <vector> | <sexpr> | <qexpr> ;  "
+  " circe   : /^/ <expr>* /$/ ;                          ";
+
+static const char *grammar_c =
+  " kw : \"if\" | \"while\" | \"return\" | \"int\" ;                         "
+  " id \"identifier\" : /[a-z_][a-z0-9_]*/ ;                                 "
+  " num : /0x[0-9a-f]+/ | /[0-9]+/ ;                                         "
+  " str : /'[^']*'/ ;                                                        "
+  " term : <num> | <str> | '(' <expr> ')'                                    "
+  "      | <id> '(' (<expr> (',' <expr>)*)? ')' | <id> ;                     "
+  " expr : <term> (('+' | '-' | '*' | \"==\" | '<') <term>)* ;               "
+  " stmt : \"if\" '(' <expr> ')' <stmt> (\"else\" <stmt>)?                   "
+  "      | \"while\" '(' <expr> ')' <stmt> | '{' <stmt>* '}'                 "
+  "      | \"return\" <expr>? ';' | \"int\" <id> ('=' <expr>)? ';'           "
+  "      | <expr> ';' | ';' ;                                                "
+  " prog : /^/ <stmt>* /$/ ;                                                 ";
+
+static const char *grammar_expr =
+  " e @memo : <t> '+' <e> | <t> '-' <e> | <t> ; "
+  " t : /[0-9]+/ | '(' <e> ')' ;                ";
+
+static const char *names_circe[] = {
+  "decimal", "number", "symbol", "string", "vector",
+  "sexpr", "qexpr", "expr", "circe", NULL };
+static const char *names_c[] = {
+  "kw", "id", "num", "str", "term", "expr", "stmt", "prog", NULL };
+static const char *names_expr[] = { "t", "e", NULL };
+
+static const char *alphabet_circe = "()[]{}\"\\ab1.-+ \n9x";
+static const char *alphabet_c = "(){};,=+-*<'x1 \nifwhilereturn0xg";
+static const char *alphabet_expr = "()+-12 ";
+
+/* The parsers of a grammar, at most 9, last one the start rule */
+static int grammar_new(const char *g, const char **names, mpc_parser_t **ps, int n) {
+
+  int k;
+  mpc_err_t *err;
+
+  for (k = 0; k < 9; k++) { ps[k] = k < n ? mpc_new(names[k]) : NULL; }
+
+  err = mpca_lang(MPCA_LANG_DEFAULT, g,
+    ps[0], ps[1], ps[2], ps[3], ps[4], ps[5], ps[6], ps[7], ps[8], NULL);
+  if (err != NULL) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char **argv) {
+
+  const char *g, *alphabet;
+  const char **names;
+  mpc_parser_t *a[9], *b[9];
+  int n, k, j, cases, bad = 0;
+  long len, m, ins;
+  char *seed, *in;
+  char *x, *y, *z;
+  FILE *f;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s circe|c|expr seed-file [cases] [rng-seed]\n", argv[0]);
+    return 2;
+  }
+
+  if      (strcmp(argv[1], "circe") == 0) { g = grammar_circe; names = names_circe; alphabet = alphabet_circe; }
+  else if (strcmp(argv[1], "c")     == 0) { g = grammar_c;     names = names_c;     alphabet = alphabet_c; }
+  else if (strcmp(argv[1], "expr")  == 0) { g = grammar_expr;  names = names_expr;  alphabet = alphabet_expr; }
+  else { fprintf(stderr, "unknown grammar '%s'\n", argv[1]); return 2; }
+
+  cases = argc > 3 ? atoi(argv[3]) : 300;
+  rng_state = argc > 4 ? strtoul(argv[4], NULL, 10) | 1 : 1;
+
+  f = fopen(argv[2], "rb");
+  if (f == NULL) { perror(argv[2]); return 2; }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  rewind(f);
+  seed = malloc(len + 1);
+  len = (long)fread(seed, 1, len, f);
+  seed[len] = '\0';
+  fclose(f);
+
+  for (n = 0; names[n]; n++);
+  if (!grammar_new(g, names, a, n) || !grammar_new(g, names, b, n)) { return 2; }
+  mpc_compile(b[n-1]);
+
+  in = malloc(len + 8);
+
+  for (k = 0; k <= cases; k++) {
+
+    /* Case 0 is the seed itself */
+    if (k == 0) {
+      strcpy(in, seed);
+    } else {
+      m = len > 0 ? 1 + (long)(rng() % (unsigned long)len) : 0;
+      memcpy(in, seed, m);
+      in[m] = '\0';
+      for (j = (int)(rng() % 4); j >= 0; j--) {
+        ins = (long)(rng() % (unsigned long)(m + 1));
+        memmove(in + ins + 1, in + ins, m - ins + 1);
+        in[ins] = alphabet[rng() % strlen(alphabet)];
+        m++;
+        if (m >= len + 7) { break; }
+      }
+    }
+
+    x = run_string(a[n-1], in);
+    y = run_string(b[n-1], in);
+    z = run_pipe(b[n-1], in);
+
+    if (strcmp(x, y) != 0 || strcmp(x, z) != 0) {
+      bad++;
+      if (bad <= 5) {
+        printf("DIFF %s case %d\n--- input\n%s\n--- interpreted\n%s\n--- compiled\n%s\n--- compiled, pipe\n%s\n",
+          argv[1], k, in, x, y, z);
+      }
+    }
+
+    free(x);
+    free(y);
+    free(z);
+  }
+
+  printf("%s: %d cases, %d diffs\n", argv[1], cases + 1, bad);
+
+  for (k = 0; k < n; k++) { mpc_undefine(a[k]); mpc_undefine(b[k]); }
+  for (k = 0; k < n; k++) { mpc_delete(a[k]); mpc_delete(b[k]); }
+  free(seed);
+  free(in);
+
+  return bad > 0;
+}